@@ -0,0 +1,113 @@
+/* 
+ * Copyright (C) 2002 Laird Breyer
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA.
+ * 
+ * Author:   Laird Breyer <laird@lbreyer.com>
+ */
+
+/* 
+ * This program is used by "make bench" to measure a single dbacl run.
+ *
+ * bcheck [-i FILE] COMMAND [ARG]...
+ *
+ * The command is run with its standard input read from FILE (default
+ * /dev/null) and its standard output discarded. When it exits, one
+ * line is printed with the elapsed, user and system times in seconds,
+ * the peak resident set size in kilobytes, and the exit status.
+ * dbacl exits with the index of the best category, so the status
+ * is reported rather than treated as a failure.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#if defined HAVE_UNISTD_H
+#include <unistd.h> 
+#endif
+
+static double seconds(struct timeval *tv) {
+  return (double)tv->tv_sec + (double)tv->tv_usec / 1000000.0;
+}
+
+int main(int argc, char **argv) {
+  struct timeval start, stop;
+  struct rusage ru;
+  const char *input = "/dev/null";
+  long maxrss;
+  pid_t pid;
+  int i, fd, status;
+
+  i = 1;
+  if( (argc > 2) && !strcmp(argv[i], "-i") ) {
+    input = argv[i + 1];
+    i += 2;
+  }
+  if( i >= argc ) {
+    fprintf(stderr, "usage: bcheck [-i FILE] COMMAND [ARG]...\n");
+    exit(1);
+  }
+
+  gettimeofday(&start, NULL);
+  pid = fork();
+  if( pid == -1 ) { 
+    perror("bcheck");
+    exit(1); 
+  } else if( pid == 0 ) {
+    fd = open(input, O_RDONLY);
+    if( (fd == -1) || (dup2(fd, 0) == -1) ) { _exit(127); }
+    close(fd);
+    fd = open("/dev/null", O_WRONLY);
+    if( (fd == -1) || (dup2(fd, 1) == -1) ) { _exit(127); }
+    close(fd);
+    execv(argv[i], argv + i);
+    _exit(127);
+  }
+
+  if( waitpid(pid, &status, 0) != pid ) {
+    perror("bcheck");
+    exit(1);
+  }
+  gettimeofday(&stop, NULL);
+
+  /* we only ever have one child, so the totals are that child's */
+  getrusage(RUSAGE_CHILDREN, &ru);
+  maxrss = ru.ru_maxrss;
+#if defined __APPLE__
+  /* darwin reports bytes, everybody else kilobytes */
+  maxrss /= 1024;
+#endif
+
+  if( !WIFEXITED(status) || (WEXITSTATUS(status) == 127) ) {
+    fprintf(stderr, "bcheck: %s did not run to completion\n", argv[i]);
+    exit(1);
+  }
+
+  fprintf(stdout, "%.3f\t%.3f\t%.3f\t%ld\t%d\n",
+	  seconds(&stop) - seconds(&start),
+	  seconds(&ru.ru_utime), seconds(&ru.ru_stime),
+	  maxrss, WEXITSTATUS(status));
+  exit(0);
+}
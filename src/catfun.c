@@ -24,7 +24,13 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <math.h>
+#include <sys/stat.h>
+
+#if defined HAVE_UNISTD_H
+#include <unistd.h> 
+#endif
 
 #include "util.h"
 #include "dbacl.h"
@@ -33,11 +39,14 @@ extern options_t m_options;
 extern charparser_t m_cp; 
 extern options_t u_options; 
 
-extern empirical_t empirical;
-
 extern category_t cat[MAX_CAT];
 extern category_count_t cat_count;
 
+extern classifier_t classifier;
+
+extern hash_bit_count_t default_max_hash_bits;
+extern hash_count_t default_max_tokens;
+
 extern myregex_t re[MAX_RE];
 extern regex_count_t regex_count;
 
@@ -355,12 +364,22 @@ void init_empirical(empirical_t *emp, hash_count_t dmt, hash_bit_count_t dmhb) {
 
     MADVISE(emp->hash, sizeof(h_item_t) * emp->max_tokens, MADV_RANDOM);
 
+    emp->ctrl = new_hash_ctrl(emp->max_tokens);
+    if( !emp->ctrl ) {
+      errormsg(E_FATAL,
+	       "not enough memory? I couldn't allocate %li bytes\n", 
+	       (long int)emp->max_tokens + HCTRL_GROUP);
+    }
 }
 
 void free_empirical(empirical_t *emp) {
   if( emp->hash ) {
     free(emp->hash);
   }
+  if( emp->ctrl ) {
+    free(emp->ctrl);
+    emp->ctrl = NULL;
+  }
 }
 
 void clear_empirical(empirical_t *emp) {
@@ -370,9 +389,14 @@ void clear_empirical(empirical_t *emp) {
 	/* this may actually be slower than a global memset */ 
 	for(i = 0; i < emp->feature_stack_top; i++) {
 	    memset(emp->feature_stack[i], 0, sizeof(h_item_t));
+	    set_hash_ctrl(emp->ctrl, emp->max_tokens, 
+			  emp->feature_stack[i] - emp->hash, 0);
 	}
     } else {
 	memset(emp->hash, 0, sizeof(h_item_t) * emp->max_tokens);
+	if( emp->ctrl ) {
+	    memset(emp->ctrl, 0, emp->max_tokens + HCTRL_GROUP);
+	}
     }
 
     emp->full_token_count = 0;
@@ -385,26 +409,13 @@ void clear_empirical(empirical_t *emp) {
 }
 
 h_item_t *find_in_empirical(empirical_t *emp, hash_value_t id) {
-  register h_item_t *i, *loop;
-  /* start at id */
-  i = loop = &emp->hash[id & (emp->max_tokens - 1)];
+  hash_count_t n;
 
-  while( FILLEDP(i) ) {
-    if( EQUALP(i->id,id) ) {
-      return i; /* found id */
-    } else {
-      i++; /* not found */
-      /* wrap around */
-      i = (i >= &emp->hash[emp->max_tokens]) ? emp->hash : i; 
-      if( i == loop ) {
-	return NULL; /* when hash table is full */
-      }
-    }
-  }
-
-  /* empty slot, so not found */
-
-  return i; 
+  n = probe_hash_ctrl(emp->ctrl, emp->max_tokens, id, id,
+		      (byte_t *)emp->hash, sizeof(h_item_t), 
+		      offsetof(h_item_t, id));
+  /* either the id or an empty slot, NULL when hash table is full */
+  return (n < emp->max_tokens) ? &emp->hash[n] : NULL;
 }
 
 /* calculates the entropy of the full empirical measure */
@@ -442,22 +453,13 @@ void init_category(category_t *cat) {
 
     cat->model_full_token_count = 0;
     cat->model_unique_token_count = 0;
-    cat->score = 0.0;
-    cat->score_div = 0.0;
-    cat->score_s2 = 0.0;
-    cat->score_shannon = 0.0;
     cat->shannon = 0.0;
     cat->shannon_s2 = 0.0;
     cat->alpha = 0.0;
     cat->beta = 0.0;
     cat->mu = 0.0;
     cat->s2 = 0.0;
-    cat->prior = 0.0;
-    cat->complexity = 0.0;
-    cat->fcomplexity = 0;
-    cat->fmiss = 0;
     cat->max_order = 0;
-    memset(cat->mediacounts, 0, sizeof(token_count_t)*TOKEN_CLASS_MAX);
     p = strrchr(cat->fullfilename, '/');
     if( p ) {
       cat->filename = p + 1; /* only keep basename */
@@ -476,6 +478,9 @@ void init_category(category_t *cat) {
     cat->model.dt = 0;
     cat->c_options = 0;
     cat->hash = NULL;
+    cat->ctrl = NULL;
+    cat->index = NULL;
+    cat->index_bits = 0;
     cat->mmap_offset = 0;
     cat->mmap_start = NULL;
 }
@@ -535,11 +540,78 @@ bool_t create_category_hash(category_t *cat, FILE *input, int protf) {
     }
 
   }
+
   return 1;
 }
 
 
+/* compiled categories are mapped read only whenever possible, 
+   that's what they are for. The index and the items are 
+   at aligned offsets after the digrams. */
+static bool_t create_compiled_hash(category_t *cat, FILE *input, int protf) {
+  long offset, index_offset, items_offset, length;
+  struct stat statinfo;
+
+  if( protf & PROT_WRITE ) {
+    errormsg(E_ERROR, "compiled category %s is read only\n",
+	     cat->fullfilename);
+    return 0;
+  }
+
+  offset = ftell(input);
+  index_offset = COMPILED_ALIGNED(offset);
+  items_offset = COMPILED_ALIGNED(index_offset + 
+				  (((long)1<<cat->index_bits) + 1) * 
+				  (long)sizeof(hash_value_t));
+  length = items_offset + (long)(cat->max_tokens * sizeof(c_item_t));
+  if( (offset < 0) || (fstat(fileno(input), &statinfo) == -1) ||
+      (statinfo.st_size < length) ) {
+    errormsg(E_ERROR, "corrupt category? %s\n",
+	     cat->fullfilename);
+    return 0;
+  }
+
+  cat->mmap_start = 
+    (byte_t *)MMAP(0, length, PROT_READ, MAP_SHARED, fileno(input), 0);
+  if( cat->mmap_start == MAP_FAILED ) { cat->mmap_start = NULL; }
+  if( cat->mmap_start ) {
+    cat->mmap_offset = items_offset;
+    cat->index = (hash_value_t *)(cat->mmap_start + index_offset);
+    cat->hash = (c_item_t *)(cat->mmap_start + items_offset);
+    if( u_options & (1<<U_OPTION_MMAP) ) {
+      MADVISE(cat->mmap_start, length, MADV_WILLNEED);
+      MLOCK(cat->mmap_start, length);
+    }
+    cat->c_options |= (1<<C_OPTION_MMAPPED_HASH);
+    return 1;
+  }
+
+  /* no mmap, so read index and items in a single block */
+  cat->c_options &= ~(1<<C_OPTION_MMAPPED_HASH);
+  cat->index = (hash_value_t *)malloc(length - index_offset);
+  if( !cat->index ) {
+    errormsg(E_ERROR, "not enough memory for category %s\n", 
+	     cat->filename);
+    return 0;
+  }
+  if( (fseek(input, index_offset, SEEK_SET) == -1) ||
+      (fread(cat->index, length - index_offset, 1, input) < 1) ) {
+    errormsg(E_ERROR, "corrupt category? %s\n",
+	     cat->fullfilename);
+    free(cat->index);
+    cat->index = NULL;
+    return 0;
+  }
+  cat->hash = (c_item_t *)((byte_t *)cat->index + 
+			   (items_offset - index_offset));
+  return 1;
+}
+
 void free_category_hash(category_t *cat) {
+  if( cat->ctrl ) {
+    free(cat->ctrl);
+    cat->ctrl = NULL;
+  }
   if( cat->hash ) {
     if( cat->mmap_start != NULL ) {
       MUNMAP(cat->mmap_start, cat->max_tokens * sizeof(c_item_t) + 
@@ -547,6 +619,13 @@ void free_category_hash(category_t *cat) {
       cat->mmap_start = NULL;
       cat->mmap_offset = 0;
       cat->hash = NULL;
+      cat->index = NULL;
+    }
+    if( cat->index ) {
+      /* compiled, the hash is part of the same block */
+      free(cat->index);
+      cat->index = NULL;
+      cat->hash = NULL;
     }
     if( cat->hash ) {
       free(cat->hash);
@@ -606,6 +685,8 @@ void init_purely_random_text_category(category_t *cat) {
   cat->delta = 0.0;
   cat->renorm = 0.0;
   cat->hash = NULL;
+  cat->ctrl = NULL;
+  cat->index = NULL;
   cat->mmap_start = NULL;
   cat->mmap_offset = 0;
   cat->model.type = simple;
@@ -617,8 +698,27 @@ void init_purely_random_text_category(category_t *cat) {
 
 c_item_t *find_in_category(category_t *cat, hash_value_t id) {
     register c_item_t *i, *loop;
-
-    if( cat->hash ) {
+    hash_value_t b;
+    hash_count_t n;
+
+    if( cat->index ) {
+	/* compiled: scan the few items whose id has the same top bits */
+	b = id >> (8 * sizeof(hash_value_t) - cat->index_bits);
+	i = &cat->hash[NTOH_ID(cat->index[b])];
+	loop = &cat->hash[NTOH_ID(cat->index[b + 1])];
+	for(; i < loop; i++) {
+	    if( EQUALP(NTOH_ID(i->id),id) ) {
+		return i;
+	    }
+	}
+	return NULL;
+    } else if( cat->ctrl ) {
+	/* the stored ids are in network order */
+	n = probe_hash_ctrl(cat->ctrl, cat->max_tokens, id, HTON_ID(id),
+			    (byte_t *)cat->hash, sizeof(c_item_t), 
+			    offsetof(c_item_t, id));
+	return (n < cat->max_tokens) ? &cat->hash[n] : NULL;
+    } else if( cat->hash ) {
 	/* start at id */
 	i = loop = &cat->hash[id & (cat->max_tokens - 1)];
 
@@ -640,19 +740,262 @@ c_item_t *find_in_category(category_t *cat, hash_value_t id) {
     }
 }
 
-/* for each loaded category, this calculates the score. 
+/***********************************************************
+ * CLASSIFIER FUNCTIONS                                    *
+ ***********************************************************/
+
+/* sets up a classifier for the given (already loaded) categories.
+   The categories are never modified by the classifier, so several
+   classifiers can use the same ones. */
+bool_t init_classifier(classifier_t *cl, 
+		       category_t *cats, category_count_t count) {
+  cl->cat = cats;
+  cl->cat_count = count;
+  memset(&cl->empirical, 0, sizeof(empirical_t));
+  memset(&cl->fused, 0, sizeof(fused_t));
+  cl->sc = (cat_score_t *)calloc((count > 0) ? count : 1, sizeof(cat_score_t));
+  cl->refs = (weight_t *)calloc((count > 0) ? count : 1, sizeof(weight_t));
+  if( !cl->sc || !cl->refs ) {
+    errormsg(E_ERROR, "not enough memory for %d category scores\n", count);
+    return 0;
+  }
+  if( m_options & (1<<M_OPTION_CALCENTROPY) ) {
+    init_empirical(&cl->empirical, 
+		   default_max_tokens, 
+		   default_max_hash_bits); /* sets cached to zero */
+  }
+  return 1;
+}
+
+void free_classifier(classifier_t *cl) {
+  if( cl->sc ) {
+    free(cl->sc);
+    cl->sc = NULL;
+  }
+  if( cl->refs ) {
+    free(cl->refs);
+    cl->refs = NULL;
+  }
+  if( cl->empirical.hash ) {
+    free_empirical(&cl->empirical);
+    cl->empirical.hash = NULL;
+  }
+  if( cl->fused.rows ) {
+    free(cl->fused.rows);
+    cl->fused.rows = NULL;
+  }
+}
+
+/* builds the control bytes of the (uncompiled) categories, so that
+   find_in_category() can skip whole groups of slots. This reads every
+   slot of every category, which a single short document never pays
+   back, so like fuse_classifier() it's up to the caller. Returns 0 if
+   some category is left without control bytes. */
+bool_t index_classifier(classifier_t *cl) {
+  category_count_t c;
+  hash_count_t i;
+  hash_value_t id;
+  category_t *cat;
+  bool_t ok = 1;
+
+  for(c = 0; c < cl->cat_count; c++) {
+    cat = &cl->cat[c];
+    if( !cat->hash || cat->index || cat->ctrl ) {
+      continue;
+    }
+    cat->ctrl = new_hash_ctrl(cat->max_tokens);
+    if( !cat->ctrl ) {
+      ok = 0;
+      continue;
+    }
+    for(i = 0; i < cat->max_tokens; i++) {
+      id = NTOH_ID(cat->hash[i].id);
+      cat->ctrl[i] = id ? HCTRL_TAG(id) : 0;
+    }
+    mirror_hash_ctrl(cat->ctrl, cat->max_tokens);
+  }
+  return ok;
+}
+
+/* builds one hash table which holds the lambda weights of all the
+   categories side by side, so scoring a token takes a single probe
+   instead of one per category. Building the table costs about as
+   much as scoring every feature of every category once, so this
+   only pays off when many documents are classified, and it's up to
+   the caller. Returns 0 if the classifier is left unfused. */
+bool_t fuse_classifier(classifier_t *cl) {
+  category_count_t c;
+  hash_count_t n, unique = 0, max_tokens;
+  double cat_bytes = 0.0;
+  size_t stride, bitmap, align;
+  c_item_t *k, *e;
+  f_item_t *f;
+  hash_value_t id;
+  fused_t *fu = &cl->fused;
+
+  if( fu->rows || (cl->cat_count < 2) ) {
+    return 0;
+  }
+  for(c = 0; c < cl->cat_count; c++) {
+    if( !cl->cat[c].hash ) {
+      return 0;
+    }
+    e = cl->cat[c].hash + cl->cat[c].max_tokens;
+    for(k = cl->cat[c].hash; k < e; k++) {
+      if( FILLEDP(k) ) { unique++; }
+    }
+    cat_bytes += (double)cl->cat[c].max_tokens * sizeof(c_item_t);
+  }
+
+  /* keep the load factor below 3/4, so probes stay short */
+  for(max_tokens = 1; max_tokens <= unique + unique/3; max_tokens <<= 1);
+  bitmap = sizeof(f_item_t) + cl->cat_count * sizeof(((f_item_t *)0)->lam[0]);
+  stride = bitmap + (cl->cat_count + 7)/8;
+  /* each row must keep both the id and the weights aligned, the
+     weights are doubles unless DIGITIZE_LAMBDA is defined */
+  align = MAXIMUM(sizeof(hash_value_t), sizeof(((f_item_t *)0)->lam[0]));
+  stride = (stride + align - 1) & ~(align - 1);
+  if( (double)max_tokens * stride > FUSED_MAX_RATIO * cat_bytes ) {
+    return 0;
+  }
+  fu->rows = (byte_t *)calloc(max_tokens, stride);
+  if( !fu->rows ) {
+    return 0;
+  }
+  fu->max_tokens = max_tokens;
+  fu->stride = stride;
+  fu->bitmap = bitmap;
+
+  for(c = 0; c < cl->cat_count; c++) {
+    e = cl->cat[c].hash + cl->cat[c].max_tokens;
+    for(k = cl->cat[c].hash; k < e; k++) {
+      if( FILLEDP(k) ) {
+	id = NTOH_ID(k->id);
+	n = id & (max_tokens - 1);
+	f = FUSED_ROW(fu, n);
+	while( FILLEDP(f) && !EQUALP(f->id,id) ) {
+	  n = (n + 1) & (max_tokens - 1);
+	  f = FUSED_ROW(fu, n);
+	}
+	SET(f->id,id);
+	f->lam[c] = NTOH_LAMBDA(k->lam);
+	FUSED_BITMAP(fu,f)[c/8] |= (byte_t)(1<<(c%8));
+      }
+    }
+  }
+  return 1;
+}
+
+static f_item_t *find_in_fused(fused_t *fu, hash_value_t id) {
+  register hash_count_t n = id & (fu->max_tokens - 1);
+  register f_item_t *f = FUSED_ROW(fu, n);
+
+  /* the table is never full */
+  while( FILLEDP(f) ) {
+    if( EQUALP(f->id,id) ) {
+      return f;
+    }
+    n = (n + 1) & (fu->max_tokens - 1);
+    f = FUSED_ROW(fu, n);
+  }
+  return NULL;
+}
+
+/* call this before classifying the next document. The empirical
+   distribution is cleared separately, because line filtering and
+   document classification need it differently */
+void reset_classifier_scores(classifier_t *cl) {
+  memset(cl->sc, 0, cl->cat_count * sizeof(cat_score_t));
+}
+
+/* adds up the digram weights of a token for every category, 
+   in the same order as the token is read */
+static void add_digram_pairs(classifier_t *cl, 
+			     const unsigned int *pairs, int n, weight_t *refs) {
+  category_count_t i;
+#if defined DIGITIZE_DIGRAMS
+  const digitized_weight_t *dig;
+#else
+  const weight_t *dig;
+#endif
+  int k;
+
+  for(i = 0; i < cl->cat_count; i++) {
+    dig = &cl->cat[i].dig[0][0];
+    for(k = 0; k < n; k++) {
+      refs[i] += UNPACK_DIGRAMS(dig[pairs[k]]);
+    }
+  }
+}
+
+/* computes the reference weight of an order 1 token from the digram
+   model of every category (while duplicating the digitization error). 
+   The token is decoded into digram table offsets once, so each
+   category only has to look up its weights. */
+static void classifier_digram_refs(classifier_t *cl, 
+				   const char *tok, weight_t *refs) {
+  unsigned int pairs[MAX_TOKEN_LEN + EXTRA_TOKEN_LEN];
+  alphabet_size_t pp, pc, len;
+  category_count_t i;
+  const char *q;
+  int n = 0;
+
+  for(i = 0; i < cl->cat_count; i++) {
+    refs[i] = 0.0;
+  }
+
+  pp = (unsigned char)*tok;
+  CLIP_ALPHABET(pp);
+  q = tok + 1;
+  len = 1;
+  while( *q != EOTOKEN ) {
+    if( *q == '\r' ) {
+      q++;
+      continue;
+    }
+    pc = (unsigned char)*q;
+    CLIP_ALPHABET(pc);
+    pairs[n++] = (unsigned int)pp * ASIZE + pc;
+    /* very long tokens (from regexes) are done in pieces */
+    if( n == (int)(sizeof(pairs)/sizeof(pairs[0])) ) {
+      add_digram_pairs(cl, pairs, n, refs);
+      n = 0;
+    }
+    pp = pc;
+    q++;
+    if( *q != DIAMOND ) { len++; }
+  }
+  add_digram_pairs(cl, pairs, n, refs);
+
+  for(i = 0; i < cl->cat_count; i++) {
+    refs[i] += UNPACK_DIGRAMS(cl->cat[i].dig[RESERVED_TOKLEN][len]) -
+      UNPACK_DIGRAMS(cl->cat[i].dig[RESERVED_TOKLEN][0]);
+    refs[i] = UNPACK_RWEIGHTS(PACK_RWEIGHTS(refs[i]));
+  }
+}
+
+/* this is the word_fun used by the command line programs */
+void score_word(char *tok, token_type_t tt, regex_count_t re) {
+  classifier_score_word(&classifier, tok, tt, re);
+}
+
+/* for each category of the classifier, this calculates the score. 
    Tokens have the format
    DIAMOND t1 DIAMOND t2 ... tn DIAMOND CLASSEP class NUL */
-void score_word(char *tok, token_type_t tt, regex_count_t re) {
+void classifier_score_word(classifier_t *cl, 
+			   char *tok, token_type_t tt, regex_count_t re) {
+  category_t *cat = cl->cat;
+  cat_score_t *sc = cl->sc;
+  empirical_t *emp = &cl->empirical;
   category_count_t i = 0;
   weight_t multinomial_correction = 0.0;
   weight_t shannon_correction = 0.0;
   weight_t lambda, ref, oldscore;
   bool_t apply;
-  alphabet_size_t pp, pc, len;
-  hash_value_t id;
+  hash_value_t id, kid;
   char *q;
   register c_item_t *k = NULL;
+  f_item_t *f = NULL;
   h_item_t *h = NULL;
 
   /* we skip "empty" tokens */
@@ -664,7 +1007,7 @@ void score_word(char *tok, token_type_t tt, regex_count_t re) {
     if( (m_options & (1<<M_OPTION_CALCENTROPY)) ) {
       /* add the token to the hash */
 
-      h = find_in_empirical(&empirical, id);
+      h = find_in_empirical(emp, id);
       if( h ) {
  	if( FILLEDP(h) ) {
 	  if( h->count < K_TOKEN_COUNT_MAX ) {
@@ -680,12 +1023,13 @@ void score_word(char *tok, token_type_t tt, regex_count_t re) {
 	  }
  	} else {
  	  if( /* !FILLEDP(i) && */
- 	     ((100 * empirical.unique_token_count) <
- 	      (HASH_FULL * empirical.max_tokens) )) {
+ 	     ((100 * emp->unique_token_count) <
+ 	      (HASH_FULL * emp->max_tokens) )) {
  	    /* fill the empirical hash */
  	    SET(h->id,id);
-	    empirical.unique_token_count += 
-	      ( empirical.unique_token_count < K_TOKEN_COUNT_MAX ) ? 1 : 0;
+	    set_hash_ctrl(emp->ctrl, emp->max_tokens, h - emp->hash, id);
+	    emp->unique_token_count += 
+	      ( emp->unique_token_count < K_TOKEN_COUNT_MAX ) ? 1 : 0;
 	    h->count = 1;
 #if defined SHANNON_STIRLING
 	    shannon_correction = 1.0 - log(2.0 * M_PI)/2.0;
@@ -695,37 +1039,48 @@ void score_word(char *tok, token_type_t tt, regex_count_t re) {
  	  } else {
  	    /* hash full */
  	    h = NULL; 
- 	    if( !empirical.hashfull_warning ) {
+ 	    if( !emp->hashfull_warning ) {
 	      errormsg(E_WARNING,
  		      "empirical hash full, calculation may be skewed. " 
  		      "Try option -h %d\n", 
- 		      (empirical.max_hash_bits + 1));
- 	      empirical.hashfull_warning = 1;
+ 		      (emp->max_hash_bits + 1));
+ 	      emp->hashfull_warning = 1;
  	    }
  	    return; /* pretend word doesn't exist */
  	  }
 
-	  if( empirical.track_features ) {
-	    if( empirical.feature_stack_top < MAX_TOKEN_LINE_STACK ) {
-	      empirical.feature_stack[empirical.feature_stack_top++] = h;
+	  if( emp->track_features ) {
+	    if( emp->feature_stack_top < MAX_TOKEN_LINE_STACK ) {
+	      emp->feature_stack[emp->feature_stack_top++] = h;
 	    } else {
-	      empirical.track_features = 0;
-	      empirical.feature_stack_top = 0;
+	      emp->track_features = 0;
+	      emp->feature_stack_top = 0;
 	    }
 	  }
  	}
-	empirical.full_token_count += 
-	  ( empirical.full_token_count < K_TOKEN_COUNT_MAX ) ? 1 : 0;
+	emp->full_token_count += 
+	  ( emp->full_token_count < K_TOKEN_COUNT_MAX ) ? 1 : 0;
 	
       }
     }
 
+    /* with a fused table, one lookup covers all the categories */
+    if( cl->fused.rows ) {
+      f = find_in_fused(&cl->fused, id);
+    }
+
+    /* the token is only walked once for the digram references */
+    if( tt.order == 1 ) {
+      classifier_digram_refs(cl, tok, cl->refs);
+    }
+
     /* now do scoring for all available categories */
-    for(i = 0; i < cat_count; i++) {
+    for(i = 0; i < cl->cat_count; i++) {
 
-      oldscore = cat[i].score;
+      oldscore = sc[i].score;
       lambda = 0.0;
       ref = 0.0;
+      kid = 0;
 
       /* see if this token is for us. The rule is: a category either
 	 uses the standard tokenizer (in that case re = INVALID_RE),
@@ -740,34 +1095,21 @@ void score_word(char *tok, token_type_t tt, regex_count_t re) {
       if( apply ) {
 
 	/* if token found, add its lambda weight */
-	k = find_in_category(&cat[i], id);
-	if( k ) {
-	  lambda = UNPACK_LAMBDA(NTOH_LAMBDA(k->lam));
+	if( cl->fused.rows ) {
+	  if( f && (FUSED_BITMAP(&cl->fused,f)[i/8] & (1<<(i%8))) ) {
+	    lambda = UNPACK_LAMBDA(f->lam[i]);
+	    kid = f->id;
+	  }
+	} else {
+	  k = find_in_category(&cat[i], id);
+	  if( k ) {
+	    lambda = UNPACK_LAMBDA(NTOH_LAMBDA(k->lam));
+	    kid = NTOH_ID(k->id);
+	  }
 	}
 
 	if( tt.order == 1 ) {
-	  /* now compute the reference weight from digram model,
-	     (while duplicating the digitization error) */
-	  pp = (unsigned char)*tok;
-	  CLIP_ALPHABET(pp);
-	  q = tok + 1;
-	  len = 1;
-	  while( *q != EOTOKEN ) {
-	    if( *q == '\r' ) {
-	      q++;
-	      continue;
-	    }
-	    pc = (unsigned char)*q;
-	    CLIP_ALPHABET(pc);
-	    ref += UNPACK_DIGRAMS(cat[i].dig[pp][pc]);
-	    pp = pc;
-	    q++;
-	    if( *q != DIAMOND ) { len++; }
-	  }
-	  ref += UNPACK_DIGRAMS(cat[i].dig[RESERVED_TOKLEN][len]) -
-	    UNPACK_DIGRAMS(cat[i].dig[RESERVED_TOKLEN][0]);
-	  ref = UNPACK_RWEIGHTS(PACK_RWEIGHTS(ref));
-
+	  ref = cl->refs[i];
 	}
 
 	/* update the complexity */
@@ -825,36 +1167,36 @@ void score_word(char *tok, token_type_t tt, regex_count_t re) {
 	   at both ends of the line, which adds up to quite a bit over
 	   many lines. */
 
-	cat[i].fcomplexity++; /* don't actually need this, but nice to have */
-	cat[i].complexity += cat[i].delta;
+	sc[i].fcomplexity++; /* don't actually need this, but nice to have */
+	sc[i].complexity += cat[i].delta;
 
 	/* now adjust the score */
 	switch(cat[i].model.type) {
 	case simple:
 	  multinomial_correction = h ?
-	    (log((weight_t)cat[i].complexity) - log((weight_t)h->count)) : 0.0;
-	  cat[i].score += 
+	    (log((weight_t)sc[i].complexity) - log((weight_t)h->count)) : 0.0;
+	  sc[i].score += 
 	    lambda + multinomial_correction + ref - cat[i].renorm;
 	  break;
 	case sequential:
 	default:
-	  cat[i].score += lambda + ref - cat[i].renorm;
+	  sc[i].score += lambda + ref - cat[i].renorm;
 	  if( tt.order == cat[i].max_order ) {
-	    cat[i].score_shannon += shannon_correction;
+	    sc[i].score_shannon += shannon_correction;
 	  }
 	  break;
 	}
 
-	if( !k || !NTOH_ID(k->id) ) {
+	if( !kid ) {
 	  /* missing data */
-	  cat[i].fmiss++;
+	  sc[i].fmiss++;
 	}
 
 	if( tt.order == 1 ) {
 	  /* sample variance */
-	  cat[i].score_s2 += (cat[i].score - oldscore) * (cat[i].score - oldscore);
+	  sc[i].score_s2 += (sc[i].score - oldscore) * (sc[i].score - oldscore);
 	  /* only count medium for 1-grams */
-	  cat[i].mediacounts[tt.cls]++;
+	  sc[i].mediacounts[tt.cls]++;
 	}
 
       }
@@ -862,22 +1204,22 @@ void score_word(char *tok, token_type_t tt, regex_count_t re) {
       if( u_options & (1<<U_OPTION_DUMP) ) {
 	if( u_options & (1<<U_OPTION_SCORES) ) {
 	  fprintf(stdout, " %8.2f * %-6.1f\t",  
-		  -sample_mean(cat[i].score, cat[i].complexity),
-		  cat[i].complexity);
+		  -sample_mean(sc[i].score, sc[i].complexity),
+		  sc[i].complexity);
 	} else if( u_options & (1<<U_OPTION_POSTERIOR) ) {
-	  fprintf(stdout, " %8.2f\t", oldscore - cat[i].score);
+	  fprintf(stdout, " %8.2f\t", oldscore - sc[i].score);
 	} else if( u_options & (1<<U_OPTION_VAR) ) {
 	  fprintf(stdout, " %8.2f * %-6.1f # %-8.2f\t",
-		  -sample_mean(cat[i].score,cat[i].complexity),
-		  cat[i].complexity,
-		  sample_variance(cat[i].score_s2, cat[i].score,
-				  cat[i].complexity)/cat[i].complexity);
+		  -sample_mean(sc[i].score,sc[i].complexity),
+		  sc[i].complexity,
+		  sample_variance(sc[i].score_s2, sc[i].score,
+				  sc[i].complexity)/sc[i].complexity);
 	} else {
 	  fprintf(stdout, 
 		  "%7.2f %7.2f %7.2f %7.2f %8lx\t", 
 		  lambda, ref, apply ? -cat[i].renorm : 0.0, 
 		  multinomial_correction,
-		  (long unsigned int)((k && apply) ? NTOH_ID(k->id) : 0));
+		  (long unsigned int)kid);
 	}
       }
 
@@ -997,6 +1339,17 @@ error_code_t load_category_header(FILE *input, category_t *cat) {
 	/* if regex can't be compiled, load_regex() exits */
 	cat->retype |= (1<<load_regex(buf + RESTARTPOS));
 
+      } else if( strncmp(buf, MAGIC12, 11) == 0 ) {
+	if( (sscanf(buf, MAGIC12, &lint_val1, &shint_val) < 2) ||
+	    (shint_val < 1) || 
+	    (shint_val > (short int)(8 * sizeof(hash_value_t))) ) {
+	  errormsg(E_ERROR, "bad category file [12]\n");
+	  return 0;
+	}
+	cat->max_tokens = (hash_count_t)lint_val1;
+	cat->index_bits = (hash_bit_count_t)shint_val;
+	cat->c_options |= (1<<C_OPTION_COMPILED);
+
       } else if( strncmp(buf, MAGIC4_i, 10) == 0) {
 	if( sscanf(buf, MAGIC4_i, &lint_val1, &shint_val, &shint_val2, scratchbuf) == 4 ) {
 	  cat->model.options = (options_t)lint_val1;
@@ -1071,7 +1424,9 @@ error_code_t explicit_load_category(category_t *cat, char *openf, int protf) {
     }
 #endif
 
-    if( !create_category_hash(cat, input, protf) ) {
+    if( (cat->c_options & (1<<C_OPTION_COMPILED)) ?
+	!create_compiled_hash(cat, input, protf) :
+	!create_category_hash(cat, input, protf) ) {
       fclose(input);
       return 0;
     }
@@ -1085,6 +1440,139 @@ error_code_t explicit_load_category(category_t *cat, char *openf, int protf) {
 }
 
 
+/* sorts the items of a compiled category */
+static int compare_c_items(const void *a, const void *b) {
+  hash_value_t x = NTOH_ID(((const c_item_t *)a)->id);
+  hash_value_t y = NTOH_ID(((const c_item_t *)b)->id);
+  return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+/* pads the output with zeros up to the next aligned offset */
+static bool_t write_compiled_padding(FILE *output) {
+  long offset = ftell(output);
+  if( offset < 0 ) {
+    return 0;
+  }
+  for(; offset % COMPILED_ALIGN; offset++) {
+    if( fputc(0, output) == EOF ) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* rewrites a loaded category in the compiled format: only the filled
+   slots, sorted by id, with a small index on the top bits of the id
+   so that each lookup scans about four items. The result is read
+   only, but typically less than half the size of the sparse hash,
+   and it is mapped straight into memory when loaded.
+   The text headers are copied from the original file. */
+error_code_t compile_category(category_t *cat) {
+  char buf[MAGIC_BUFSIZE];
+  FILE *input, *output;
+  char *tempname = NULL;
+  c_item_t *items, *k, *e;
+  hash_value_t *index;
+  hash_count_t n, t;
+  hash_bit_count_t ibits;
+  size_t b, nb;
+  alphabet_size_t i, j;
+#if defined DIGITIZE_DIGRAMS
+  digitized_weight_t d;
+#else
+  weight_t d;
+#endif
+  bool_t ok = (bool_t)1;
+
+  if( !cat->hash ) {
+    return 0;
+  }
+
+  n = 0;
+  e = cat->hash + cat->max_tokens;
+  for(k = cat->hash; k < e; k++) {
+    if( FILLEDP(k) ) { n++; }
+  }
+  items = (c_item_t *)malloc((n > 0 ? n : 1) * sizeof(c_item_t));
+  if( !items ) {
+    errormsg(E_ERROR, "not enough memory for compiling %s\n", 
+	     cat->fullfilename);
+    return 0;
+  }
+  for(t = 0, k = cat->hash; k < e; k++) {
+    if( FILLEDP(k) ) { memcpy(&items[t++], k, sizeof(c_item_t)); }
+  }
+  qsort(items, n, sizeof(c_item_t), compare_c_items);
+
+  /* about four items per bucket, which fits in a cache line */
+  for(ibits = 1; (ibits < 8 * sizeof(hash_value_t)) && 
+	((n >> (ibits + 2)) > 0); ibits++);
+  nb = (size_t)1<<ibits;
+  index = (hash_value_t *)malloc((nb + 1) * sizeof(hash_value_t));
+  if( !index ) {
+    errormsg(E_ERROR, "not enough memory for compiling %s\n", 
+	     cat->fullfilename);
+    free(items);
+    return 0;
+  }
+  for(b = 0, t = 0; b <= nb; b++) {
+    while( (t < n) && 
+	   ((NTOH_ID(items[t].id) >> (8 * sizeof(hash_value_t) - ibits)) < b) ) {
+      t++;
+    }
+    index[b] = HTON_ID((hash_value_t)t);
+  }
+
+  input = fopen(cat->fullfilename, "rb");
+  output = input ? mytmpfile(cat->fullfilename, &tempname) : NULL;
+  if( !output ) {
+    errormsg(E_ERROR, "cannot compile %s\n", cat->fullfilename);
+    if( input ) { fclose(input); }
+    free(items);
+    free(index);
+    return 0;
+  }
+
+  /* same headers, except for the compiled line */
+  while( ok && fgets(buf, MAGIC_BUFSIZE, input) ) {
+    if( strncmp(buf, MAGIC6, 2) == 0 ) {
+      break;
+    } else if( strncmp(buf, MAGIC12, 11) != 0 ) {
+      ok = (fputs(buf, output) != EOF);
+    }
+  }
+  fclose(input);
+  ok = ok &&
+    (0 < fprintf(output, MAGIC12, (long int)n, (short int)ibits)) &&
+    (0 < fprintf(output, MAGIC6));
+
+  for(i = 0; ok && (i < ASIZE); i++) {
+    for(j = 0; ok && (j < ASIZE); j++) {
+      d = HTON_DIGRAM(cat->dig[i][j]);
+      ok = (fwrite(&d, SIZEOF_DIGRAMS, 1, output) == 1);
+    }
+  }
+
+  ok = ok && write_compiled_padding(output) &&
+    (fwrite(index, sizeof(hash_value_t), nb + 1, output) == nb + 1) &&
+    write_compiled_padding(output) &&
+    (fwrite(items, sizeof(c_item_t), n, output) == n);
+
+  free(items);
+  free(index);
+  fclose(output);
+
+  if( !ok || !myrename(tempname, cat->fullfilename) ) { 
+    errormsg(E_ERROR, 
+	     "due to a potential file corruption, category %s was not updated\n", 
+	     cat->fullfilename);
+    unlink(tempname);
+    ok = 0;
+  }
+  free(tempname);
+  return ok;
+}
+
 /* loads a category hash 
    returns 0 on failure, you should free the category in that case */
 error_code_t load_category(category_t *cat) {
@@ -1108,10 +1596,26 @@ error_code_t reload_category(category_t *cat) {
 
 void reload_all_categories() {
   category_count_t c;
+  /* the fused table holds copies of the old weights */
+  bool_t fused = (classifier.fused.rows != NULL);
+  bool_t indexed = 0;
+  if( fused ) {
+    free(classifier.fused.rows);
+    classifier.fused.rows = NULL;
+  }
+  for(c = 0; c < cat_count; c++) {
+    indexed |= (cat[c].ctrl != NULL);
+  }
   for(c = 0; c < cat_count; c++) {
     if( !reload_category(&cat[c]) ) {
       errormsg(E_FATAL,
 	      "could not reload %s, exiting\n", cat[c].fullfilename);
     }
   }
+  if( indexed ) {
+    index_classifier(&classifier);
+  }
+  if( fused ) {
+    fuse_classifier(&classifier);
+  }
 }
@@ -459,6 +459,39 @@ typedef u_int16_t digitized_weight_t;
  */
 #define MAX_TOKEN_LEN ((charbuf_len_t)30) 
 #define TOKEN_LIST_GROW 1048576L
+/* while the learner hash grows, each new token moves this many of
+   the old slots, see grow_learner_step() */
+#define GROW_STEP 64
+/* how many online dumps given with -O are merged in one pass, see
+   combine_learner_dumps() */
+#define COMBINE_WAYS 64
+/* with -I, the weights are reoptimized incrementally only while at
+   most one feature in DELTA_FRACTION needs it, see mark_learner_delta() */
+#define DELTA_FRACTION 8
+/* with -Z, new tokens are counted in SKETCH_DEPTH rows of small
+   counters, each row 1<<SKETCH_WIDTH_BITS times as wide as the
+   learner hash, see count_in_sketch() */
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH_BITS 2
+/* input files smaller than this are cheaper to read than to map, see
+   map_input_file(). A memory mapped input file gives back the pages
+   it has read once they add up to MAPPED_INPUT_RELEASE bytes, see
+   release_mapped_input() */
+#define MAPPED_INPUT_MIN 65536L
+#define MAPPED_INPUT_RELEASE 16777216L
+/* while a directory is read, this many of the next files are
+   already open, so the kernel can read them ahead, see
+   fill_dir_walk() */
+#define READAHEAD_FILES 16
+/* with -Q, the decoded lines travel to the tokenizer in batches of
+   about PIPELINE_BATCH bytes, and the decoder can be at most
+   PIPELINE_BATCHES batches ahead, see process_lines_pipelined() */
+#define PIPELINE_BATCH 65536L
+#define PIPELINE_BATCHES 4
+/* a new category's token list stays in memory until it would grow
+   beyond this many bytes, then it is moved to a temporary file.
+   Lower this if learning very large corpora on a small machine. */
+#define TOKEN_ARENA_MAX (256L * TOKEN_LIST_GROW)
 
 /* user options */
 #define U_OPTION_CLASSIFY               1
@@ -477,6 +510,7 @@ typedef u_int16_t digitized_weight_t;
 #define U_OPTION_GROWHASH               15
 #define U_OPTION_INDENTED               16
 #define U_OPTION_NOZEROLEARN            17
+#define U_OPTION_COMPILE                18
 #define U_OPTION_MMAP                   21
 #define U_OPTION_CONFIDENCE             22
 #define U_OPTION_VAR                    23
@@ -484,6 +518,9 @@ typedef u_int16_t digitized_weight_t;
 #define U_OPTION_CLASSIFY_MULTIFILE     25
 #define U_OPTION_PRIOR_CORRECTION       26
 #define U_OPTION_MEDIACOUNTS            27
+#define U_OPTION_SERVER                 28
+#define U_OPTION_COUNTS_ONLY            29
+#define U_OPTION_INCREMENTAL            30
 
 /* model options */
 #define M_OPTION_REFMODEL               1
@@ -514,6 +551,7 @@ typedef u_int16_t digitized_weight_t;
 
 /* category options */
 #define C_OPTION_MMAPPED_HASH            1
+#define C_OPTION_COMPILED                2
 
 
 typedef u_int32_t options_t; /* make sure big enough for all options */
@@ -610,6 +648,7 @@ typedef enum {gcUNDEF = 0, gcDISCARD, gcTOKEN, gcTOKEN_END, gcIGNORE} good_char_
 #define NOTNULL(x) ((x) > 0)
 
 #define MAXIMUM(x,y) (((x)<(y))?(y):(x))
+#define MINIMUM(x,y) (((x)<(y))?(x):(y))
 #define INCREMENT(x,y,z) if( (x) < (y) ) { (x)++; } else { z = 1; }
 #define INCREASE(x,d,y,z) if( (x) < ((y)-(d)) ) { (x) += (d); } else { z = 1; }
 
@@ -676,8 +715,16 @@ typedef enum {gcUNDEF = 0, gcDISCARD, gcTOKEN, gcTOKEN_END, gcIGNORE} good_char_
                   " mu %" FMT_printf_score_t \
                   " s2 %" FMT_printf_score_t "\n"
 #define MAGIC11   "# medialp "
+#define MAGIC12   "# compiled %ld %hd\n"
+/* file offset alignment of the index and items in compiled categories */
+#define COMPILED_ALIGN 64
+#define COMPILED_ALIGNED(x) ((((x) + COMPILED_ALIGN - 1)/COMPILED_ALIGN)*COMPILED_ALIGN)
 
-#define MAGIC_ONLINE "# dbacl " SIGNATURE " online memory dump\n"
+/* the online memory dump is a raw copy of learner_t, so bump the
+   layout whenever learner_t changes, or old dumps would be misread */
+#define MAGIC_ONLINE_LAYOUT "2"
+#define MAGIC_ONLINE_ANY "# dbacl " SIGNATURE " online memory dump"
+#define MAGIC_ONLINE MAGIC_ONLINE_ANY " layout " MAGIC_ONLINE_LAYOUT "\n"
 
 #define MAGIC_DUMP "# lambda | dig_ref | count | id     | token\n"
 #define MAGIC_DUMPTBL_o "%9.3f %9.3f %7" FMT_printf_integer_t " %8lx "
@@ -704,6 +751,7 @@ typedef struct {
   token_count_t full_token_count;
   token_count_t unique_token_count;
   h_item_t *hash;
+  byte_t *ctrl; /* see probe_hash_ctrl() */
   bool_t track_features;
   h_item_t *feature_stack[MAX_TOKEN_LINE_STACK];
   token_stack_t feature_stack_top;
@@ -725,7 +773,6 @@ typedef struct {
   char *filename;
   char *fullfilename;
   token_order_t max_order;
-  token_count_t fcomplexity;
   token_count_t model_unique_token_count;
   token_count_t model_full_token_count;
   document_count_t model_num_docs;
@@ -736,20 +783,12 @@ typedef struct {
   score_t divergence;
   score_t renorm;
   score_t delta;
-  score_t complexity;
-  score_t score;
-  score_t score_div;
-  score_t score_s2;
-  score_t score_shannon;
   score_t shannon;
   score_t shannon_s2;
   score_t alpha;
   score_t beta;
   score_t mu;
   score_t s2;
-  score_t prior;
-  token_count_t fmiss;
-  token_count_t mediacounts[TOKEN_CLASS_MAX];
   struct {
     mtype type;
     options_t options;
@@ -758,6 +797,9 @@ typedef struct {
   } model;
   options_t c_options;
   c_item_t *hash;
+  byte_t *ctrl; /* optional, see index_classifier() */
+  hash_value_t *index; /* compiled categories only */
+  hash_bit_count_t index_bits;
   byte_t *mmap_start;
   long mmap_offset;
 #if defined DIGITIZE_DIGRAMS
@@ -767,6 +809,59 @@ typedef struct {
 #endif
 } category_t;
 
+/* per document scores for a single category. These are kept separately
+   so that the categories themselves are only read while classifying */
+typedef struct {
+  score_t complexity;
+  score_t score;
+  score_t score_div;
+  score_t score_s2;
+  score_t score_shannon;
+  score_t prior;
+  token_count_t fcomplexity;
+  token_count_t fmiss;
+  token_count_t mediacounts[TOKEN_CLASS_MAX];
+} cat_score_t;
+
+/* one row of a fused table: the lambda weights of every category
+   for the same feature id. A row has cat_count weights, so it is
+   always addressed through the table stride */
+typedef struct {
+  hash_value_t id;
+#if defined DIGITIZE_LAMBDA
+  digitized_weight_t lam[];
+#else
+  weight_t lam[];
+#endif
+} f_item_t;
+
+/* each row is followed by a bitmap of the categories which actually
+   contain the feature, because a missing feature counts as a miss */
+typedef struct {
+  hash_count_t max_tokens;
+  size_t stride;
+  size_t bitmap;
+  byte_t *rows;
+} fused_t;
+
+#define FUSED_ROW(f,n) ((f_item_t *)((f)->rows + (size_t)(n) * (f)->stride))
+#define FUSED_BITMAP(f,r) ((byte_t *)(r) + (f)->bitmap)
+/* don't fuse if the table would be bigger than this many times
+   the categories' own hash tables */
+#define FUSED_MAX_RATIO 4
+
+/* everything that changes while a document is being classified. Several
+   classifiers can share the same categories, the command line
+   program simply uses one global instance */
+typedef struct {
+  category_t *cat;
+  category_count_t cat_count;
+  cat_score_t *sc;
+  weight_t *refs; /* digram reference weights of the current token */
+  empirical_t empirical;
+  fused_t fused; /* optional, see fuse_classifier() */
+} classifier_t;
+
 typedef struct {
   token_count_t count;
   weight_t B; /* mustn't digitize this :-( */
@@ -800,6 +895,20 @@ typedef struct {
   score_t shannon;
 } emplist_t;
 
+/* while the weights are optimized, the features of each order are
+   copied out of the sparse learner hash into dense arrays, in hash
+   order. Order r occupies the indices start[r] to start[r+1] - 1. */
+typedef struct {
+  hash_count_t size;
+  hash_count_t start[MAX_SUBMATCH + 1];
+  l_item_t **item; /* where each feature lives in the hash */
+  long *tok; /* offset of each token string in the token list, or -1 */
+  weight_t *lam;
+  weight_t *ltrms;
+  weight_t *dref;
+  token_count_t *count;
+} l_features_t;
+
 typedef struct {
   char *filename;
   struct {
@@ -813,6 +922,8 @@ typedef struct {
     long mmap_offset;
     size_t mmap_length;
     long mmap_cursor;
+    byte_t *arena; /* the token list when it is kept in memory */
+    long arena_cursor;
   } tmp;
   re_bitfield retype;
   token_order_t max_order;
@@ -843,6 +954,25 @@ typedef struct {
   long mmap_learner_offset;
   long mmap_hash_offset;
   l_item_t *hash;
+  byte_t *ctrl; /* see probe_hash_ctrl() */
+  struct {
+    hash_count_t old_tokens; /* nonzero while items are being moved */
+    hash_count_t tidy_tokens; /* nonzero while tombstones are cleared */
+    hash_count_t cursor;
+    byte_t *old; /* one bit per slot still placed for old_tokens */
+  } grow; /* see grow_learner_step() */
+  struct {
+    hash_value_t *id; /* counted since the online file was loaded */
+    hash_count_t top;
+    hash_count_t max;
+    hash_count_t active; /* features marked for reoptimization */
+  } delta; /* with -I, see mark_learner_delta() */
+  struct {
+    byte_t *count; /* SKETCH_DEPTH rows of saturating counters */
+    hash_bit_count_t bits;
+    token_count_t held; /* tokens not (yet) placed in the hash */
+  } sketch; /* with -Z, see count_in_sketch() */
+  l_features_t feat; /* only while optimizing, see build_learner_features() */
   weight_t dig[ASIZE][ASIZE];
   long int regex_token_count[MAX_RE + 1];
   struct {
@@ -997,6 +1127,7 @@ extern "C"
   void sanitize_options();
   int set_option(int op, char *optarg);
 
+  /* these are defined in learner.c */
   void init_learner(learner_t *learner, char *opath, bool_t readonly);
   void free_learner(learner_t *learner);
 
@@ -1007,6 +1138,8 @@ extern "C"
   void optimize_and_save(learner_t *learner);
 
   l_item_t *find_in_learner(learner_t *learner, hash_value_t id);
+  token_order_t get_token_order(char *tok);
+  bool_t fill_ref_vars(learner_t *learner, l_item_t *k, char *tok);
   bool_t grow_learner_hash(learner_t *learner);
   void hash_word_and_learn(learner_t *learner, 
 			   char *tok, token_type_t tt, regex_count_t re);
@@ -1017,7 +1150,12 @@ extern "C"
 
   bool_t read_online_learner_struct(learner_t *learner, char *opath, bool_t readonly);
   void write_online_learner_struct(learner_t *learner, char *opath);
+  bool_t merge_learner_struct(learner_t *learner, char *path);
+  bool_t combine_learner_dumps(learner_t *learner, char **path, int n);
+  bool_t merge_learner_shards(learner_t *learner, char **path,
+			      token_count_t **bound, long *nbound, int n);
   error_code_t save_learner(learner_t *learner, char *opath);
+  void tmp_close(learner_t *learner);
 
 
   /* these are defined in catfun.c */
@@ -1040,14 +1178,24 @@ extern "C"
   error_code_t load_category(category_t *cat);
   error_code_t load_category_header(FILE *input, category_t *cat);
   error_code_t open_category(category_t *cat);
+  error_code_t compile_category(category_t *cat);
   void reload_all_categories();
 
+  bool_t init_classifier(classifier_t *cl, 
+			 category_t *cats, category_count_t count);
+  void free_classifier(classifier_t *cl);
+  bool_t index_classifier(classifier_t *cl);
+  bool_t fuse_classifier(classifier_t *cl);
+  void reset_classifier_scores(classifier_t *cl);
+  void classifier_score_word(classifier_t *cl, 
+			     char *tok, token_type_t tt, regex_count_t re);
   void score_word(char *tok, token_type_t tt, regex_count_t re);
   confidence_t gamma_pvalue(category_t *cat, double obs);
 
   /* file format handling in fh.c */
   void init_file_handling();
   void cleanup_file_handling();
+  bool_t claim_input_file();
 
   token_class_t get_token_class();
   regex_count_t load_regex(char *buf);
@@ -1085,6 +1233,12 @@ extern "C"
 		    void (*word_fun)(char *, token_type_t, regex_count_t), 
 		    char *(*pre_line_fun)(char *),
 		    void (*post_line_fun)(char *));
+  void process_buffer(const char *buf, size_t len,
+		      int (*line_filter)(MBOX_State *, char *),
+		      void (*character_filter)(XML_State *, char *), 
+		      void (*word_fun)(char *, token_type_t, regex_count_t), 
+		      char *(*pre_line_fun)(char *),
+		      void (*post_line_fun)(char *));
   void process_directory(char *name, 
 			 int (*line_filter)(MBOX_State *, char *),
 			 void (*character_filter)(XML_State *, char *), 
@@ -1141,6 +1295,12 @@ extern "C"
 		      void (*word_fun)(char *, token_type_t, regex_count_t), 
 		      char *(*pre_line_fun)(char *),
 		      void (*post_line_fun)(char *));
+  void w_process_buffer(const char *buf, size_t len,
+			int (*line_filter)(MBOX_State *, wchar_t *),
+			void (*character_filter)(XML_State *, wchar_t *), 
+			void (*word_fun)(char *, token_type_t, regex_count_t), 
+			char *(*pre_line_fun)(char *),
+			void (*post_line_fun)(char *));
   void w_process_directory(char *name,
 			   int (*line_filter)(MBOX_State *, wchar_t *),
 			   void (*character_filter)(XML_State *, wchar_t *), 
@@ -36,6 +36,10 @@
 #include <unistd.h> 
 #endif
 
+#if defined HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
 #include "util.h"
 #include "dbacl.h"
 
@@ -72,145 +76,42 @@ extern int cmd;
 extern char *inputfile;
 extern long inputline;
 
-/***********************************************************
- * EXPERIMENTAL:                                           *
- * this code is an experiment to see if memory mapping is  *
- * faster than buffered I/O. Surprisingly, the gain is at  *
- * best marginal (less than two percent on my test).       *
- * The code is left in for future experiments              *
- *                                                         *
- * I suspect that mmap() isn't faster because we only read *
- * the input files sequentially, never backtrack, and my   *
- * Debian development system probably reads ahead quite    *
- * agressively. So normal buffered I/O does about the same *
- * amount of work, In any case, most of the time is spent  *
- * in the hash tables and calculations anyway.             *
- *                                                         *
- * The mmap() code below is written so as to easily replace*
- * the buffered I/O functions                              *
- ***********************************************************/
+extern int parallel_jobs;
+extern int parallel_worker;
+extern long parallel_file_count;
 
-#undef EXPERIMENTAL
+/* with -t, process_directory() also reads the subdirectories */
+bool_t recurse_directories = 0;
 
-#if defined EXPERIMENTAL
+/* with -Q, process_file() decodes the lines on a second thread */
+bool_t pipeline_input = 0;
 
-#include <sys/stat.h>
-#include <errno.h>
+/* the directories being read, innermost first */
+typedef struct dir_level {
+  DIR *d;
+  char *path;
+  struct dir_level *up;
+} dir_level_t;
 
+/* the state of process_directory(), see next_dir_walk_file() */
 typedef struct {
-  FILE *f;
-  size_t fsize;
-  size_t fmappos;
-  size_t fmapsize;
-  char *seekpos;
-  char *mstart;
-} MMFILE;
-
-int MMEOF(MMFILE *stream) {
-  return stream->mstart && ((stream->seekpos - stream->mstart) + 
-			    stream->fmappos >= stream->fsize);
-}
-
-MMFILE *MMOPEN(FILE *f) {
-  MMFILE *stream = NULL;
-  struct stat sb;
-  if( f ) {
-    stream = (MMFILE *)malloc(sizeof(MMFILE));
-    if( stream ) {
-      stream->f = f;
-#define MEGABYTES 20
-      stream->fmapsize = MEGABYTES*1024*1024;
-      if( fstat(fileno(f), &sb) == -1 ) {
-	free(stream);
-	return NULL;
-      }
-      stream->fsize = sb.st_size;
-      stream->fmappos = 0;
-      stream->mstart = MMAP(NULL, stream->fmapsize, PROT_READ, MAP_SHARED,
-			    fileno(stream->f), stream->fmappos);
-      if( stream->mstart == MAP_FAILED ) {
-	free(stream);
-	return NULL;
-      }
-      stream->seekpos = stream->mstart;
-
-      if( stream->mstart ) {
-	MADVISE(stream->mstart, stream->fmapsize, MADV_SEQUENTIAL);
-      }
-    }
-  }
-  return stream;
-}
-
-int MMCLOSE(MMFILE *stream) {
-  int r = 0;
-  if( stream ) {
-    r = MUNMAP(stream->mstart, stream->fmapsize);
-    free(stream);
-  }
-  return r;
-}
-
-void MMFORWARD(MMFILE *stream) {
-  size_t offset;
-  if( stream->fmappos + stream->fmapsize < stream->fsize ) {
-    offset = stream->seekpos - stream->mstart;
-    if( MUNMAP(stream->mstart, stream->fmapsize) == -1 ) {
-      free(stream);
-      exit(0);
-    }
-
-    stream->fmappos += system_pagesize * (offset/system_pagesize);
-    stream->mstart = MMAP(0, stream->fmapsize, PROT_READ, MAP_SHARED,
-			  fileno(stream->f), stream->fmappos);
-    if( stream->mstart == MAP_FAILED ) {
-      free(stream);
-      exit(0);
-    }
-    stream->seekpos = stream->mstart + 
-      (offset - system_pagesize * (offset/system_pagesize));
-    if( stream->mstart ) {
-      MADVISE(stream->mstart, stream->fmapsize, MADV_SEQUENTIAL);
-    }
-  }
-}
-
-char *MMGETS(char *s, size_t size, MMFILE *stream) {
-  char *result = NULL;
-  size_t left;
-
-  left = stream->fmapsize - (stream->seekpos - stream->mstart);
-  if( left < size ) {
-    MMFORWARD(stream);
-    left = stream->fmapsize - (stream->seekpos - stream->mstart);
-  }
-
-  if( left <= 0 ) {
-    return NULL;
-  } else if( size <= left + 1) {
-    result = memccpy(s, stream->seekpos, '\n', size - 1);
-    if( result ) { 
-      *result = '\0';
-      stream->seekpos += result - s;
-      return s;
-    }
-  } else { 
-    result = memccpy(s, stream->seekpos, '\n', left);
-    if( result ) {
-      *result = '\0';
-      stream->seekpos = result;
-    } else {
-      memcpy(s, stream->seekpos, left);
-      s[left] = '\0';
-      stream->seekpos += left;
-    }
-    return s;
-  }
-  return NULL;
-}
-
-#endif
-
+  dir_level_t *top;
+  struct {
+    FILE *input;
+    char *path;
+  } ahead[READAHEAD_FILES]; /* files opened in advance, or NULL */
+  int first;
+  int count;
+  char *path; /* of the file last returned */
+} dir_walk_t;
+
+/* the regular file which is being read in place, see map_input_file() */
+static struct {
+  byte_t *start;
+  size_t len;
+  byte_t *released; /* the pages before this were given back */
+  volatile sig_atomic_t truncated; /* see mapped_input_sigbus() */
+} mapped_input;
 
 /***********************************************************
  * MISCELLANEOUS FILE HANDLING                             *
@@ -484,6 +385,17 @@ token_type_t get_token_type(token_order_t o) {
  * encoding doesn't include NUL bytes inside characters    *
  ***********************************************************/
 
+/* when several worker processes split the input files, each file
+ * belongs to exactly one worker, in round robin order. All workers
+ * must call this for every regular file, in the same order.
+ */
+bool_t claim_input_file() {
+  if( parallel_jobs > 1 ) {
+    return ((parallel_file_count++ % parallel_jobs) == parallel_worker);
+  }
+  return 1;
+}
+
 /* this sets up an artificial empty line to give the
  * various filters a chance to flush their caches
  */
@@ -495,6 +407,215 @@ bool_t finalize_textbuf(int *final) {
   return 0;
 }
 
+/* joins a directory and an entry name into a new path */
+static char *join_path(const char *dir, const char *name) {
+  size_t n = strlen(dir);
+  char *path;
+
+  path = (char *)malloc(n + strlen(name) + 2);
+  if( path ) {
+    strcpy(path, dir);
+    if( (n > 0) && (path[n - 1] != '/') ) {
+      path[n++] = '/';
+    }
+    strcpy(path + n, name);
+  }
+  return path;
+}
+
+/* on success, the new level owns path */
+static bool_t push_dir_level(dir_walk_t *w, char *path) {
+  dir_level_t *l;
+  DIR *d;
+
+  d = opendir(path);
+  if( d ) {
+    l = (dir_level_t *)malloc(sizeof(dir_level_t));
+    if( l ) {
+      l->d = d;
+      l->path = path;
+      l->up = w->top;
+      w->top = l;
+      return 1;
+    }
+    closedir(d);
+  }
+  return 0;
+}
+
+static void pop_dir_level(dir_walk_t *w) {
+  dir_level_t *l = w->top;
+
+  closedir(l->d);
+  free(l->path);
+  w->top = l->up;
+  free(l);
+}
+
+/* returns S_IFREG for a file, S_IFDIR for a subdirectory or 0. Most
+   systems say what the entry is, then there's no need for stat().
+   Symbolic links to directories aren't followed, so the walk can't
+   loop */
+static int dir_entry_type(struct dirent *sd, const char *path) {
+  struct stat statinfo;
+
+#if defined DT_REG && defined DT_DIR && defined DT_LNK && defined DT_UNKNOWN
+  switch(sd->d_type) {
+  case DT_REG:
+    return S_IFREG;
+  case DT_DIR:
+    return S_IFDIR;
+  case DT_LNK:
+  case DT_UNKNOWN:
+    break;
+  default:
+    return 0;
+  }
+#endif
+  if( stat(path, &statinfo) == 0 ) {
+    if( S_ISREG(statinfo.st_mode) ) {
+      return S_IFREG;
+    } else if( S_ISDIR(statinfo.st_mode) &&
+	       (lstat(path, &statinfo) == 0) && S_ISDIR(statinfo.st_mode) ) {
+      return S_IFDIR;
+    }
+  }
+  return 0;
+}
+
+/* reads the directories ahead of the file being processed, and keeps
+   up to READAHEAD_FILES of the next files open. Each is announced
+   with posix_fadvise(), so the kernel can fetch it while the current
+   file is tokenized. With -t, a subdirectory is read as soon as it
+   is found, before the rest of its parent */
+static void fill_dir_walk(dir_walk_t *w) {
+  struct dirent *sd;
+  FILE *input;
+  char *path;
+  int k;
+
+  while( w->top && (w->count < READAHEAD_FILES) ) {
+    sd = readdir(w->top->d);
+    if( !sd ) {
+      pop_dir_level(w);
+      continue;
+    }
+    if( !strcmp(sd->d_name, ".") || !strcmp(sd->d_name, "..") ) {
+      continue;
+    }
+    path = join_path(w->top->path, sd->d_name);
+    if( !path ) {
+      errormsg(E_WARNING, "not enough memory, skipping %s\n", sd->d_name);
+      continue;
+    }
+
+    switch(dir_entry_type(sd, path)) {
+    case S_IFREG:
+      /* only the worker which claims a file opens it. If that fails,
+	 the file is still queued, see next_dir_walk_file() */
+      if( claim_input_file() ) {
+	input = fopen(path, "rb");
+#if defined POSIX_FADV_WILLNEED
+	if( input ) {
+	  posix_fadvise(fileno(input), 0, 0, POSIX_FADV_WILLNEED);
+	}
+#endif
+	k = (w->first + w->count++) % READAHEAD_FILES;
+	w->ahead[k].input = input;
+	w->ahead[k].path = path;
+	path = NULL;
+      }
+      break;
+    case S_IFDIR:
+      if( recurse_directories && push_dir_level(w, path) ) {
+	path = NULL;
+      }
+      break;
+    default:
+      /* nothing */
+      break;
+    }
+
+    if( path ) {
+      free(path);
+    }
+  }
+}
+
+static bool_t open_dir_walk(dir_walk_t *w, char *name) {
+  char *path;
+
+  memset(w, 0, sizeof(dir_walk_t));
+  path = join_path(name, "");
+  if( path && push_dir_level(w, path) ) {
+    return 1;
+  }
+  if( path ) {
+    free(path);
+  }
+  return 0;
+}
+
+/* a worker which claimed a file it couldn't open must still account
+   for it, so that the parent gets the files in input order. A
+   classifier ends an empty record, and a learner records that the
+   file added no tokens. */
+static void skip_input_file(char *path, void (*post_file_fun)(char *)) {
+  if( parallel_jobs > 1 ) {
+    if( u_options & (1<<U_OPTION_CLASSIFY) ) {
+      fputc('\0', stdout);
+      fflush(stdout);
+    } else if( post_file_fun ) {
+      (*post_file_fun)(path);
+    }
+  }
+}
+
+/* returns the next file to process, already opened. Its name
+   stays in w->path until the next call. The files which couldn't
+   be opened are passed over, see skip_input_file() */
+static FILE *next_dir_walk_file(dir_walk_t *w, 
+				void (*post_file_fun)(char *)) {
+  FILE *input;
+
+  do {
+    if( w->path ) {
+      free(w->path);
+      w->path = NULL;
+    }
+    fill_dir_walk(w);
+    if( w->count == 0 ) {
+      return NULL;
+    }
+    input = w->ahead[w->first].input;
+    w->path = w->ahead[w->first].path;
+    w->first = (w->first + 1) % READAHEAD_FILES;
+    w->count--;
+    if( !input ) {
+      skip_input_file(w->path, post_file_fun);
+    }
+  } while( !input );
+  return input;
+}
+
+static void close_dir_walk(dir_walk_t *w) {
+  while( w->count > 0 ) {
+    if( w->ahead[w->first].input ) {
+      fclose(w->ahead[w->first].input);
+    }
+    free(w->ahead[w->first].path);
+    w->first = (w->first + 1) % READAHEAD_FILES;
+    w->count--;
+  }
+  while( w->top ) {
+    pop_dir_level(w);
+  }
+  if( w->path ) {
+    free(w->path);
+    w->path = NULL;
+  }
+}
+
 void process_directory(char *name,
 		       int (*line_filter)(MBOX_State *, char *),
 		       void (*character_filter)(XML_State *, char *), 
@@ -502,56 +623,53 @@ void process_directory(char *name,
 		       char *(*pre_line_fun)(char *),
 		       void (*post_line_fun)(char *),
 		       void (*post_file_fun)(char *)) {
-  DIR *d;
-  struct dirent *sd;
+  dir_walk_t w;
   FILE *input;
-  struct stat statinfo;
-  char fullp[_POSIX_PATH_MAX + 1];
-  char *fp;
 
-  d = opendir(name);
-  if( d ) {
-    /* directory returns relative file names, but we need full paths */
-    strcpy(fullp, name);
-    fp = fullp + strlen(name); 
-    if( (fp > fullp) && (fp[-1] != '/') ) {
-      *fp++ = '/';
-    }
-
-    for(sd = readdir(d); sd; sd = readdir(d)) {
-      strcpy(fp, sd->d_name);
-
-      if( stat(fullp, &statinfo) == 0 ) {
-	switch(statinfo.st_mode & S_IFMT) {
-	case S_IFREG:
-	  input = fopen(fullp, "rb");
-	  if( input ) {
-	    inputfile = fullp;
-	    /* set some initial options */
-	    reset_xml_character_filter(&xml, xmlRESET);
+  if( open_dir_walk(&w, name) ) {
+    while( (input = next_dir_walk_file(&w, post_file_fun)) ) {
+      inputfile = w.path;
+      /* set some initial options */
+      reset_xml_character_filter(&xml, xmlRESET);
       
-	    if( m_options & (1<<M_OPTION_MBOX_FORMAT) ) {
-	      reset_mbox_line_filter(&mbox);
-	    }
-	    process_file(input, line_filter, character_filter, 
-			 word_fun, pre_line_fun, post_line_fun);
-	    fclose(input);
-
-	    if( post_file_fun ) { (*post_file_fun)(fullp); }
-
-	  }
-	default:
-	  /* nothing */
-	  break;
-	}
+      if( m_options & (1<<M_OPTION_MBOX_FORMAT) ) {
+	reset_mbox_line_filter(&mbox);
       }
+      process_file(input, line_filter, character_filter, 
+		   word_fun, pre_line_fun, post_line_fun);
+      fclose(input);
+
+      if( post_file_fun ) { (*post_file_fun)(w.path); }
     }
-    closedir(d);
+    inputfile = name;
+    close_dir_walk(&w);
   } else {
     errormsg(E_WARNING, "could not open %s, skipping\n", name);
   }
 }
 
+/* the lines of a mapped file are only read once, so the pages before
+   *buf can go. They stay in the page cache, but no longer count
+   towards our own memory use, which would otherwise grow with the
+   size of the file. If the file was truncated under us, *buf skips
+   to the end, so the reader stops as if it had reached EOF */
+static void release_mapped_input(const char **buf, const char *end) {
+  byte_t *p;
+
+  if( mapped_input.truncated ) {
+    if( *buf < end ) {
+      errormsg(E_WARNING, "%s was truncated while being read\n", inputfile);
+      *buf = end;
+    }
+  } else if( mapped_input.start && 
+	     ((byte_t *)*buf - mapped_input.released >= MAPPED_INPUT_RELEASE) ) {
+    p = mapped_input.start + PAGEALIGN((byte_t *)*buf - mapped_input.start);
+    MADVISE(mapped_input.released, p - mapped_input.released, 
+	    MADV_DONTNEED);
+    mapped_input.released = p;
+  }
+}
+
 void reset_current_token(char *tokbuf, char **q, token_order_t *how_many) {
   tokbuf[0] = DIAMOND;
   tokbuf[1] = '\0';
@@ -559,13 +677,240 @@ void reset_current_token(char *tokbuf, char **q, token_order_t *how_many) {
   *how_many = 0;
 }
 
-/* reads a text file as input and applies several filters. */
-void process_file(FILE *input, 
-		  int (*line_filter)(MBOX_State *, char *),
-		  void (*character_filter)(XML_State *, char *), 
-		  void (*word_fun)(char *, token_type_t, regex_count_t), 
-		  char *(*pre_line_fun)(char *),
-		  void (*post_line_fun)(char *)) {
+#if defined HAVE_LIBPTHREAD
+
+/* a batch holds consecutive decoded lines, each stored as its token
+   class byte followed by the NUL terminated line. Only the decoder
+   touches cmd, a reload request is passed on as an empty line whose
+   class byte is PIPELINE_RELOAD */
+#define PIPELINE_RELOAD 0x80
+typedef struct {
+  char *text;
+  charbuf_len_t len;
+  charbuf_len_t size;
+} line_batch_t;
+
+/* the decoder fills the batches after the head in turn, the
+   tokenizer empties them from the head */
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t filled;
+  pthread_cond_t emptied;
+  line_batch_t batch[PIPELINE_BATCHES];
+  int head;
+  int count;
+  bool_t done;
+  token_class_t last_cls;
+} pipeline;
+
+/* what the decoding thread needs to read the document */
+typedef struct {
+  FILE *input;
+  const char *buf;
+  const char *end;
+  int extra_lines;
+  int (*line_filter)(MBOX_State *, char *);
+  void (*character_filter)(XML_State *, char *);
+} line_decoder_t;
+
+/* the class of the line being tokenized, see pipelined_token_type() */
+static token_class_t pipeline_cls;
+
+/* the decoder already worked out the token class, which depends on
+   the mbox state after the line was filtered */
+static token_type_t pipelined_token_type(token_order_t o) {
+  token_type_t tt;
+  tt.order = o;
+  tt.mark = 0;
+  tt.cls = pipeline_cls;
+  return tt;
+}
+
+static void append_batch_line(line_batch_t *b, token_class_t cls, 
+			      const char *line) {
+  charbuf_len_t n = strlen(line) + 2;
+  char *p;
+
+  if( b->len + n > b->size ) {
+    p = (char *)realloc(b->text, b->len + n + PIPELINE_BATCH);
+    if( !p ) {
+      errormsg(E_FATAL, "not enough memory for input line (%d bytes)\n",
+	       n);
+    }
+    b->text = p;
+    b->size = b->len + n + PIPELINE_BATCH;
+  }
+  b->text[b->len] = (char)cls;
+  memcpy(b->text + b->len + 1, line, n - 1);
+  b->len += n;
+}
+
+/* hands the batch being filled over to the tokenizer, and waits
+   until the next one is free */
+static line_batch_t *queue_line_batch() {
+  line_batch_t *b;
+
+  pthread_mutex_lock(&pipeline.lock);
+  pipeline.count++;
+  pthread_cond_signal(&pipeline.filled);
+  while( pipeline.count == PIPELINE_BATCHES ) {
+    pthread_cond_wait(&pipeline.emptied, &pipeline.lock);
+  }
+  b = &pipeline.batch[(pipeline.head + pipeline.count) % PIPELINE_BATCHES];
+  pthread_mutex_unlock(&pipeline.lock);
+  return b;
+}
+
+/* the first stage of process_lines_pipelined(): reads the lines and
+   runs the line and character filters. This thread owns textbuf and
+   the mbox and xml states until it is done */
+static void *line_decoder(void *arg) {
+  line_decoder_t *d = (line_decoder_t *)arg;
+  line_batch_t *b = &pipeline.batch[pipeline.head];
+
+  while( d->input ? fill_textbuf(d->input, &d->extra_lines) :
+	 fill_textbuf_from_memory(&d->buf, d->end, &d->extra_lines) ) {
+    inputline++;
+    if( *textbuf && 
+	(!d->line_filter || (*d->line_filter)(&mbox, textbuf)) ) {
+      if( d->character_filter ) { (*d->character_filter)(&xml, textbuf); }
+      append_batch_line(b, get_token_type(0).cls, textbuf);
+      if( b->len >= PIPELINE_BATCH ) {
+	b = queue_line_batch();
+      }
+    }
+    if( cmd & (1<<CMD_RELOAD_CATS) ) {
+      append_batch_line(b, PIPELINE_RELOAD, "");
+      cmd &= ~(1<<CMD_RELOAD_CATS);
+    }
+    if( !d->input ) { release_mapped_input(&d->buf, d->end); }
+  }
+  pipeline.last_cls = get_token_type(0).cls;
+
+  pthread_mutex_lock(&pipeline.lock);
+  if( b->len > 0 ) {
+    pipeline.count++;
+  }
+  pipeline.done = 1;
+  pthread_cond_signal(&pipeline.filled);
+  pthread_mutex_unlock(&pipeline.lock);
+  return NULL;
+}
+
+/* same as the loop of process_lines(), but the lines are read and
+   decoded on a second thread, while this one tokenizes the lines
+   decoded earlier. Returns 0 if the thread couldn't be started, and
+   nothing was read */
+static bool_t process_lines_pipelined(FILE *input, const char *buf, 
+				      const char *end, int extra_lines,
+				      int (*line_filter)(MBOX_State *, char *),
+				      void (*character_filter)(XML_State *, char *), 
+				      void (*word_fun)(char *, token_type_t, regex_count_t)) {
+  pthread_t tid;
+  line_decoder_t d;
+  line_batch_t *b;
+  char *p;
+  regex_count_t i;
+  char tokbuf[(MAX_TOKEN_LEN+1)*MAX_SUBMATCH+EXTRA_TOKEN_LEN];
+  char *q;
+  token_order_t how_many;
+  int j;
+
+  d.input = input;
+  d.buf = buf;
+  d.end = end;
+  d.extra_lines = extra_lines;
+  d.line_filter = line_filter;
+  d.character_filter = character_filter;
+
+  memset(&pipeline, 0, sizeof(pipeline));
+  pthread_mutex_init(&pipeline.lock, NULL);
+  pthread_cond_init(&pipeline.filled, NULL);
+  pthread_cond_init(&pipeline.emptied, NULL);
+
+  if( pthread_create(&tid, NULL, line_decoder, &d) != 0 ) {
+    pthread_cond_destroy(&pipeline.emptied);
+    pthread_cond_destroy(&pipeline.filled);
+    pthread_mutex_destroy(&pipeline.lock);
+    return 0;
+  }
+
+  reset_current_token(tokbuf, &q, &how_many);
+
+  while( 1 ) {
+    pthread_mutex_lock(&pipeline.lock);
+    while( (pipeline.count == 0) && !pipeline.done ) {
+      pthread_cond_wait(&pipeline.filled, &pipeline.lock);
+    }
+    if( pipeline.count == 0 ) {
+      pthread_mutex_unlock(&pipeline.lock);
+      break;
+    }
+    b = &pipeline.batch[pipeline.head];
+    pthread_mutex_unlock(&pipeline.lock);
+
+    for(p = b->text; p < b->text + b->len; p += strlen(p) + 1) {
+      if( (unsigned char)*p == PIPELINE_RELOAD ) {
+	p++;
+	reload_all_categories();
+	continue;
+      }
+      pipeline_cls = (token_class_t)*p++;
+
+      if( (u_options & (1<<U_OPTION_DEBUG)) && 
+	  (u_options & (1<<U_OPTION_CLASSIFY)) ) {
+	fprintf(stdout, "%s", p);
+      }
+      for(i = 0; i < regex_count; i++) {
+	regex_tokenizer(p, i, word_fun, pipelined_token_type);
+      }
+      if( (m_options & (1<<M_OPTION_USE_STDTOK)) ) {
+	std_tokenizer(p, &q, tokbuf, &how_many, ngram_order,
+		      word_fun, pipelined_token_type);
+      }
+
+      if( !(m_options & (1<<M_OPTION_NGRAM_STRADDLE_NL)) ) {
+	reset_current_token(tokbuf, &q, &how_many);
+      }
+    }
+    b->len = 0;
+
+    pthread_mutex_lock(&pipeline.lock);
+    pipeline.head = (pipeline.head + 1) % PIPELINE_BATCHES;
+    pipeline.count--;
+    pthread_cond_signal(&pipeline.emptied);
+    pthread_mutex_unlock(&pipeline.lock);
+  }
+  pthread_join(tid, NULL);
+
+  if( (m_options & (1<<M_OPTION_USE_STDTOK)) ) { 
+    pipeline_cls = pipeline.last_cls;
+    std_tokenizer(NULL, &q, tokbuf, &how_many, ngram_order,
+		  word_fun, pipelined_token_type);
+  }
+
+  for(j = 0; j < PIPELINE_BATCHES; j++) {
+    if( pipeline.batch[j].text ) {
+      free(pipeline.batch[j].text);
+    }
+  }
+  pthread_cond_destroy(&pipeline.emptied);
+  pthread_cond_destroy(&pipeline.filled);
+  pthread_mutex_destroy(&pipeline.lock);
+  return 1;
+}
+
+#endif
+
+/* reads a document line by line and applies several filters. The
+   lines come from the input stream if there is one, otherwise from
+   the memory between buf and end. */
+static void process_lines(FILE *input, const char *buf, const char *end,
+			  int (*line_filter)(MBOX_State *, char *),
+			  void (*character_filter)(XML_State *, char *), 
+			  void (*word_fun)(char *, token_type_t, regex_count_t), 
+			  char *(*pre_line_fun)(char *),
+			  void (*post_line_fun)(char *)) {
   char *pptextbuf;
   regex_count_t i;
   char tokbuf[(MAX_TOKEN_LEN+1)*MAX_SUBMATCH+EXTRA_TOKEN_LEN];
@@ -576,7 +921,11 @@ void process_file(FILE *input,
   /* initialize the norex state */
   reset_current_token(tokbuf, &q, &how_many);
 
-  set_iobuf_mode(input);
+  /* in server mode, the stream is shared by many messages, so
+     setvbuf() was already called once and for all */
+  if( input && !(u_options & (1<<U_OPTION_SERVER)) ) {
+    set_iobuf_mode(input);
+  }
 
   inputline = 0;
 
@@ -584,8 +933,19 @@ void process_file(FILE *input,
      needed for plain text */
   if( u_options & (1<<U_OPTION_FILTER) ) { extra_lines = 0; }
 
+#if defined HAVE_LIBPTHREAD
+  /* the line functions must see the lines as they are read, so they
+     rule out the pipeline */
+  if( pipeline_input && !pre_line_fun && !post_line_fun &&
+      process_lines_pipelined(input, buf, end, extra_lines,
+			      line_filter, character_filter, word_fun) ) {
+    return;
+  }
+#endif
+
   /* now start processing */
-  while( fill_textbuf(input, &extra_lines) ) {
+  while( input ? fill_textbuf(input, &extra_lines) :
+	 fill_textbuf_from_memory(&buf, end, &extra_lines) ) {
     inputline++;
     /* preprocesses textbuf, optionally censors it */
     if( pre_line_fun ) {
@@ -636,6 +996,8 @@ void process_file(FILE *input,
       cmd &= ~(1<<CMD_RELOAD_CATS);
     }
 
+    if( !input ) { release_mapped_input(&buf, end); }
+
   }
   /* since std_tokenizer tokens can straddle lines, we should
      flush the last token fragment - note this has nothing to do with
@@ -648,6 +1010,136 @@ void process_file(FILE *input,
   }
 }
 
+#if defined SA_SIGINFO && defined MAP_ANONYMOUS
+
+/* a mapped file which is truncated, e.g. a mail spool or a rotated
+   log, raises SIGBUS when the pages past its new end are read. The
+   stdio path just sees EOF there, so this handler makes the reader
+   do the same: it maps a page of newlines in place of each missing
+   page that is touched, which ends the current line, and then
+   release_mapped_input() stops the reader. A SIGBUS anywhere else
+   is fatal, as usual. */
+static struct sigaction sigbus_saved;
+
+static void mapped_input_sigbus(int signum, siginfo_t *info, void *context) {
+  byte_t *p = (byte_t *)info->si_addr;
+  byte_t *end = mapped_input.start + mapped_input.len;
+
+  if( !mapped_input.start || (p < mapped_input.start) || (p >= end) ) {
+    sigaction(SIGBUS, &sigbus_saved, NULL);
+    return;
+  }
+  p = mapped_input.start + PAGEALIGN(p - mapped_input.start);
+  if( mmap(p, system_pagesize, PROT_READ|PROT_WRITE, 
+	   MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0) == MAP_FAILED ) {
+    sigaction(SIGBUS, &sigbus_saved, NULL);
+    return;
+  }
+  memset(p, '\n', system_pagesize);
+  mapped_input.truncated = 1;
+}
+
+static void catch_mapped_input_sigbus() {
+  struct sigaction act;
+
+  memset(&act, 0, sizeof(act));
+  act.sa_sigaction = mapped_input_sigbus;
+  act.sa_flags = SA_SIGINFO;
+  sigemptyset(&act.sa_mask);
+  sigaction(SIGBUS, &act, &sigbus_saved);
+}
+
+static void release_mapped_input_sigbus() {
+  sigaction(SIGBUS, &sigbus_saved, NULL);
+}
+
+#else
+
+#define catch_mapped_input_sigbus()
+#define release_mapped_input_sigbus()
+
+#endif
+
+/* maps the unread part of a regular input file into memory, so its
+   lines can be read in place without a copy through stdio. Returns
+   NULL for pipes and terminals, small files, and the stdin of server
+   mode, which holds many messages. Mapping can also fail, e.g. for a
+   file larger than the address space. The caller reads those through
+   stdio instead */
+static byte_t *map_input_file(FILE *input, size_t *len, long *offset) {
+  struct stat sb;
+  byte_t *start;
+
+  if( (u_options & (1<<U_OPTION_SERVER)) ||
+      (fstat(fileno(input), &sb) != 0) || !S_ISREG(sb.st_mode) ||
+      ((off_t)(long)sb.st_size != sb.st_size) ||
+      ((off_t)(size_t)sb.st_size != sb.st_size) ) {
+    return NULL;
+  }
+  /* stdin may have been read partially before we got it */
+  *offset = ftell(input);
+  if( (*offset < 0) || ((long)sb.st_size - *offset < MAPPED_INPUT_MIN) ) {
+    return NULL;
+  }
+  *len = (size_t)sb.st_size;
+  start = (byte_t *)MMAP(0, *len, PROT_READ, MAP_PRIVATE, fileno(input), 0);
+  if( start == MAP_FAILED ) {
+    return NULL;
+  }
+  if( start ) {
+    MADVISE(start, *len, MADV_SEQUENTIAL);
+    mapped_input.start = start;
+    mapped_input.len = *len;
+    mapped_input.released = start;
+    mapped_input.truncated = 0;
+    catch_mapped_input_sigbus();
+  }
+  return start;
+}
+
+/* the input was read in place, leave the stream at its end */
+static void unmap_input_file(FILE *input, byte_t *start, size_t len) {
+  release_mapped_input_sigbus();
+  MUNMAP(start, len);
+  memset((void *)&mapped_input, 0, sizeof(mapped_input));
+  fseek(input, 0, SEEK_END);
+}
+
+/* reads a text file as input and applies several filters. */
+void process_file(FILE *input, 
+		  int (*line_filter)(MBOX_State *, char *),
+		  void (*character_filter)(XML_State *, char *), 
+		  void (*word_fun)(char *, token_type_t, regex_count_t), 
+		  char *(*pre_line_fun)(char *),
+		  void (*post_line_fun)(char *)) {
+  byte_t *start;
+  size_t len;
+  long offset;
+
+  start = map_input_file(input, &len, &offset);
+  if( start ) {
+    process_lines(NULL, (char *)start + offset, (char *)start + len,
+		  line_filter, character_filter,
+		  word_fun, pre_line_fun, post_line_fun);
+    unmap_input_file(input, start, len);
+  } else {
+    process_lines(input, NULL, NULL, line_filter, character_filter,
+		  word_fun, pre_line_fun, post_line_fun);
+  }
+}
+
+/* same as process_file(), for a document which is already in memory.
+   This skips stdio entirely. */
+void process_buffer(const char *buf, size_t len,
+		    int (*line_filter)(MBOX_State *, char *),
+		    void (*character_filter)(XML_State *, char *), 
+		    void (*word_fun)(char *, token_type_t, regex_count_t), 
+		    char *(*pre_line_fun)(char *),
+		    void (*post_line_fun)(char *)) {
+  process_lines(NULL, buf, buf + len, line_filter, character_filter,
+		word_fun, pre_line_fun, post_line_fun);
+}
+
 
 /***********************************************************
  * WIDE CHARACTER FILE HANDLING FUNCTIONS                  *
@@ -663,65 +1155,41 @@ void w_process_directory(char *name,
 			 char *(*pre_line_fun)(char *),
 			 void (*post_line_fun)(char *),
 			 void (*post_file_fun)(char *)) {
-  DIR *d;
-  struct dirent *sd;
+  dir_walk_t w;
   FILE *input;
-  struct stat statinfo;
-  char fullp[_POSIX_PATH_MAX + 1];
-  char *fp;
 
-  d = opendir(name);
-  if( d ) {
-    /* directory returns relative file names, but we need full paths */
-    strcpy(fullp, name);
-    fp = fullp + strlen(name); 
-    if( (fp > fullp) && (fp[-1] != '/') ) {
-      *fp++ = '/';
-    }
-
-    for(sd = readdir(d); sd; sd = readdir(d)) {
-      strcpy(fp, sd->d_name);
-
-      if( stat(fullp, &statinfo) == 0 ) {
-	switch(statinfo.st_mode & S_IFMT) {
-	case S_IFREG:
-	  input = fopen(fullp, "rb");
-	  if( input ) {
-	    inputfile = fullp;
-	    /* set some initial options */
-	    reset_xml_character_filter(&xml, xmlRESET);
+  if( open_dir_walk(&w, name) ) {
+    while( (input = next_dir_walk_file(&w, post_file_fun)) ) {
+      inputfile = w.path;
+      /* set some initial options */
+      reset_xml_character_filter(&xml, xmlRESET);
       
-	    if( m_options & (1<<M_OPTION_MBOX_FORMAT) ) {
-	      reset_mbox_line_filter(&mbox);
-	    }
-	    w_process_file(input, w_line_filter, w_character_filter, 
-			   word_fun, pre_line_fun, post_line_fun);
-	    fclose(input);
-
-	    if( post_file_fun ) { (*post_file_fun)(fullp); }
-	    
-	  }
-	default:
-	  /* nothing */
-	  break;
-	}
+      if( m_options & (1<<M_OPTION_MBOX_FORMAT) ) {
+	reset_mbox_line_filter(&mbox);
       }
+      w_process_file(input, w_line_filter, w_character_filter, 
+		     word_fun, pre_line_fun, post_line_fun);
+      fclose(input);
+
+      if( post_file_fun ) { (*post_file_fun)(w.path); }
     }
-    closedir(d);
+    inputfile = name;
+    close_dir_walk(&w);
   } else {
     errormsg(E_WARNING, "could not open %s, skipping\n", name);
   }
 }
 
-/* reads a text file as input, converting each line
+/* reads a document line by line, converting each line
 into a wide character representation and applies several
-filters. */
-void w_process_file(FILE *input, 
-		    int (*line_filter)(MBOX_State *,wchar_t *),
-		    void (*character_filter)(XML_State *,wchar_t *), 
-		    void (*word_fun)(char *, token_type_t, regex_count_t), 
-		    char *(*pre_line_fun)(char *),
-		    void (*post_line_fun)(char *)) {
+filters. The lines come from the input stream if there is one, 
+otherwise from the memory between buf and end. */
+static void w_process_lines(FILE *input, const char *buf, const char *end,
+			    int (*line_filter)(MBOX_State *,wchar_t *),
+			    void (*character_filter)(XML_State *,wchar_t *), 
+			    void (*word_fun)(char *, token_type_t, regex_count_t), 
+			    char *(*pre_line_fun)(char *),
+			    void (*post_line_fun)(char *)) {
   char *pptextbuf;
   regex_count_t i;
   mbstate_t input_shiftstate;
@@ -732,7 +1200,9 @@ void w_process_file(FILE *input,
   wchar_t *wcp;
   char wcq[MB_LEN_MAX+1];
 
-  set_iobuf_mode(input);
+  if( input && !(u_options & (1<<U_OPTION_SERVER)) ) {
+    set_iobuf_mode(input);
+  }
 
   /* initialize the norex state */
   reset_current_token(tokbuf, &q, &how_many);
@@ -743,7 +1213,8 @@ void w_process_file(FILE *input,
      needed for plain text */
   if( u_options & (1<<U_OPTION_FILTER) ) { extra_lines = 0; }
 
-  while( fill_textbuf(input, &extra_lines) ) {
+  while( input ? fill_textbuf(input, &extra_lines) :
+	 fill_textbuf_from_memory(&buf, end, &extra_lines) ) {
     inputline++;
     /* preprocesses textbuf, optionally censors it */
     if( pre_line_fun ) {
@@ -799,6 +1270,8 @@ void w_process_file(FILE *input,
       cmd &= ~(1<<CMD_RELOAD_CATS);
     }
 
+    if( !input ) { release_mapped_input(&buf, end); }
+
   }
   /* since w_std_tokenizer tokens can straddle lines, we should
      flush the last token fragment */
@@ -810,4 +1283,40 @@ void w_process_file(FILE *input,
 
 }
 
+/* reads a text file as input, converting each line
+into a wide character representation and applies several
+filters. */
+void w_process_file(FILE *input, 
+		    int (*line_filter)(MBOX_State *,wchar_t *),
+		    void (*character_filter)(XML_State *,wchar_t *), 
+		    void (*word_fun)(char *, token_type_t, regex_count_t), 
+		    char *(*pre_line_fun)(char *),
+		    void (*post_line_fun)(char *)) {
+  byte_t *start;
+  size_t len;
+  long offset;
+
+  start = map_input_file(input, &len, &offset);
+  if( start ) {
+    w_process_lines(NULL, (char *)start + offset, (char *)start + len,
+		    line_filter, character_filter,
+		    word_fun, pre_line_fun, post_line_fun);
+    unmap_input_file(input, start, len);
+  } else {
+    w_process_lines(input, NULL, NULL, line_filter, character_filter,
+		    word_fun, pre_line_fun, post_line_fun);
+  }
+}
+
+/* same as w_process_file(), for a document which is already in memory */
+void w_process_buffer(const char *buf, size_t len,
+		      int (*line_filter)(MBOX_State *,wchar_t *),
+		      void (*character_filter)(XML_State *,wchar_t *), 
+		      void (*word_fun)(char *, token_type_t, regex_count_t), 
+		      char *(*pre_line_fun)(char *),
+		      void (*post_line_fun)(char *)) {
+  w_process_lines(NULL, buf, buf + len, line_filter, character_filter,
+		  word_fun, pre_line_fun, post_line_fun);
+}
+
 #endif /* DISABLE_WCHAR */
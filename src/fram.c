@@ -31,6 +31,14 @@ long inputline;
 
 int cmd = 0;
 
+/* number of worker processes, and which one we are */
+int parallel_jobs = 1;
+int parallel_worker = 0;
+long parallel_file_count = 0;
+
+/* number of threads optimizing the learner's weights */
+int learner_threads = 1;
+
 options_t u_options = 0;
 options_t m_options = 0;
 
@@ -51,6 +59,7 @@ regex_count_t antiregex_count = 0;
 
 char *extn = "";
 empirical_t empirical;
+classifier_t classifier;
 
 MBOX_State mbox;
 XML_State xml;
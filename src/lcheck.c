@@ -0,0 +1,140 @@
+/* 
+ * Copyright (C) 2002 Laird Breyer
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA.
+ * 
+ * Author:   Laird Breyer <laird@lbreyer.com>
+ */
+
+/* 
+ * This program only uses the public libdbacl interface, and is used
+ * to check that the library gives the same results as dbacl.
+ *
+ * lcheck [-T type] -l category FILE...
+ * lcheck -c category [-c category]... FILE...
+ *
+ * The second form prints the same output as dbacl -n -F, once for
+ * each file read into memory and once for each file read from a
+ * descriptor.
+ * If a category can't be loaded, it exits with status 2.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#if defined HAVE_UNISTD_H
+#include <unistd.h> 
+#endif
+
+#include "libdbacl.h"
+
+static char *read_file(const char *name, size_t *len) {
+  FILE *input;
+  char *buf = NULL;
+  size_t n, size = 0;
+
+  *len = 0;
+  input = fopen(name, "rb");
+  if( input ) {
+    do {
+      if( *len == size ) {
+	size = size ? 2 * size : BUFSIZ;
+	buf = (char *)realloc(buf, size);
+	if( !buf ) { break; }
+      }
+      n = fread(buf + *len, 1, size - *len, input);
+      *len += n;
+    } while( n > 0 );
+    fclose(input);
+  }
+  return buf;
+}
+
+static void print_scores(dbacl_t *d, const char *name, double *scores) {
+  int i;
+  fprintf(stdout, "%s ", name);
+  for(i = 0; i < dbacl_category_count(d); i++) {
+    fprintf(stdout, "%s %5.2f ", dbacl_category_name(d, i), scores[i]);
+  }
+  fprintf(stdout, "\n");
+}
+
+int main(int argc, char **argv) {
+  dbacl_t *d;
+  double *scores;
+  char *learn = NULL;
+  char *buf;
+  size_t len;
+  int i, fd;
+
+  if( dbacl_api_version() != LIBDBACL_API_VERSION ) { exit(1); }
+
+  d = dbacl_open();
+  if( !d ) { exit(1); }
+
+  for(i = 1; (i < argc - 1) && (argv[i][0] == '-'); i += 2) {
+    switch(argv[i][1]) {
+    case 'T':
+      if( dbacl_set_format(d, argv[i + 1]) != 0 ) { exit(1); }
+      break;
+    case 'l':
+      learn = argv[i + 1];
+      break;
+    case 'c':
+      if( dbacl_load_category(d, argv[i + 1]) < 0 ) {
+	/* the library must survive this, and a new handle work */
+	dbacl_close(d);
+	d = dbacl_open();
+	fprintf(stdout, "could not load %s\n", argv[i + 1]);
+	exit(d ? 2 : 1);
+      }
+      break;
+    default:
+      exit(1);
+    }
+  }
+
+  scores = (double *)calloc(dbacl_category_count(d) + 1, sizeof(double));
+  if( !scores ) { exit(1); }
+
+  for(; i < argc; i++) {
+    buf = read_file(argv[i], &len);
+    if( !buf ) { exit(1); }
+    if( learn ) {
+      if( dbacl_learn_buffer(d, learn, buf, len) != 0 ) { exit(1); }
+    } else {
+      if( dbacl_classify_buffer(d, buf, len, scores) < 0 ) { exit(1); }
+      print_scores(d, argv[i], scores);
+
+      fd = open(argv[i], O_RDONLY);
+      if( (fd == -1) || (dbacl_classify_fd(d, fd, scores) < 0) ) { exit(1); }
+      close(fd);
+      print_scores(d, argv[i], scores);
+    }
+    free(buf);
+  }
+
+  if( learn && (dbacl_save(d) != 0) ) { exit(1); }
+
+  free(scores);
+  dbacl_close(d);
+  exit(0);
+}
@@ -0,0 +1,4935 @@
+/* 
+ * Copyright (C) 2002 Laird Breyer
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA.
+ * 
+ * Author:   Laird Breyer <laird@lbreyer.com>
+ */
+
+/* 
+ * The category learner. This used to live in dbacl.c, and is now
+ * part of libdbacl so that other programs can learn and save
+ * categories without running the dbacl executable.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <math.h>
+#include <ctype.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+
+#if defined HAVE_UNISTD_H
+#include <unistd.h> 
+#include <sys/types.h>
+#include <sys/time.h>
+#endif
+
+#if defined HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#include "util.h"
+#include "dbacl.h" /* make sure this is last */
+
+/* global variables */
+
+extern signal_cleanup_t cleanup;
+
+extern hash_bit_count_t default_max_hash_bits;
+extern hash_count_t default_max_tokens;
+
+extern hash_bit_count_t default_max_grow_hash_bits;
+extern hash_count_t default_max_grow_tokens;
+
+hash_bit_count_t decimation;
+int zthreshold = 0;
+int zsketch = 0;
+
+dirichlet_t dirichlet;
+
+extern category_t cat[MAX_CAT];
+
+extern myregex_t re[MAX_RE];
+extern regex_count_t regex_count;
+
+extern empirical_t empirical;
+
+extern options_t u_options;
+extern options_t m_options;
+extern charparser_t m_cp;
+extern digtype_t m_dt;
+
+/* for counting emails */
+bool_t not_header; 
+extern MBOX_State mbox;
+
+char *digtype = "";
+char *online = "";
+extern char *progname;
+
+int overflow_warning = 0;
+int digramic_overflow_warning = 0;
+int skewed_constraints_warning = 0;
+
+extern long system_pagesize;
+extern int learner_threads;
+
+extern void *in_iobuf;
+extern void *out_iobuf;
+
+/* tolerance for the error in divergence - this can be changed with -q.
+   More accuracy means slower learning. This should be the same order
+   of magnitude as the error due to digitization, but we tweak them
+   to obtain timely output */
+
+int quality = 0;
+double qtol_alpha = 0.0001;
+double qtol_div = 0.01;
+double qtol_lam = CLIP_LAMBDA_TOL(0.05);
+double qtol_logz = 0.05;
+bool_t qtol_multipass = 0;
+bool_t qtol_secant = 0; /* -E secant, see minimize_secant_divergence() */
+
+/***********************************************************
+ * FILE MANAGEMENT FUNCTIONS                               *
+ ***********************************************************/
+
+bool_t check_magic_write(char *path, char *magic, size_t len) {
+  FILE *output;
+  char buf[MAGIC_BUFSIZE];
+
+  output = fopen(path, "rb");
+  if( output ) {
+    /* output file exists already */
+    if( (!feof(output) && !fgets(buf, MAGIC_BUFSIZE, output)) ||
+	(strncmp(buf, magic, len) != 0) ) {
+      errormsg(E_ERROR,"the file %s is already used for something, "
+	       "use another filename. Nothing written.\n", path);
+      fclose(output);
+      return (bool_t)0;
+    } else {
+      /* it's an existing category file */
+      fclose(output);
+    }
+  }
+  return (bool_t)1;
+}
+
+/* output -log (mediaprobs) */
+void write_mediaprobs(FILE *out, learner_t *learner) {
+  token_class_t t;
+
+  fprintf(out, MAGIC11);
+  for(t = 0; t < TOKEN_CLASS_MAX; t++) {
+    fprintf(out, "%" FMT_printf_score_t " ", -log(learner->mediaprobs[t]));
+  }
+  fprintf(out, "\n");
+}
+
+bool_t write_category_headers(learner_t *learner, FILE *output) {
+  regex_count_t c;
+  char scratchbuf[MAGIC_BUFSIZE];
+  char smb[MAX_SUBMATCH+1];
+  token_order_t s;
+  char *p;
+
+  bool_t ok = (bool_t)1;
+
+  /* print out standard category file headers */
+  ok = ok && 
+    (0 < fprintf(output, MAGIC1, learner->filename, 
+		 (m_options & (1<<M_OPTION_REFMODEL)) ? "(ref)" : ""));
+  ok = ok &&
+    (0 < fprintf(output, 
+		 MAGIC2_o, learner->divergence, learner->logZ, 
+		 (short int)learner->max_order,
+		 (m_options & (1<<M_OPTION_MULTINOMIAL)) ? "multinomial" : "hierarchical" ));
+  ok = ok &&
+    (0 < fprintf(output, MAGIC3, 
+		 (short int)learner->max_hash_bits, 
+		 (long int)learner->full_token_count, 
+		 (long int)learner->unique_token_count,
+		 (long int)(learner->doc.count)));
+
+  ok = ok &&
+    (0 < fprintf(output, MAGIC8_o,
+		 learner->shannon, learner->shannon2));
+
+  ok = ok &&
+    (0 < fprintf(output, MAGIC10_o,
+		 learner->alpha, learner->beta,
+		 learner->mu, learner->s2));
+
+  write_mediaprobs(output, learner);
+
+  /* print out any regexes we might need */
+  for(c = 0; c < regex_count; c++) {
+    /* write the bitmap */
+    smb[0] = '\0';
+    for(p = smb, s = 1; s <= MAX_SUBMATCH; s++) {
+      if( re[c].submatches & (1<<s) ) {
+	*p++ = (char)s + '0';
+      }
+    }
+    *p = '\0';
+
+    ok = ok && 
+      (0 < fprintf(output, MAGIC5_o, re[c].string, smb));
+  }
+
+  /* print options */
+  ok = ok &&
+    (0 < fprintf(output, MAGIC4_o, m_options, m_cp, m_dt,
+		 print_model_options(m_options, m_cp, scratchbuf)));
+
+  ok = ok &&
+    (0 < fprintf(output, MAGIC6)); 
+  return ok;
+}
+
+#if defined DIGITIZE_DIGRAMS
+typedef digitized_weight_t myweight_t;
+#else
+typedef weight_t myweight_t;
+#endif
+
+/* writes the learner to a file for easily readable category */
+/* the category file is first constructed as a temporary file,
+   then renamed if no problems occured. Because renames are 
+   atomic on POSIX, this guarantees that a loaded category file
+   used for classifications is never internally corrupt */
+error_code_t save_learner(learner_t *learner, char *opath) {
+
+  alphabet_size_t i, j;
+  hash_count_t t;
+  FILE *output;
+  char *tempname = NULL;
+
+  bool_t ok;
+  size_t n;
+  c_item_t ci;
+  c_item_t *ci_ptr;
+  myweight_t shval;
+  myweight_t *shval_ptr = NULL;
+
+  long mmap_offset = 0;
+  size_t mmap_length = 0;
+  byte_t *mmap_start = NULL;
+  
+
+  if( u_options & (1<<U_OPTION_VERBOSE) ) {
+    fprintf(stdout, "saving category to file %s\n", learner->filename);
+  }
+  
+  /* don't overwrite data files */
+  if( !check_magic_write(learner->filename, MAGIC1, 10) ) {
+    exit_fatal();
+  }
+  
+  /* In case we have both the -m and -o switches we try to write the
+     data with mmap. We don't do this in general, because mmap can
+     cause corruption, but if -m and -o are used together, we assume the 
+     user knows that a single process must read/write the file at a time.
+     Also, we don't try to create the file - if the file doesn't exist,
+     we won't gain much time by using mmap on that single occasion. */
+  if( opath && *opath && (u_options & (1<<U_OPTION_MMAP)) ) {
+    ok = (bool_t)0; 
+    output = fopen(learner->filename, "r+b");
+    if( output ) {
+      ok = (bool_t)1;
+      if( out_iobuf ) {
+	setvbuf(output, (char *)out_iobuf, (int)_IOFBF, (size_t)(BUFFER_MAG * system_pagesize));
+      }
+
+      ok = ok && write_category_headers(learner, output);
+      if( !ok ) { 
+	goto skip_mmap; 
+      }
+      /* now mmap the file and write out the arrays real quick */
+      mmap_offset = ftell(output);
+      if( mmap_offset == (long)-1 ) { 
+	ok = 0;
+	goto skip_mmap; 
+      }
+      mmap_length = (size_t)mmap_offset + (ASIZE * ASIZE * SIZEOF_DIGRAMS) + 
+	learner->max_tokens * sizeof(c_item_t);
+
+      ok = ok && (-1 != ftruncate(fileno(output), (off_t)mmap_length));
+      if( !ok ) { 
+	goto skip_mmap; 
+      }
+
+      mmap_start = (byte_t *)MMAP(0, mmap_length, 
+				  PROT_READ|PROT_WRITE, MAP_SHARED, fileno(output), 0);
+      if( mmap_start == MAP_FAILED ) { mmap_start = NULL; }
+      if( !mmap_start ) { 
+	ok = 0; 
+	goto skip_mmap;
+      }
+
+      MLOCK(mmap_start, mmap_length);
+
+      MADVISE(mmap_start, mmap_length, MADV_SEQUENTIAL|MADV_WILLNEED);
+
+      /* character frequencies */
+      shval_ptr = (myweight_t *)(mmap_start + mmap_offset);
+      for(i = 0; i < ASIZE; i++) {
+	for(j = 0; j < ASIZE; j++) {
+	  *shval_ptr = HTON_DIGRAM(PACK_DIGRAMS(learner->dig[i][j]));
+	  shval_ptr++;
+	}
+      }
+
+      /* token/feature weights */
+      ci_ptr = (c_item_t *)(mmap_start + mmap_offset + 
+			    (ASIZE * ASIZE * SIZEOF_DIGRAMS));
+      for(t = 0; t < learner->max_tokens; t++) {
+	/* write each element so that it's easy to read back in a
+	   c_item_t array */
+	SET(ci_ptr->id,learner->hash[t].id);
+	ci_ptr->lam = learner->hash[t].lam;
+
+	ci_ptr->id = HTON_ID(ci_ptr->id);
+	ci_ptr->lam = HTON_LAMBDA(ci_ptr->lam);
+	ci_ptr++;
+      }
+
+    skip_mmap:
+      fclose(output);
+      
+      if( mmap_start ) { 
+	MUNMAP(mmap_start, mmap_length);
+	mmap_start = NULL;
+      }
+    }
+
+    if( ok ) {
+      
+      return 1; /* we're done */
+    } else {
+      errormsg(E_WARNING, "could not mmap %s, trying stdio.\n", 
+	       learner->filename);
+      /* oh oh, file is corrupt. We delete it and try again below
+	 without mmap */
+      unlink(learner->filename);
+    }
+  }
+
+  /* this keeps track to see if writing is successful, 
+     it's not foolproof, but probably good enough */
+  ok = (bool_t)1; 
+
+  output = mytmpfile(learner->filename, &tempname);
+  if( output ) {
+
+    if( out_iobuf ) {
+      setvbuf(output, (char *)out_iobuf, (int)_IOFBF, (size_t)(BUFFER_MAG * system_pagesize));
+    }
+
+    ok = ok && write_category_headers(learner, output);
+
+    /* end of readable stuff */
+    if( ok ) {
+      /* now write arrays: this is far(!) from efficient, but the bits
+	 we need are not nicely tucked into a block of memory, and due
+	 to the sizes involved when dealing with possibly millions of tokens, we
+	 can't afford to malloc a brand new block just to pack everything 
+	 nicely. At least, the file buffering should mitigate the performance
+	 hit, and we prefer to learn slowly and classify fast. */
+
+      /* character frequencies */
+      for(i = 0; i < ASIZE; i++) {
+	for(j = 0; j < ASIZE; j++) {
+	  shval = HTON_DIGRAM(PACK_DIGRAMS(learner->dig[i][j]));
+	  for(n = 0; n < 1; ) {
+	    if( 0 > (n = fwrite(&shval, SIZEOF_DIGRAMS, (size_t)1, output)) ) {
+	      ok = 0;
+	      goto skip_remaining;
+	    } 
+	  }	    
+	}
+      }
+
+      MADVISE(learner->hash, sizeof(l_item_t) * learner->max_tokens, 
+	      MADV_SEQUENTIAL|MADV_WILLNEED);
+
+      /* token/feature weights */
+      for(t = 0; t < learner->max_tokens; t++) {
+	/* write each element so that it's easy to read back in a c_item_t array */
+	SET(ci.id,learner->hash[t].id);
+	ci.lam = learner->hash[t].lam;
+
+	ci.id = HTON_ID(ci.id);
+	ci.lam = HTON_LAMBDA(ci.lam);
+
+	for(n = 0; n < 1; ) {
+	  if( 0 > (n = fwrite(&ci, sizeof(ci), (size_t)1, output)) ) {
+	    ok = 0;
+	    goto skip_remaining;
+	  } 
+	}
+      }
+    }
+
+  skip_remaining:
+
+    fclose(output);
+
+    /* the rename is atomic on posix */
+    if( !ok || !myrename(tempname, learner->filename) ) { 
+      errormsg(E_ERROR, 
+	       "due to a potential file corruption, category %s was not updated\n", 
+	       learner->filename);
+      unlink(tempname);
+      cleanup.tempfile = NULL;
+    }
+    free(tempname);
+  } else {
+    errormsg(E_ERROR, "cannot open tempfile for writing %s\n", learner->filename);
+    return 0;
+  }
+
+
+  return 1;
+}
+
+/* Instead of saving a full new category file, we try to
+ * overwrite the contents of an already open, memory mapped category.
+ * CAREFUL: THIS CAN CORRUPT THE CATEGORY!
+ * If the return value is 0, then you should assume the category no 
+ * longer exists on disk.
+ */
+error_code_t fast_partial_save_learner(learner_t *learner, category_t *xcat) {
+  char *p, *q;
+#define REPLBUF (3*128)
+  char buf[REPLBUF];
+  charbuf_len_t n, max;
+
+  alphabet_size_t i, j;
+  hash_count_t t;
+  c_item_t *ci_ptr;
+  myweight_t *shval_ptr;
+
+  if( xcat->mmap_start && 
+      (xcat->model.options == learner->model.options) &&
+      (xcat->max_order == learner->max_order) &&
+      (xcat->max_hash_bits == learner->max_hash_bits) ) {
+    max = 0;
+    buf[0] = '\0';
+    /* we only overwrite the header if there's exactly enough space */
+    /* we must overwrite 3 lines which all start with # */
+    q = p = strchr((char *)xcat->mmap_start + 1, '#');
+    if( p ) {
+      n = snprintf(buf, (size_t)(REPLBUF - max), MAGIC2_o, 
+		   learner->divergence, learner->logZ, 
+		   (short int)learner->max_order,
+		   (m_options & (1<<M_OPTION_MULTINOMIAL)) ? "multinomial" : "hierarchical" );
+      max += n;
+    }
+    q = strchr(q + 1, '#');
+    if( q && (max < REPLBUF) ) {
+      n = snprintf(buf + max, (size_t)(REPLBUF - max), MAGIC3, 
+		   (short int)learner->max_hash_bits, 
+		   (long int)learner->full_token_count, 
+		   (long int)learner->unique_token_count,
+		   (long int)(learner->doc.count));
+      max += n;
+    }
+    q = strchr(q + 1, '#');
+    if( q && (max < REPLBUF) ) {
+      n = snprintf(buf + max, (size_t)(REPLBUF - max), MAGIC8_o, 
+		   learner->shannon, learner->shannon2);
+      max += n;
+    }
+    q = strchr(q + 1, '#');
+    if( q && (max < REPLBUF) ) {
+      n = snprintf(buf + max, (size_t)(REPLBUF - max), MAGIC10_o, 
+		   learner->alpha, learner->beta,
+		   learner->mu, learner->s2);
+      max += n;
+    }
+    /* now check it fits into the existing space */
+    q = strchr(q + 1, '#');
+    if( (q - p) == max ) {
+      /* from here on, there's no turning back. Since we don't
+	 overwrite everything, if there's a problem, we'll have to
+	 unlink the category */
+
+      /* header */
+      memcpy(p, buf, (size_t)max);
+
+      /* character frequencies */
+      shval_ptr = (myweight_t *)(xcat->mmap_start + xcat->mmap_offset - 
+				 ASIZE * ASIZE * sizeof(myweight_t));
+      for(i = 0; i < ASIZE; i++) {
+	for(j = 0; j < ASIZE; j++) {
+	  *shval_ptr = HTON_DIGRAM(PACK_DIGRAMS(learner->dig[i][j]));
+	  shval_ptr++;
+	}
+      }
+      /* token/feature weights 
+	 (we assume cat->max_tokens <= learner->max_tokens, and
+	 that filled hash values in cat are also filled in learner) */
+      ci_ptr = (c_item_t *)(xcat->mmap_start + xcat->mmap_offset);
+      for(t = 0; t < learner->max_tokens; t++) {
+	/* write each element so that it's easy to read back in a
+	   c_item_t array */
+	SET(ci_ptr->id,learner->hash[t].id);
+	ci_ptr->lam = learner->hash[t].lam;
+
+	ci_ptr->id = HTON_ID(ci_ptr->id);
+	ci_ptr->lam = HTON_LAMBDA(ci_ptr->lam);
+	ci_ptr++;
+	if( xcat->ctrl ) {
+	  set_hash_ctrl(xcat->ctrl, xcat->max_tokens, t, learner->hash[t].id);
+	}
+      }
+
+      if( u_options & (1<<U_OPTION_VERBOSE) ) {
+	fprintf(stdout, "partially overwriting category file %s\n",
+		learner->filename);
+      }
+      return 1;
+    }
+  }
+  if( u_options & (1<<U_OPTION_VERBOSE) ) {
+    fprintf(stdout, "can't make fast save\n");
+  }
+  return 0;
+}
+
+
+/* opens an empty temporary file for the token list */
+static bool_t tmp_open_file(learner_t *learner) {
+  learner->tmp.file = 
+    mytmpfile(learner->filename ? learner->filename : progname, 
+	      &learner->tmp.filename);
+  /* set this: in case of a fatal signal, we can unlink the temprile */
+  cleanup.tempfile = learner->tmp.filename;
+
+  learner->tmp.iobuf = NULL;   /* can't reuse in_iobuf or out_iobuf */
+  if( learner->tmp.file ) {
+#if defined HAVE_POSIX_MEMALIGN
+    /* buffer must exist until after fclose() */
+    if( 0 != posix_memalign(&learner->tmp.iobuf, system_pagesize, 
+			    BUFFER_MAG * system_pagesize) ) {
+      learner->tmp.iobuf = NULL;
+    }
+#elif defined HAVE_MEMALIGN
+    /* buffer can't be free()'d */
+    learner->tmpiobuf = (void *)memalign(system_pagesize, 
+					 BUFFER_MAG * system_pagesize);
+#elif defined HAVE_VALLOC
+    /* buffer can't be free()'d */
+    learner->tmpiobuf = (void *)valloc(BUFFER_MAG * system_pagesize);
+#endif
+    if( learner->tmp.iobuf ) {
+      setvbuf(learner->tmp.file, (char *)learner->tmp.iobuf, (int)_IOFBF, 
+	      (size_t)(BUFFER_MAG * system_pagesize));
+    }
+  }
+  return (learner->tmp.file != NULL);
+}
+
+/* the in memory token list got too big, so move it to a temporary
+   file. The file position is left at the end of the list. */
+static bool_t tmp_spill_arena(learner_t *learner) {
+  byte_t *arena = learner->tmp.arena;
+  bool_t ok;
+
+  learner->tmp.arena = NULL;
+  ok = tmp_open_file(learner) &&
+    (fwrite(arena, 1, learner->tmp.used, learner->tmp.file) == 
+     (size_t)learner->tmp.used);
+  learner->tmp.avail = learner->tmp.used;
+  free(arena);
+
+  if( ok && (u_options & (1<<U_OPTION_VERBOSE)) ) {
+    fprintf(stdout, "moved %ld bytes of tokens to %s\n", 
+	    learner->tmp.used, learner->tmp.filename);
+  }
+  return ok;
+}
+
+bool_t tmp_seek_start(learner_t *learner) {
+  if( learner->tmp.arena ) {
+    learner->tmp.arena_cursor = 0;
+    return (bool_t)1;
+  } else if( learner->tmp.mmap_start ) {
+    learner->tmp.mmap_cursor = learner->tmp.mmap_offset;
+    return (bool_t)1;
+  } else if( learner->tmp.file ) {
+    clearerr(learner->tmp.file);
+    return (fseek(learner->tmp.file, learner->tmp.offset, SEEK_SET) == 0);
+  }
+  return (bool_t)0;
+}
+
+bool_t tmp_seek_end(learner_t *learner) {
+  if( learner->tmp.arena ) {
+    learner->tmp.arena_cursor = learner->tmp.used;
+    return (bool_t)1;
+  } else if( learner->tmp.mmap_start ) {
+    learner->tmp.mmap_cursor = learner->tmp.mmap_offset + learner->tmp.used;
+    return (bool_t)1;
+  } else if( learner->tmp.file ) {
+    return (fseek(learner->tmp.file, 
+		  learner->tmp.offset + learner->tmp.used, SEEK_SET) == 0);
+  }
+  return (bool_t)0;
+}
+
+long tmp_get_pos(learner_t *learner) {
+  if( learner->tmp.arena ) {
+    return learner->tmp.arena_cursor;
+  } else if( learner->tmp.mmap_start ) {
+    return learner->tmp.mmap_cursor - learner->tmp.mmap_offset;
+  } else if( learner->tmp.file ) {
+    return ftell(learner->tmp.file) - learner->tmp.offset;
+  }
+  return (bool_t)0;
+}
+
+/* returns the start of the token list if it can be addressed directly,
+   ie it's in memory or memory mapped, NULL otherwise */
+static const byte_t *tmp_get_base(learner_t *learner) {
+  if( learner->tmp.arena ) {
+    return learner->tmp.arena;
+  } else if( learner->tmp.mmap_start ) {
+    return learner->tmp.mmap_start + learner->tmp.mmap_offset;
+  }
+  return NULL;
+}
+
+size_t tmp_read_block(learner_t *learner, byte_t *buf, size_t bufsiz,
+		      const byte_t **startp) {
+  long left = learner->tmp.used - tmp_get_pos(learner);
+  if( bufsiz > (size_t)left ) { bufsiz = (left >= 0) ? (size_t)left : 0; }
+  if( learner->tmp.arena ) {
+    *startp = learner->tmp.arena + learner->tmp.arena_cursor;
+    learner->tmp.arena_cursor += bufsiz;
+    return bufsiz;
+  } else if( learner->tmp.mmap_start ) {
+    /*     memcpy(buf, learner->tmp.mmap_start + learner->tmp.mmap_cursor, bufsiz); */
+    *startp = learner->tmp.mmap_start + learner->tmp.mmap_cursor;
+    learner->tmp.mmap_cursor += bufsiz;
+    return bufsiz;
+  } else if( learner->tmp.file ) {
+    if( ferror(learner->tmp.file) || feof(learner->tmp.file) ) {
+      return 0;
+    }
+    *startp = buf;
+    return fread(buf, 1, bufsiz, learner->tmp.file);
+  }
+  return 0;
+}
+
+/* must unmap/ftruncate/remap if using mmap, don't touch mmap_cursor */
+bool_t tmp_grow(learner_t *learner) {
+  long offset;
+  byte_t *p;
+
+  if( learner->tmp.arena &&
+      ((learner->tmp.used + 2 * MAX_TOKEN_LEN) >= learner->tmp.avail) ) {
+    p = NULL;
+    if( 2 * learner->tmp.avail <= TOKEN_ARENA_MAX ) {
+      p = (byte_t *)realloc(learner->tmp.arena, 2 * learner->tmp.avail);
+    }
+    if( p ) {
+      learner->tmp.arena = p;
+      learner->tmp.avail *= 2;
+      return (bool_t)1;
+    }
+    if( !tmp_spill_arena(learner) ) {
+      errormsg(E_FATAL,
+	       "could not move the tokens to a tempfile, unable to proceed.\n"); 
+    }
+    /* now the file needs growing too */
+  }
+
+  if( learner->tmp.file &&
+      ((learner->tmp.used + 2 * MAX_TOKEN_LEN) >= learner->tmp.avail) ) {
+
+    if( learner->tmp.mmap_start ) {
+      MUNLOCK(learner->tmp.mmap_start, learner->tmp.mmap_length);
+      MUNMAP(learner->tmp.mmap_start, learner->tmp.mmap_length);
+    }
+
+    learner->tmp.avail += TOKEN_LIST_GROW;
+
+    if( -1 == ftruncate(fileno(learner->tmp.file), 
+			learner->tmp.offset + learner->tmp.avail) ) {
+      errormsg(E_FATAL,
+	       "could not resize the tempfile, unable to proceed.\n"); 
+    }
+
+    /* mmap_start is still old value, but invalid */
+    if( learner->tmp.mmap_start ) { 
+      offset = PAGEALIGN(learner->tmp.offset);
+      learner->tmp.mmap_length = learner->tmp.avail + system_pagesize;
+      learner->tmp.mmap_start =
+	(byte_t *)MMAP(learner->tmp.mmap_start, learner->tmp.mmap_length,
+		       PROT_READ|PROT_WRITE, MAP_SHARED,
+		       fileno(learner->tmp.file), offset);
+      if( learner->tmp.mmap_start == MAP_FAILED ) { learner->tmp.mmap_start = NULL; }
+      if( !learner->tmp.mmap_start ) {
+	if( u_options & (1<<U_OPTION_VERBOSE) ) {
+	  errormsg(E_WARNING, "could not mmap token file after resize\n");
+	}
+	/* this isn't fatal, we just switch to ordinary file ops, since
+	 the file is still open :) */
+	if( -1 == fseek(learner->tmp.file,learner->tmp.offset + 
+			(learner->tmp.mmap_cursor - learner->tmp.mmap_offset),
+			SEEK_SET) ) {
+	  /* ok, this is fatal */
+	  errormsg(E_FATAL,
+		   "could not resize and seek in tempfile, unable to proceed.\n");
+	}
+	learner->tmp.mmap_length = 0;
+	learner->tmp.mmap_offset = 0;
+	learner->tmp.mmap_cursor = 0;
+      } else {
+	/* all is well, relock the pages */
+	MLOCK(learner->tmp.mmap_start, learner->tmp.mmap_length);
+	MADVISE(learner->tmp.mmap_start, learner->tmp.mmap_length,
+		MADV_SEQUENTIAL|MADV_WILLNEED);
+      }
+      /* if there was a fatal error, we simply don't return */
+      return (bool_t)1;
+    }
+  }
+  return (bool_t)0;
+}
+
+/* assume we are at the end of the token list and there is enough room */
+void tmp_write_token(learner_t *learner, const char *tok) {
+  byte_t *p;
+  if( learner->tmp.arena ) {
+    p = learner->tmp.arena + learner->tmp.arena_cursor;
+    while( *tok ) { *p++ = *tok++; }
+    *p++ = TOKENSEP;
+    learner->tmp.arena_cursor = p - learner->tmp.arena;
+    learner->tmp.used = learner->tmp.arena_cursor;
+  } else if( learner->tmp.mmap_start ) {
+    p = learner->tmp.mmap_start + learner->tmp.mmap_cursor;
+    while( *tok ) { *p++ = *tok++; }
+    *p++ = TOKENSEP;
+    learner->tmp.mmap_cursor = p - learner->tmp.mmap_start;
+    learner->tmp.used = learner->tmp.mmap_cursor - learner->tmp.mmap_offset;
+  } else if( learner->tmp.file ) {
+    /* now save token to temporary file */
+    if( (EOF == fputs(tok, learner->tmp.file)) ||
+	(EOF == fputc(TOKENSEP, learner->tmp.file)) ) {
+      errormsg(E_ERROR, 
+	       "could not write a token to tempfile, calculations will be skewed.\n");
+    } else {
+      learner->tmp.used += (strlen(tok) + 1);
+    }
+  }
+}
+
+void tmp_close(learner_t *learner) {
+  if( learner->tmp.arena ) {
+    free(learner->tmp.arena);
+    learner->tmp.arena = NULL;
+  }
+  if( learner->tmp.mmap_start ) {
+    MUNLOCK(learner->tmp.mmap_start, learner->tmp.mmap_length);
+    MUNMAP(learner->tmp.mmap_start, learner->tmp.mmap_length);
+    learner->tmp.mmap_start = NULL;
+  }
+  if( learner->tmp.file ) {
+    fclose(learner->tmp.file);
+    learner->tmp.file = NULL;
+    if( learner->tmp.filename ) { 
+      unlink(learner->tmp.filename);
+      cleanup.tempfile = NULL;
+      free(learner->tmp.filename);
+      learner->tmp.filename = NULL;
+    }
+  }
+}
+
+/***********************************************************
+ * EMPLIST FUNCTIONS                                       *
+ ***********************************************************/
+bool_t emplist_grow(emplist_t *emp) {
+  hash_count_t *n;
+
+  if( emp ) {
+    if( u_options & (1<<U_OPTION_VERBOSE) ) {
+      errormsg(E_WARNING, "growing emp.stack %" FMT_printf_integer_t "\n", 
+	       emp->max * 2);
+    }
+
+    n = (hash_value_t *)realloc(emp->stack,
+				sizeof(hash_value_t *) * emp->max * 2);
+    if( n != NULL ) {
+      emp->max *= 2;
+      emp->stack = n;
+      return 1;
+    } 
+  }
+  errormsg(E_WARNING,
+	   "disabling emp.stack. Not enough memory? I couldn't allocate %li bytes\n", 
+	   (sizeof(l_item_t *) * ((long int)emp->max) * 2));
+  m_options &= ~(1<<M_OPTION_CALCENTROPY);
+
+  return 0;
+}
+
+void emplist_replace(emplist_t *reservoir, document_count_t n, emplist_t *emp) {
+  if( reservoir[n].stack && (emp->top > reservoir[n].max) ) {
+    free(reservoir[n].stack);
+    reservoir[n].stack = NULL;
+  }
+  if( !reservoir[n].stack ) {
+    for(reservoir[n].max = 1; emp->top > reservoir[n].max; 
+	reservoir[n].max *=2);
+    reservoir[n].stack = (hash_value_t *)malloc(reservoir[n].max * sizeof(hash_value_t));
+  }
+  if( reservoir[n].stack ) {
+    memcpy(reservoir[n].stack, emp->stack, emp->top * sizeof(hash_value_t));
+    reservoir[n].top = emp->top;
+    reservoir[n].shannon = emp->shannon;
+  } else {
+    errormsg(E_WARNING,
+	     "couldn't replace document #%" FMT_printf_integer_t " in reservoir, ignoring\n", n);
+  }
+}
+
+/*
+ * Adds emp to the reservoir in such a way that we 
+ * end up with a uniform random sample of size RESERVOIR_SIZE.
+ * This algorithm is a short form of reservoir sampling, and we use
+ * it here because we don't know the total number of documents 
+ * until it's too late.
+ */
+
+void emplist_add_to_reservoir(emplist_t *reservoir, document_count_t docno, 
+			      emplist_t *emp) {
+  double xi;
+  if( docno < RESERVOIR_SIZE) {
+    emplist_replace(reservoir, docno, emp);
+  } else {
+    xi = ((double)rand()/(RAND_MAX + 1.0));
+    if( (docno + 1) * xi < RESERVOIR_SIZE ) {
+      xi = ((double)rand()/(RAND_MAX + 1.0));
+      emplist_replace(reservoir, (int)(RESERVOIR_SIZE * xi), emp);
+    }
+  }
+}
+
+/***********************************************************
+ * LEARNER FUNCTIONS                                       *
+ ***********************************************************/
+static void unmark_learner_items(learner_t *learner) {
+  l_item_t *p, *e;
+
+  e = learner->hash + learner->max_tokens;
+  for(p = learner->hash; p != e; p++) {
+    UNSETMARK(p);
+  }
+}
+
+static void free_learner_delta(learner_t *learner) {
+  if( learner->delta.id ) {
+    free(learner->delta.id);
+  }
+  memset(&learner->delta, 0, sizeof(learner->delta));
+}
+
+/* with -I, remembers each feature counted since the online file was
+   loaded. Once the list outgrows the number of features, incremental
+   optimization wouldn't save anything, so the list is dropped and all
+   the weights are optimized as usual */
+static void note_learner_delta(learner_t *learner, hash_value_t id) {
+  hash_value_t *n = NULL;
+
+  if( learner->delta.top >= learner->delta.max ) {
+    if( learner->delta.max < learner->unique_token_count ) {
+      n = (hash_value_t *)realloc(learner->delta.id, 
+				  2 * learner->delta.max * sizeof(hash_value_t));
+    }
+    if( !n ) {
+      free_learner_delta(learner);
+      return;
+    }
+    learner->delta.id = n;
+    learner->delta.max *= 2;
+  }
+  learner->delta.id[learner->delta.top++] = id;
+}
+
+static void free_learner_sketch(learner_t *learner) {
+  if( learner->sketch.count ) {
+    free(learner->sketch.count);
+  }
+  memset(&learner->sketch, 0, sizeof(learner->sketch));
+}
+
+/* with -Z, a new token doesn't get a slot in the hash at once. Its
+   occurrences are counted in a count-min sketch instead, and the
+   token is only placed in the hash once the count reaches zsketch,
+   so the rare tokens never fill the hash. The counters are only
+   raised to the new minimum (conservative update) and saturate at
+   255. Returns the estimated count, including this occurrence */
+static token_count_t count_in_sketch(learner_t *learner, hash_value_t id) {
+  static const u_int32_t mult[SKETCH_DEPTH] = 
+    { 0x9e3779b1UL, 0x85ebca77UL, 0xc2b2ae3dUL, 0x27d4eb2fUL };
+  byte_t *c[SKETCH_DEPTH];
+  byte_t m = 0xff;
+  u_int32_t h;
+  int j;
+
+  h = (u_int32_t)id ^ (u_int32_t)((id >> 16) >> 16);
+  for(j = 0; j < SKETCH_DEPTH; j++) {
+    c[j] = learner->sketch.count + ((hash_count_t)j << learner->sketch.bits) +
+      ((u_int32_t)(h * mult[j]) >> (32 - learner->sketch.bits));
+    m = MINIMUM(m, *c[j]);
+  }
+  if( m < 0xff ) {
+    m++;
+  }
+  for(j = 0; j < SKETCH_DEPTH; j++) {
+    if( *c[j] < m ) {
+      *c[j] = m;
+    }
+  }
+  return (token_count_t)m;
+}
+
+void free_learner_hash(learner_t *learner) {
+  if( learner->hash ) {
+    if( learner->mmap_start != NULL ) {
+      MUNMAP(learner->mmap_start, 
+	     learner->mmap_hash_offset + learner->max_tokens * sizeof(l_item_t));
+      learner->mmap_start = NULL;
+      learner->mmap_learner_offset = 0;
+      learner->mmap_hash_offset = 0;
+      learner->hash = NULL;
+    }
+    if( learner->hash ) {
+      free(learner->hash);
+      learner->hash = NULL;
+    }
+  }
+}
+
+/* (re)builds the control bytes for the whole hash, after it was
+   read from disk or grown */
+static bool_t rebuild_learner_ctrl(learner_t *learner) {
+  hash_count_t c;
+
+  if( learner->ctrl ) {
+    free(learner->ctrl);
+  }
+  learner->ctrl = new_hash_ctrl(learner->max_tokens);
+  if( !learner->ctrl ) {
+    errormsg(E_ERROR, "not enough memory for the learner hash\n");
+    return 0;
+  }
+  for(c = 0; c < learner->max_tokens; c++) {
+    learner->ctrl[c] = 
+      learner->hash[c].id ? HCTRL_TAG(learner->hash[c].id) : 0;
+  }
+  mirror_hash_ctrl(learner->ctrl, learner->max_tokens);
+  return 1;
+}
+
+/* the optimizer passes only look at the features of one order
+   at a time, so rather than scanning the whole sparse hash each time,
+   they read the dense arrays in learner->feat. The hash stays the
+   master copy for everything else: the lambdas of an order are copied
+   back when that order is done, and the partial sums filled in by
+   recalculate_reference_measure() are copied in before it starts. */
+static void free_learner_features(learner_t *learner) {
+  l_features_t *f = &learner->feat;
+  if( f->item ) { free(f->item); }
+  if( f->tok ) { free(f->tok); }
+  if( f->lam ) { free(f->lam); }
+  if( f->ltrms ) { free(f->ltrms); }
+  if( f->dref ) { free(f->dref); }
+  if( f->count ) { free(f->count); }
+  memset(f, 0, sizeof(l_features_t));
+}
+
+/* when the token list can be addressed directly, we find each
+   feature's token string once here, so recalculate_reference_measure()
+   doesn't have to parse and hash the whole list for every order. The
+   hash slots' tmp.read.eff are free at this point and hold the feature
+   numbers while we look the tokens up. */
+static void index_learner_tokens(learner_t *learner) {
+  l_features_t *f = &learner->feat;
+  char tok[(MAX_TOKEN_LEN+1)*MAX_SUBMATCH+EXTRA_TOKEN_LEN];
+  const byte_t *base, *p, *e;
+  char *q;
+  l_item_t *k;
+  hash_count_t j;
+
+  base = tmp_get_base(learner);
+  if( !base || (f->size == 0) ) {
+    return;
+  }
+  f->tok = (long *)malloc(f->size * sizeof(long));
+  if( !f->tok ) {
+    return; /* not fatal, we'll just read the token list each time */
+  }
+
+  for(j = 0; j < f->size; j++) {
+    f->tok[j] = -1;
+    f->item[j]->tmp.read.eff = j;
+  }
+
+  e = base + learner->tmp.used;
+  for(p = base; p < e; p++) {
+    for(q = tok; (p < e) && (*p != TOKENSEP); p++) {
+      if( q < tok + sizeof(tok) - 1 ) {
+	*q++ = *p;
+      }
+    }
+    *q = 0;
+    k = find_in_learner(learner, hash_full_token(tok));
+    if( k && (get_token_order(tok) == k->typ.order) ) {
+      if( f->tok[k->tmp.read.eff] >= 0 ) {
+	/* a repeated token counts twice in kappa, leave that
+	   to the slow path */
+	free(f->tok);
+	f->tok = NULL;
+	break;
+      }
+      f->tok[k->tmp.read.eff] = (p - base) - (q - tok);
+    }
+  }
+
+  for(j = 0; j < f->size; j++) {
+    f->item[j]->tmp.read.eff = 0;
+  }
+}
+
+static void build_learner_features(learner_t *learner) {
+  l_features_t *f = &learner->feat;
+  hash_count_t next[MAX_SUBMATCH];
+  hash_count_t k, n;
+  l_item_t *i, *e;
+  token_order_t r;
+
+  free_learner_features(learner);
+
+  memset(next, 0, sizeof(next));
+  e = learner->hash + learner->max_tokens;
+  for(i = learner->hash; i != e; i++) {
+    if( FILLEDP(i) ) {
+      next[i->typ.order]++;
+    }
+  }
+  for(r = 0; r < MAX_SUBMATCH; r++) {
+    f->start[r + 1] = f->start[r] + next[r];
+    next[r] = f->start[r];
+  }
+  f->size = f->start[MAX_SUBMATCH];
+
+  n = (f->size > 0) ? f->size : 1;
+  f->item = (l_item_t **)malloc(n * sizeof(l_item_t *));
+  f->lam = (weight_t *)malloc(n * sizeof(weight_t));
+  f->ltrms = (weight_t *)calloc(n, sizeof(weight_t));
+  f->dref = (weight_t *)calloc(n, sizeof(weight_t));
+  f->count = (token_count_t *)malloc(n * sizeof(token_count_t));
+  if( !f->item || !f->lam || !f->ltrms || !f->dref || !f->count ) {
+    errormsg(E_FATAL, 
+	     "not enough memory to optimize %ld features\n", (long)f->size);
+  }
+
+  for(i = learner->hash; i != e; i++) {
+    if( FILLEDP(i) ) {
+      k = next[i->typ.order]++;
+      f->item[k] = i;
+      f->lam[k] = UNPACK_LAMBDA(i->lam);
+      f->count[k] = i->count;
+    }
+  }
+
+  index_learner_tokens(learner);
+}
+
+/* copies the partial sums of the rth order features out of the hash */
+static void gather_learner_features(learner_t *learner, token_order_t r) {
+  l_features_t *f = &learner->feat;
+  hash_count_t k;
+  for(k = f->start[r]; k < f->start[r + 1]; k++) {
+    f->ltrms[k] = UNPACK_LWEIGHTS(f->item[k]->tmp.min.ltrms);
+    f->dref[k] = UNPACK_RWEIGHTS(f->item[k]->tmp.min.dref);
+  }
+}
+
+/* copies the rth order lambdas back into the hash */
+static void scatter_learner_lambdas(learner_t *learner, token_order_t r) {
+  l_features_t *f = &learner->feat;
+  hash_count_t k;
+  for(k = f->start[r]; k < f->start[r + 1]; k++) {
+    f->item[k]->lam = PACK_LAMBDA(f->lam[k]);
+  }
+}
+
+bool_t create_learner_hash(learner_t *learner, FILE *input, bool_t readonly) {
+  size_t j, n;
+  byte_t *mmap_start;
+  long mmap_learner_offset;
+  long mmap_hash_offset;
+  
+  if( learner->hash ) { free_learner_hash(learner); }
+
+  if( u_options & (1<<U_OPTION_MMAP) ) {
+    /* here we mmap the fixed size portion of the dump file. First
+       we mmap the learner structure portion as a fast way of loading 
+       the learner variable, then we must undo/redo the mmap because
+       we cannot know the hash table size until we've read the dumped learner_t.
+    */
+
+    mmap_learner_offset = strlen(MAGIC_ONLINE);
+    mmap_hash_offset = mmap_learner_offset + sizeof(learner_t);
+
+    mmap_start =
+      (byte_t *)MMAP(0, mmap_hash_offset,
+		     PROT_READ|(readonly ? 0 : PROT_WRITE),
+		     MAP_SHARED, fileno(input), 0);
+    if( mmap_start == MAP_FAILED ) { mmap_start = NULL; }
+    if( mmap_start ) {
+      /* first we overwrite the learner struct with the contents of
+	 the mmapped region */
+      memcpy(learner, mmap_start + mmap_learner_offset, sizeof(learner_t));
+      
+      MUNMAP(mmap_start, mmap_hash_offset);
+      
+      mmap_start =
+	(byte_t *)MMAP(mmap_start,
+		       mmap_hash_offset + sizeof(l_item_t) * learner->max_tokens,
+		       PROT_READ|(readonly ? 0 : PROT_WRITE), 
+		       MAP_SHARED, fileno(input), 0);
+      if( mmap_start == MAP_FAILED ) { mmap_start = NULL; }
+      if( mmap_start ) {
+	/* now fill some member variables */
+	learner->mmap_start = mmap_start;
+	learner->mmap_learner_offset = mmap_learner_offset;
+	learner->mmap_hash_offset = mmap_hash_offset;
+	learner->hash = (l_item_t *)(mmap_start + mmap_hash_offset);
+	MADVISE(learner->mmap_start, 
+		learner->mmap_hash_offset + sizeof(l_item_t) * learner->max_tokens,
+		MADV_SEQUENTIAL|MADV_WILLNEED);
+	/* lock the pages to prevent swapping - on Linux, this
+	   works without root privs so long as the user limits
+	   are big enough - mine are unlimited ;-) 
+	   On other OSes, root may me necessary. */
+	MLOCK(learner->mmap_start,
+	      learner->mmap_hash_offset + sizeof(l_item_t) * learner->max_tokens);
+      }
+    }
+  }
+
+  if( !learner->hash ) {
+    
+    for(n = 0; n < 1; ) {
+      n = fread(learner, sizeof(learner_t), 1, input);
+      if( (n == 0) && ferror(input) ) {
+	return 0;
+      }
+    }
+
+    /* allocate hash table normally */
+    learner->hash = (l_item_t *)malloc(learner->max_tokens * sizeof(l_item_t));
+    if( !learner->hash ) {
+      errormsg(E_WARNING, "failed to allocate %li bytes for learner hash.\n",
+	       (sizeof(l_item_t) * ((long int)learner->max_tokens)));
+      /* this error is not fatal, because we have another opportunity to 
+	 allocate the hash later */
+      return 0;
+    }
+
+    MADVISE(learner->hash, sizeof(l_item_t) * learner->max_tokens, 
+	    MADV_SEQUENTIAL);
+
+    for(n = j = 0; n < learner->max_tokens; n += j) {
+      j = fread(&learner->hash[n], sizeof(l_item_t), 
+		learner->max_tokens - n, input);
+      if( (j == 0) && ferror(input) ) {
+	errormsg(E_WARNING, "could not read online learner dump, ignoring.\n");
+	return 0;
+      }
+    }
+
+  }
+  return (learner->hash != NULL);
+}
+
+/* slots at the old size are probed exactly as before the hash grew,
+   wrapping around at old_tokens. Returns old_tokens if id isn't there. */
+static hash_count_t probe_old_layout(learner_t *learner, hash_value_t id) {
+  hash_count_t m = learner->grow.old_tokens;
+  hash_count_t n = id & (m - 1), k;
+  byte_t tag = HCTRL_TAG(id);
+
+  for(k = 0; (k < m) && learner->ctrl[n]; k++, n = (n + 1) & (m - 1)) {
+    if( (learner->ctrl[n] == tag) && EQUALP(learner->hash[n].id, id) ) {
+      return n;
+    }
+  }
+  return m;
+}
+
+/* moves the item in slot c from its place in the old layout to its
+   place in the grown hash. If it would land in the same slot it
+   stays, otherwise the slot becomes a tombstone, so probe sequences
+   which pass through it aren't cut short. */
+static void relocate_learner_item(learner_t *learner, hash_count_t c) {
+  hash_count_t n;
+  hash_value_t id = learner->hash[c].id;
+
+  set_hash_ctrl_byte(learner->ctrl, learner->max_tokens, c, 0);
+  n = probe_hash_ctrl(learner->ctrl, learner->max_tokens, id, id,
+		      (byte_t *)learner->hash, sizeof(l_item_t), 
+		      offsetof(l_item_t, id));
+  if( n != c ) {
+    memcpy(&learner->hash[n], &learner->hash[c], sizeof(l_item_t));
+    memset(&learner->hash[c], 0, sizeof(l_item_t));
+    set_hash_ctrl_byte(learner->ctrl, learner->max_tokens, c, HCTRL_DELETED);
+  }
+  set_hash_ctrl(learner->ctrl, learner->max_tokens, n, id);
+}
+
+/* refiles every item in the cluster of filled slots around slot d,
+   which gets rid of its tombstones. Each item's home is inside the
+   cluster, so refiling them in order never moves one past a slot
+   that is still to be visited. Returns the first empty slot after 
+   the cluster. */
+static hash_count_t tidy_learner_cluster(learner_t *learner, hash_count_t d) {
+  hash_count_t mask = learner->max_tokens - 1;
+  hash_count_t a, b, j, n;
+  hash_value_t id;
+
+  for(a = d; learner->ctrl[(a - 1) & mask]; a = (a - 1) & mask);
+  for(b = d; learner->ctrl[b]; b = (b + 1) & mask);
+
+  for(j = a; j != b; j = (j + 1) & mask) {
+    id = learner->hash[j].id;
+    set_hash_ctrl_byte(learner->ctrl, learner->max_tokens, j, 0);
+    if( id ) {
+      n = probe_hash_ctrl(learner->ctrl, learner->max_tokens, id, id,
+			  (byte_t *)learner->hash, sizeof(l_item_t), 
+			  offsetof(l_item_t, id));
+      if( n != j ) {
+	memcpy(&learner->hash[n], &learner->hash[j], sizeof(l_item_t));
+	memset(&learner->hash[j], 0, sizeof(l_item_t));
+      }
+      set_hash_ctrl(learner->ctrl, learner->max_tokens, n, id);
+    }
+  }
+  return b;
+}
+
+/* does a little more of the work of growing the hash. First the items
+   still placed for the old size are moved, then the clusters with
+   tombstones are refiled. Until both are done, find_in_learner() also
+   looks where ids used to be. */
+static void grow_learner_step(learner_t *learner) {
+  hash_count_t c, e;
+
+  if( learner->grow.old_tokens ) {
+    e = MINIMUM(learner->grow.cursor + GROW_STEP, learner->grow.old_tokens);
+    for(c = learner->grow.cursor; c < e; c++) {
+      if( learner->grow.old[c/8] & (1<<(c%8)) ) {
+	relocate_learner_item(learner, c);
+      }
+    }
+    learner->grow.cursor = e;
+    if( e == learner->grow.old_tokens ) {
+      free(learner->grow.old);
+      learner->grow.old = NULL;
+      learner->grow.tidy_tokens = learner->grow.old_tokens;
+      learner->grow.old_tokens = 0;
+      learner->grow.cursor = 0;
+    }
+  } else if( learner->grow.tidy_tokens ) {
+    /* tombstones are only ever left below the old size */
+    e = MINIMUM(learner->grow.cursor + GROW_STEP, learner->grow.tidy_tokens);
+    for(c = learner->grow.cursor; c < e; c++) {
+      if( learner->ctrl[c] == HCTRL_DELETED ) {
+	c = tidy_learner_cluster(learner, c);
+	if( c >= learner->grow.tidy_tokens ) {
+	  break;
+	}
+      }
+    }
+    learner->grow.cursor = MAXIMUM(c, e);
+    if( learner->grow.cursor >= learner->grow.tidy_tokens ) {
+      learner->grow.tidy_tokens = 0;
+      learner->grow.cursor = 0;
+    }
+  }
+}
+
+/* completes any growth in progress, needed before the whole hash is
+   read or written */
+static void finish_learner_growth(learner_t *learner) {
+  while( learner->grow.old_tokens || learner->grow.tidy_tokens ) {
+    grow_learner_step(learner);
+  }
+}
+
+/* returns true if the hash could be grown, false otherwise.
+   The hash doubles in place, but the items aren't redistributed
+   all at once, which would stall a big learner. Instead each call of
+   hash_word_and_learn() moves a few more, see grow_learner_step(). */
+bool_t grow_learner_hash(learner_t *learner) {
+  hash_count_t c, old_size, new_size;
+  l_item_t *i;
+  byte_t *ctrl, *old;
+
+  if( !(u_options & (1<<U_OPTION_GROWHASH)) ) {
+    return 0;
+  } else {
+    if( learner->max_hash_bits < default_max_grow_hash_bits ) {
+
+      /* 
+	 this warning is mostly useless and distracting
+
+	 errormsg(E_WARNING,
+	 "growing hash table, next time perhaps consider using -h %d\n",
+	 learner.max_hash_bits + 1);
+
+      */
+
+      /* the previous growth must be complete */
+      finish_learner_growth(learner);
+
+      old_size = learner->max_tokens;
+      new_size = (hash_count_t)1<<(learner->max_hash_bits+1);
+
+      /* one bit for each slot that must still be moved */
+      if( (old = (byte_t *)calloc((old_size + 7)/8, 1)) == NULL ) {
+	errormsg(E_WARNING,
+		"failed to grow hash table.\n");
+	return 0;
+      }
+
+      /* there are two cases - if learner is mmapped, we must malloc a
+       * new hash and copy the mmapped contents to it, otherwise we
+       * can realloc. 
+       */
+      if( learner->mmap_start ) {
+	if( (i = (l_item_t *)malloc(new_size * sizeof(l_item_t))) == NULL ) {
+	  errormsg(E_WARNING,
+		   "failed to malloc hash table for growing.\n");
+	  free(old);
+	  return 0;
+	}
+	memcpy(i, learner->hash, sizeof(l_item_t) * old_size);
+	free_learner_hash(learner);
+      } else {
+	if( u_options & (1<<U_OPTION_MMAP) ) {
+	  MUNLOCK(learner->hash, sizeof(l_item_t) * old_size);
+	}
+
+	/* grow the memory around the hash */
+	if( (i = (l_item_t *)realloc(learner->hash, 
+				     sizeof(l_item_t) * new_size)) == NULL ) {
+	  errormsg(E_WARNING,
+		   "failed to grow hash table.\n");
+	  free(old);
+	  return 0;
+	}
+      }
+      /* the lower half is unchanged, so the hash is usable at
+	 its old size even if we can't grow the control bytes */
+      learner->hash = i; 
+
+      if( (ctrl = (byte_t *)realloc(learner->ctrl, 
+				    new_size + HCTRL_GROUP)) == NULL ) {
+	errormsg(E_WARNING,
+		"failed to grow hash table.\n");
+	free(old);
+	return 0;
+      }
+      learner->ctrl = ctrl;
+
+      if( u_options & (1<<U_OPTION_MMAP) ) {
+	MLOCK(i, sizeof(l_item_t) * new_size);
+      }
+
+      MADVISE(i, sizeof(l_item_t) * new_size, MADV_RANDOM);
+
+      /* realloc doesn't initialize the memory */
+      memset(&i[old_size], 0, (new_size - old_size) * sizeof(l_item_t));
+      memset(&ctrl[old_size], 0, new_size - old_size + HCTRL_GROUP);
+      for(c = 0; (c < HCTRL_GROUP) && (c < old_size); c++) {
+	set_hash_ctrl_byte(ctrl, new_size, c, ctrl[c]);
+      }
+
+      /* now mark every used slot */
+      for(c = 0; c < old_size; c++) {
+	if( FILLEDP(&i[c]) ) {
+	  old[c/8] |= (1<<(c%8));
+	}
+      }
+
+      learner->max_hash_bits++;
+      learner->max_tokens = new_size;
+      learner->grow.old_tokens = old_size;
+      learner->grow.tidy_tokens = 0;
+      learner->grow.cursor = 0;
+      learner->grow.old = old;
+    } else {
+      u_options &= ~(1<<U_OPTION_GROWHASH); /* it's the law */
+      errormsg(E_WARNING,
+	       "the token hash table is nearly full, slowing down.\n"); 
+    }
+  }
+  return 1;
+}
+
+/* This code malloc()s and fread()s the learner structure. */
+bool_t read_online_learner_struct(learner_t *learner, char *path, bool_t readonly) {
+  FILE *input;
+  char buf[BUFSIZ+1]; /* must be greater than MAGIC_BUFSIZE */
+  bool_t ok = 0;
+  char *sav_filename;
+  long offset;
+  l_item_t *p, *e;
+
+  /* 
+   * This code malloc()s and fread()s the learner structure, or alternatively
+   * it mmap()s it for speed. Note we open for read/write, because the
+   * file might be left open and reused later.
+   */
+  input = fopen(path, readonly ? "rb" : "r+b");
+  if( input ) {
+
+/*     if( out_iobuf ) { */
+/*       setvbuf(input, (char *)out_iobuf, (int)_IOFBF, (size_t)(BUFFER_MAG * system_pagesize)); */
+/*     } */
+
+    if( !fgets(buf, MAGIC_BUFSIZE, input) ||
+	(strncmp(buf, MAGIC_ONLINE, strlen(MAGIC_ONLINE)) != 0) ) {
+	if( strncmp(buf, MAGIC_ONLINE_ANY, strlen(MAGIC_ONLINE_ANY)) == 0 ) {
+	  errormsg(E_WARNING,
+		  "the file %s is an online memory dump from an older dbacl, "
+		  "it can't be used\n", 
+		  path);
+	} else if( strncmp(buf, MAGIC_ONLINE, 35) == 0 ) {
+	  errormsg(E_WARNING,
+		  "the file %s has the wrong version number, it will be ignored\n", 
+		  path);
+	} else {
+	  errormsg(E_WARNING,
+		  "the file %s is not a dbacl online memory dump, it will be ignored\n", 
+		  path);
+	}
+    } else {
+      /* from here on, if a problem arises then learner is hosed, so we exit */
+      ok = 1;
+
+      /* must save some prefilled members because learner is read from disk */
+      sav_filename = learner->filename;
+
+      if( !create_learner_hash(learner, input, readonly) ) {
+	ok = 0;
+	goto skip_read_online;
+      }
+      /* restore members */
+      learner->filename = sav_filename;
+      memset(&learner->feat, 0, sizeof(l_features_t));
+      learner->ctrl = NULL;
+      memset(&learner->grow, 0, sizeof(learner->grow));
+      memset(&learner->delta, 0, sizeof(learner->delta));
+      memset(&learner->sketch, 0, sizeof(learner->sketch));
+      if( !rebuild_learner_ctrl(learner) ) {
+	ok = 0;
+	goto skip_read_online;
+      }
+
+      /* override options */
+      if( (m_options != learner->model.options) ||
+	  (zthreshold != learner->model.tmin) ||
+	  (m_cp != learner->model.cp) ||
+	  (m_dt != learner->model.dt) ) {
+	/* we don't warn about changes in u_options, as they can happen
+	   during computations */
+	errormsg(E_WARNING, 
+		 "some command line options were changed when loading %s\n",
+		 path);
+	m_options = learner->model.options;
+	m_cp = learner->model.cp;
+	m_dt = learner->model.dt;
+/*       u_options = learner->u_options; */
+	zthreshold = learner->model.tmin;
+      }
+
+      /* last, there is a long list of token strings, we compute the
+       start offset, and seek to the end so we can append more
+       tokens */
+      learner->tmp.file = input;
+      learner->tmp.filename = NULL;
+      learner->tmp.offset = strlen(MAGIC_ONLINE) + sizeof(learner_t) + 
+	sizeof(l_item_t) * learner->max_tokens;
+      learner->tmp.iobuf = NULL;
+      learner->tmp.arena = NULL;
+
+      if( u_options & (1<<U_OPTION_MMAP) ) {
+	offset = PAGEALIGN(learner->tmp.offset);
+	/* since offset can be up to a page less than the true beginning,
+	   we must allow an extra page in the mmap length */
+	learner->tmp.mmap_length = learner->tmp.avail + system_pagesize;
+	learner->tmp.mmap_start = 
+	  (byte_t *)MMAP(0, learner->tmp.mmap_length,
+			 PROT_READ|(readonly ? 0 : PROT_WRITE), MAP_SHARED,
+			 fileno(learner->tmp.file), offset);
+	if( learner->tmp.mmap_start == MAP_FAILED ) { learner->tmp.mmap_start = NULL; }
+	if( learner->tmp.mmap_start ) {
+	  MLOCK(learner->tmp.mmap_start, learner->tmp.mmap_length);
+	  MADVISE(learner->tmp.mmap_start, learner->tmp.mmap_length,
+		  MADV_SEQUENTIAL|MADV_WILLNEED);
+	  learner->tmp.mmap_offset = learner->tmp.offset - offset;
+	  learner->tmp.mmap_cursor = 0;
+	} else {
+	  learner->tmp.mmap_length = 0;
+	  if( u_options & (1<<U_OPTION_VERBOSE) ) {
+	    errormsg(E_WARNING, "couldn't mmap temporary tokens\n");
+	  }
+	}
+      }
+
+      if( !tmp_seek_end(learner) ) {
+	ok = 0;
+	learner->tmp.file = NULL;
+	learner->tmp.filename = NULL;
+	goto skip_read_online;
+      }
+      /* consistency check */
+      if( tmp_get_pos(learner) != learner->tmp.used ) {
+	ok = 0;
+	learner->tmp.file = NULL;
+	learner->tmp.filename = NULL;
+	goto skip_read_online;
+      }
+/*       printf("tmp.used = %ld tmp.avail = %ld tmp.offset = %ld\n", */
+/* 	     learner->tmp.used, learner->tmp.avail, learner->tmp.offset); */
+     
+      /* last but not least, hash may contain junk because mmapped, so
+	 clear some data. A read only dump is only merged, and its
+	 mapping can't be written */
+      if( !readonly ) {
+	e = learner->hash + learner->max_tokens;
+	for(p = learner->hash; p < e; p++) {
+	  if( FILLEDP(p) ) {
+	    p->tmp.read.eff = 0;
+	  }
+	}
+      }
+
+    }
+  skip_read_online:
+    /* if we're ok, we must leave the file open, even if it's mmapped,
+     because we must be able to unmap/remap it on the fly */
+    if( !ok ) {
+      if( learner->tmp.mmap_start ) {
+	MUNMAP(learner->tmp.mmap_start, learner->tmp.mmap_length);
+	learner->tmp.mmap_start = 0;
+	learner->tmp.mmap_length = 0;
+	learner->tmp.mmap_offset = 0;
+	learner->tmp.mmap_cursor = 0;
+      }
+      fclose(input); 
+      errormsg(E_FATAL,
+	       "the file %s could not be read, learning from scratch.\n", 
+	       path);
+    }
+  }
+
+  if( u_options & (1<<U_OPTION_VERBOSE) ) {
+    fprintf(stdout, "%s %s\n", ok ? "loaded" : "couldn't load", path);
+  }
+
+  return ok;
+}
+
+/* this is a straight memory dump  */
+void write_online_learner_struct(learner_t *learner, char *path) {
+  FILE *output;
+  char *tempname = NULL;
+  bool_t ok;
+  byte_t buf[BUFSIZ+1];
+  size_t t, j, n;
+  learner_t *mml;
+  long tokoff;
+  const byte_t *sp;
+
+  /* the dump must not depend on the state of a growing hash */
+  finish_learner_growth(learner);
+
+  if( !check_magic_write(path, MAGIC_ONLINE, strlen(MAGIC_ONLINE)) ) {
+    /* we simply ignore this. Note that check_magic_write() already
+       notifies the user */
+    return;
+  }
+
+
+  /* if the hash table is memory mapped, then we simply update the 
+     learner structure and exit */
+
+  if( learner->mmap_start != NULL ) {
+    mml = (learner_t *)(learner->mmap_start + learner->mmap_learner_offset);
+    memcpy(mml, learner, sizeof(learner_t));
+    /* clear some variables just to be safe */
+    mml->mmap_start = NULL;
+    mml->mmap_learner_offset = 0;
+    mml->mmap_hash_offset = 0;
+    mml->hash = NULL;
+
+    return;
+  }
+
+
+  /* if we're here, then we must write out a completely new memory dump,
+   * and the mmap_ variables are all zero. */
+  
+  output = mytmpfile(path, &tempname);
+  if( output ) {
+
+    if( out_iobuf ) {
+      setvbuf(output, (char *)out_iobuf, (int)_IOFBF, (size_t)(BUFFER_MAG * system_pagesize));
+    }
+
+    ok = 1;
+    ok = ok &&
+      (0 < fprintf(output, MAGIC_ONLINE));
+
+    /* save current model options - don't want them to change next time we learn */
+    learner->model.options = m_options;
+    learner->model.cp = m_cp;
+    learner->model.dt = m_dt;
+    learner->u_options = u_options;
+
+    /* make sure some stuff is zeroed out */
+    /* but leave others untouched, eg doc.A, doc.S, doc.count for shannon */
+    learner->mmap_start = NULL; /* assert mmap_start == NULL */
+    learner->mmap_learner_offset = 0;
+    learner->mmap_hash_offset = 0;
+    learner->doc.emp.top = 0;
+    learner->doc.emp.max = 0;
+    learner->doc.emp.stack = NULL;
+    memset(learner->doc.reservoir, 0, RESERVOIR_SIZE * sizeof(emplist_t));
+
+    /* write learner */
+    ok = ok &&
+      (0 < fwrite(learner, sizeof(learner_t), 1, output));
+    for(t = j = 0; t < learner->max_tokens; t += j) {
+      j = fwrite(&(learner->hash[t]), sizeof(l_item_t), 
+		 learner->max_tokens - t, output);
+      if( (j == 0) && ferror(output) ) {
+	ok = 0;
+	goto skip_write_online;
+      }
+    }
+
+    tokoff = ftell(output);
+    /* extend the size ofthe file - this is needed mostly for mmapping,
+     but it might also marginally speed up the repeated writes below */
+    if( -1 == ftruncate(fileno(output), tokoff + learner->tmp.avail) ) {
+      ok = 0;
+      goto skip_write_online;
+    }
+
+    /* write temporary tokens */
+    if( !tmp_seek_start(learner) ) {
+      errormsg(E_ERROR, "cannot seek in online token file %s\n", tempname);
+      ok = 0;
+      goto skip_write_online;
+    }
+    n = 0;
+    while( (n = tmp_read_block(learner, buf, BUFSIZ, &sp)) > 0 ) {
+      for(t = j = 0; t < n; t += j) {
+	j = fwrite(sp + t, 1, n - t, output);
+	if( (j == 0) && ferror(output) ) {
+	  ok = 0;
+	  goto skip_write_online;
+	}
+      }
+    }
+    /* consistency check */
+    if( (tokoff + learner->tmp.used) != ftell(output) ) {
+      ok = 0;
+      goto skip_write_online;
+    } 
+
+  skip_write_online:
+    fclose(output);
+
+    if( u_options & (1<<U_OPTION_VERBOSE) ) {
+      fprintf(stdout, "writing online memory dump: %s\n", ok ? "success" : "failed");
+    }
+
+    /* the rename is atomic on posix */
+    if( !ok || (rename(tempname, path) < 0) ) {
+      errormsg(E_ERROR,
+	       "due to a potential file corruption, %s was not updated\n", 
+	       path);
+      unlink(tempname);
+    }
+
+    free(tempname);
+  }
+}
+
+bool_t merge_temp_tokens(learner_t *dest, learner_t *src) {
+  hash_value_t id;
+  byte_t buf[BUFSIZ+1];
+  char tok[(MAX_TOKEN_LEN+1)*MAX_SUBMATCH+EXTRA_TOKEN_LEN];
+  size_t n = 0;
+
+  const byte_t *p;
+  char *q;
+
+  l_item_t *k;
+
+  if( !tmp_seek_start(src) ) {
+    errormsg(E_ERROR, "cannot seek in temporary token file [%s]\n", 
+	     src->filename);
+    return 0;
+  }
+  if( !tmp_seek_end(dest) ) {
+    errormsg(E_ERROR, "cannot seek in temporary token file [%s]\n", 
+	     dest->filename);
+    return 0;
+  }
+
+  q = tok;
+  while( (n = tmp_read_block(src, buf, BUFSIZ, &p)) > 0 ) {
+    /*       p = buf; */
+    /*       p[n] = '\0'; */
+    while( n-- > 0 ) {
+      if( *p != TOKENSEP) {
+	*q++ = *p; /* copy into tok */
+      } else { /* interword space */ 
+	*q = 0; /* append NUL to tok */
+	/* now lookup weight in hash */
+	id = hash_full_token(tok);
+	k = find_in_learner(dest, id); 
+	if( !k || !FILLEDP(k) ) {
+	  tmp_grow(dest); /* just in case we're full */
+	  tmp_write_token(dest, tok);
+	}
+	q = tok; /* reset q */
+      }
+      p++;
+    }
+  }
+    
+
+  return 1;
+}
+
+/* like find_in_learner(), but grows the hash first if id is new and
+   the hash is full */
+static l_item_t *find_merged_item(learner_t *dest, hash_value_t id) {
+  l_item_t *i;
+
+  if( dest->grow.old_tokens || dest->grow.tidy_tokens ) {
+    grow_learner_step(dest);
+  }
+  i = find_in_learner(dest, id);
+  if( i && !FILLEDP(i) &&
+      ((100 * dest->unique_token_count) >= 
+       (HASH_FULL * dest->max_tokens)) && grow_learner_hash(dest) ) {
+    i = find_in_learner(dest, id);
+    /* new i, go through all tests again */
+  }
+  return i;
+}
+
+/* fills the empty slot i of dest with the item j of another learner,
+   without its count */
+static void fill_merged_item(learner_t *dest, l_item_t *i, l_item_t *j) {
+  SET(i->id, j->id);
+  set_hash_ctrl(dest->ctrl, dest->max_tokens, i - dest->hash, j->id);
+
+  INCREMENT(dest->unique_token_count, 
+	    K_TOKEN_COUNT_MAX, overflow_warning);
+
+  i->typ = j->typ;
+
+  /* order accounting */
+  dest->max_order = MAXIMUM(dest->max_order,i->typ.order);
+
+  INCREMENT(dest->fixed_order_unique_token_count[i->typ.order],
+	    K_TOKEN_COUNT_MAX, overflow_warning);
+}
+
+bool_t merge_hashes(learner_t *dest, learner_t *src) {
+  register l_item_t *i, *j, *e;
+  alphabet_size_t ci, cj;
+
+  e = src->hash + src->max_tokens;
+  for(j = src->hash ; j != e; j++) {
+    if( FILLEDP(j) ) {
+      i = find_merged_item(dest, j->id);
+      if( i ) {
+	if( FILLEDP(i) ) {
+	  
+	  /* nothing */
+
+	} else if( /* !FILLEDP(i) && */
+		  ((100 * dest->unique_token_count) < 
+		   (HASH_FULL * dest->max_tokens) ) ) {
+
+	  fill_merged_item(dest, i, j);
+
+	}
+
+	INCREASE(i->count, j->count, 
+		 K_TOKEN_COUNT_MAX, overflow_warning);
+
+	dest->tmax = MAXIMUM(dest->tmax, i->count);
+
+	INCREASE(dest->full_token_count, j->count,
+		 K_TOKEN_COUNT_MAX, overflow_warning);
+
+	INCREASE(dest->fixed_order_token_count[i->typ.order], j->count,
+		  K_TOKEN_COUNT_MAX, skewed_constraints_warning);
+
+      }
+    }
+  }
+
+  for(ci = 0; ci < ASIZE; ci++) { 
+    for(cj = 0; cj < ASIZE; cj++) { 
+      dest->dig[ci][cj] += src->dig[ci][cj];
+    }
+  }
+
+  return 1;
+}
+
+
+static void merge_document_counts(learner_t *dest, learner_t *src) {
+  dest->doc.A += src->doc.A;
+  dest->doc.S += src->doc.S;
+  dest->doc.count += src->doc.count;
+  dest->doc.nullcount += src->doc.nullcount;
+  /* can't use these when merging */
+  dest->alpha = 0.0;
+  dest->beta = 0.0;
+  dest->mu = 0.0;
+  dest->s2 = 0.0;
+}
+
+bool_t merge_learner_struct(learner_t *learner, char *path) {
+  learner_t dummy;
+  bool_t ok = 0;
+  options_t m_sav, u_sav;
+
+  m_sav = m_options;
+  u_sav = u_options;
+
+  init_learner(&dummy, path, 1);
+
+  m_options = m_sav;
+  u_options = u_sav;
+
+  if( dummy.retype != 0 ) {
+    errormsg(E_WARNING, 
+	     "merging regular expressions is not supported, ignoring %s\n",
+	     path);
+    ok = 0;
+  } else {
+    /* in case these changed while initing dummy */
+    learner->model.options = m_options;
+    learner->model.cp = m_cp;
+    learner->model.dt = m_dt;
+
+    /* _before_ we fill the hash, we merge the temp tokens (we only
+       add those thokens not found in learner->hash) */
+    ok = 
+      merge_temp_tokens(learner, &dummy) &&
+      merge_hashes(learner, &dummy);
+  
+    if( ok ) {
+      merge_document_counts(learner, &dummy);
+    }
+  }
+
+  free_learner(&dummy);
+
+  if( !ok ) {
+    errormsg(E_WARNING, 
+	     "%s could not be merged, the learned category might be corrupt\n",
+	     path);
+  }
+
+  return ok;
+}
+
+/* reads the token list of a shard one token at a time */
+typedef struct {
+  learner_t *learner;
+  byte_t buf[BUFSIZ+1];
+  const byte_t *p;
+  size_t n;
+  token_count_t count;
+} shard_reader_t;
+
+static bool_t read_shard_token(shard_reader_t *r, char *tok) {
+  char *q = tok;
+
+  for(;;) {
+    if( r->n == 0 ) {
+      r->n = tmp_read_block(r->learner, r->buf, BUFSIZ, &r->p);
+      if( r->n == 0 ) {
+	return 0;
+      }
+    }
+    r->n--;
+    if( *r->p != TOKENSEP ) {
+      *q++ = *r->p++; /* copy into tok */
+    } else {
+      r->p++;
+      *q = 0;
+      r->count++;
+      return 1;
+    }
+  }
+}
+
+/* adds the tokens of shard r up to its limit-th token to the learner,
+   in the order they were first seen */
+static void replay_shard_tokens(learner_t *learner, shard_reader_t *r, 
+				token_count_t limit) {
+  char tok[(MAX_TOKEN_LEN+1)*MAX_SUBMATCH+EXTRA_TOKEN_LEN];
+  hash_value_t id;
+  l_item_t *i, *j;
+
+  while( (r->count < limit) && read_shard_token(r, tok) ) {
+    id = hash_full_token(tok);
+    i = find_merged_item(learner, id);
+    if( i && !FILLEDP(i) &&
+	((100 * learner->unique_token_count) < 
+	 (HASH_FULL * learner->max_tokens)) ) {
+      j = find_in_learner(r->learner, id);
+      if( j && FILLEDP(j) ) {
+	fill_merged_item(learner, i, j);
+	tmp_grow(learner); /* just in case we're full */
+	tmp_write_token(learner, tok);
+      }
+    }
+  }
+}
+
+/* Merges the online dumps of n learners, where shard w learned the
+ * input files w, w + n, w + 2n, etc. After its k-th file, shard w had
+ * bound[w][k] distinct tokens. The new tokens are added file by file
+ * before the counts are merged, so the hash and the token list are
+ * filled in the same order as by a single learner reading all the
+ * files, and so are the learned weights.
+ */
+bool_t merge_learner_shards(learner_t *learner, char **path,
+			    token_count_t **bound, long *nbound, int n) {
+  learner_t *dummy;
+  shard_reader_t *r;
+  options_t m_sav, u_sav;
+  long k, kmax;
+  int w;
+  bool_t ok = 1;
+
+  dummy = (learner_t *)malloc(n * sizeof(learner_t));
+  r = (shard_reader_t *)malloc(n * sizeof(shard_reader_t));
+  if( !dummy || !r ) {
+    errormsg(E_FATAL, "not enough memory to merge %d shards\n", n);
+  }
+
+  kmax = 0;
+  for(w = 0; w < n; w++) {
+    m_sav = m_options;
+    u_sav = u_options;
+    init_learner(&dummy[w], path[w], 1);
+    m_options = m_sav;
+    u_options = u_sav;
+
+    r[w].learner = &dummy[w];
+    r[w].n = 0;
+    r[w].count = 0;
+    if( !tmp_seek_start(&dummy[w]) ) {
+      errormsg(E_ERROR, "cannot seek in temporary token file [%s]\n", 
+	       path[w]);
+      ok = 0;
+    }
+    kmax = MAXIMUM(kmax, nbound[w]);
+  }
+  if( !tmp_seek_end(learner) ) {
+    errormsg(E_ERROR, "cannot seek in temporary token file [%s]\n", 
+	     learner->filename);
+    ok = 0;
+  }
+
+  if( ok ) {
+    /* in case these changed while initing the shards */
+    learner->model.options = m_options;
+    learner->model.cp = m_cp;
+    learner->model.dt = m_dt;
+
+    for(k = 0; k < kmax; k++) {
+      for(w = 0; w < n; w++) {
+	if( k < nbound[w] ) {
+	  replay_shard_tokens(learner, &r[w], bound[w][k]);
+	}
+      }
+    }
+    /* whatever wasn't accounted for to a file */
+    for(w = 0; w < n; w++) {
+      replay_shard_tokens(learner, &r[w], K_TOKEN_COUNT_MAX);
+    }
+
+    for(w = 0; w < n; w++) {
+      if( merge_hashes(learner, &dummy[w]) ) {
+	merge_document_counts(learner, &dummy[w]);
+      } else {
+	ok = 0;
+      }
+    }
+  }
+
+  for(w = 0; w < n; w++) {
+    free_learner(&dummy[w]);
+  }
+  free(dummy);
+  free(r);
+
+  if( !ok ) {
+    errormsg(E_WARNING, 
+	     "the shards could not be merged, the learned category might be corrupt\n");
+  }
+
+  return ok;
+}
+
+/* reads the hash of an online dump straight from the file, in the
+   order of (home slot, id), one cluster of filled slots at a time */
+#define DUMP_BLOCK 1024
+typedef struct {
+  FILE *input;
+  char *path;
+  learner_t head; /* as stored in the dump, the pointers are junk */
+  hash_count_t slot;
+  bool_t seen_empty;
+  l_item_t *run;
+  hash_count_t run_len, run_pos, run_max;
+  l_item_t *wrap;
+  hash_count_t wrap_len, wrap_max;
+  l_item_t block[DUMP_BLOCK];
+  hash_count_t block_len, block_pos;
+} dump_reader_t;
+
+static hash_count_t dump_mask;
+
+static int compare_dump_items(const void *a, const void *b) {
+  hash_value_t x = ((const l_item_t *)a)->id;
+  hash_value_t y = ((const l_item_t *)b)->id;
+  if( (x & dump_mask) != (y & dump_mask) ) {
+    return ((x & dump_mask) < (y & dump_mask)) ? -1 : 1;
+  }
+  return (x < y) ? -1 : (x > y);
+}
+
+static bool_t push_dump_item(l_item_t **buf, hash_count_t *len, 
+			     hash_count_t *max, l_item_t *item) {
+  l_item_t *b;
+  if( *len >= *max ) {
+    b = (l_item_t *)realloc(*buf, 2 * (*max + 1) * sizeof(l_item_t));
+    if( !b ) {
+      return 0;
+    }
+    *buf = b;
+    *max = 2 * (*max + 1);
+  }
+  memcpy(*buf + (*len)++, item, sizeof(l_item_t));
+  return 1;
+}
+
+static bool_t open_dump_reader(dump_reader_t *r, char *path) {
+  char buf[MAGIC_BUFSIZE];
+  size_t l = strlen(MAGIC_ONLINE);
+
+  memset(r, 0, sizeof(dump_reader_t));
+  r->path = path;
+  r->input = fopen(path, "rb");
+  if( r->input ) {
+    if( (fread(buf, 1, l, r->input) == l) && 
+	(strncmp(buf, MAGIC_ONLINE, l) == 0) &&
+	(fread(&r->head, sizeof(learner_t), 1, r->input) == 1) &&
+	(r->head.retype == 0) && (r->head.max_tokens > 0) &&
+	((r->head.max_tokens & (r->head.max_tokens - 1)) == 0) ) {
+      return 1;
+    }
+    fclose(r->input);
+    r->input = NULL;
+  }
+  return 0;
+}
+
+static void close_dump_reader(dump_reader_t *r) {
+  if( r->input ) {
+    fclose(r->input);
+    r->input = NULL;
+  }
+  if( r->run ) {
+    free(r->run);
+    r->run = NULL;
+  }
+  if( r->wrap ) {
+    free(r->wrap);
+    r->wrap = NULL;
+  }
+}
+
+/* fills r->run with the next cluster, sorted. A cluster only holds
+   items whose home slots lie inside it, except that the cluster at the
+   start of the hash may hold items which wrapped around from the end.
+   Those are kept back and sorted into the last cluster. */
+static bool_t read_dump_cluster(dump_reader_t *r) {
+  l_item_t *item;
+  bool_t ok = 1;
+
+  r->run_len = r->run_pos = 0;
+  while( ok && (r->slot < r->head.max_tokens) ) {
+    if( r->block_pos >= r->block_len ) {
+      r->block_len = fread(r->block, sizeof(l_item_t), 
+			   MINIMUM(DUMP_BLOCK, r->head.max_tokens - r->slot),
+			   r->input);
+      r->block_pos = 0;
+      if( r->block_len == 0 ) {
+	errormsg(E_ERROR, "the file %s is truncated\n", r->path);
+	ok = 0;
+	break;
+      }
+    }
+    item = &r->block[r->block_pos++];
+    if( FILLEDP(item) ) {
+      if( !r->seen_empty && ((item->id & dump_mask) > r->slot) ) {
+	ok = push_dump_item(&r->wrap, &r->wrap_len, &r->wrap_max, item);
+      } else {
+	ok = push_dump_item(&r->run, &r->run_len, &r->run_max, item);
+      }
+      r->slot++;
+    } else {
+      r->seen_empty = 1;
+      r->slot++;
+      if( r->run_len > 0 ) {
+	break;
+      }
+    }
+  }
+  if( ok && (r->slot >= r->head.max_tokens) ) {
+    while( ok && (r->wrap_len > 0) ) {
+      ok = push_dump_item(&r->run, &r->run_len, &r->run_max, 
+			  &r->wrap[--r->wrap_len]);
+    }
+  }
+  if( !ok ) {
+    r->run_len = 0;
+    return 0;
+  }
+  qsort(r->run, r->run_len, sizeof(l_item_t), compare_dump_items);
+  return (r->run_len > 0);
+}
+
+/* the next item of r in (home slot, id) order, or NULL at the end */
+static l_item_t *peek_dump_item(dump_reader_t *r) {
+  if( (r->run_pos >= r->run_len) && !read_dump_cluster(r) ) {
+    return NULL;
+  }
+  return &r->run[r->run_pos];
+}
+
+/* a binary heap of readers, ordered by their next item. Equal
+   items come out in the order of the files, so the first file decides
+   the type of a feature, as with merge_hashes() */
+static bool_t dump_reader_before(dump_reader_t *a, dump_reader_t *b) {
+  int c = compare_dump_items(peek_dump_item(a), peek_dump_item(b));
+  return (c < 0) || ((c == 0) && (a < b));
+}
+
+static void sift_dump_heap(dump_reader_t **heap, int len, int k) {
+  dump_reader_t *t;
+  int c;
+
+  for(c = 2 * k + 1; c < len; k = c, c = 2 * k + 1) {
+    if( (c + 1 < len) && dump_reader_before(heap[c + 1], heap[c]) ) {
+      c++;
+    }
+    if( !dump_reader_before(heap[c], heap[k]) ) {
+      break;
+    }
+    t = heap[c]; heap[c] = heap[k]; heap[k] = t;
+  }
+}
+
+/* adds a combined item to the learner, new items are marked until
+   their token is appended to the token list */
+static bool_t add_combined_item(learner_t *learner, l_item_t *j) {
+  l_item_t *i;
+  bool_t isnew = 0;
+
+  i = find_merged_item(learner, j->id);
+  if( i ) {
+    if( !FILLEDP(i) ) {
+      if( (100 * learner->unique_token_count) >= 
+	  (HASH_FULL * learner->max_tokens) ) {
+	return 0;
+      }
+      fill_merged_item(learner, i, j);
+      SETMARK(i);
+      isnew = 1;
+    }
+
+    INCREASE(i->count, j->count, 
+	     K_TOKEN_COUNT_MAX, overflow_warning);
+
+    learner->tmax = MAXIMUM(learner->tmax, i->count);
+
+    INCREASE(learner->full_token_count, j->count,
+	     K_TOKEN_COUNT_MAX, overflow_warning);
+
+    INCREASE(learner->fixed_order_token_count[i->typ.order], j->count,
+	     K_TOKEN_COUNT_MAX, skewed_constraints_warning);
+  }
+  return isnew;
+}
+
+/* appends the tokens of the marked items, in the order of the token
+   list of r, and returns how many are still missing */
+static token_count_t append_combined_tokens(learner_t *learner, 
+					    dump_reader_t *r,
+					    token_count_t missing) {
+  char tok[(MAX_TOKEN_LEN+1)*MAX_SUBMATCH+EXTRA_TOKEN_LEN];
+  byte_t buf[BUFSIZ];
+  long left;
+  size_t n, k;
+  char *q;
+  l_item_t *i;
+
+  if( fseek(r->input, strlen(MAGIC_ONLINE) + sizeof(learner_t) + 
+	    sizeof(l_item_t) * r->head.max_tokens, SEEK_SET) != 0 ) {
+    errormsg(E_ERROR, "cannot seek in temporary token file [%s]\n", 
+	     r->path);
+    return missing;
+  }
+
+  q = tok;
+  for(left = r->head.tmp.used; (missing > 0) && (left > 0); left -= n) {
+    n = fread(buf, 1, MINIMUM((long)BUFSIZ, left), r->input);
+    if( n == 0 ) {
+      break;
+    }
+    for(k = 0; k < n; k++) {
+      if( buf[k] != TOKENSEP ) {
+	*q++ = buf[k]; /* copy into tok */
+      } else {
+	*q = 0;
+	i = find_in_learner(learner, hash_full_token(tok));
+	if( i && FILLEDP(i) && MARKEDP(i) ) {
+	  UNSETMARK(i);
+	  tmp_grow(learner); /* just in case we're full */
+	  tmp_write_token(learner, tok);
+	  missing--;
+	}
+	q = tok; /* reset q */
+      }
+    }
+  }
+  return missing;
+}
+
+/* Combines the online dumps in path[] into the learner. Up to
+ * COMBINE_WAYS dumps are read at once, straight from their files,
+ * and their hashes are merged like sorted lists: each dump is read
+ * in order of home slot, so equal features come out of the dumps
+ * together and are added to the learner with a single lookup, close
+ * to the previous one when the hash sizes match. Only the token
+ * strings of new features are read back. Dumps which can't be read
+ * this way are merged with merge_learner_struct() instead.
+ */
+bool_t combine_learner_dumps(learner_t *learner, char **path, int n) {
+  dump_reader_t *r;
+  dump_reader_t **heap;
+  l_item_t item, *next;
+  token_count_t missing;
+  alphabet_size_t ci, cj;
+  int w, k, m, len;
+  bool_t ok = 1;
+
+  r = (dump_reader_t *)malloc(COMBINE_WAYS * sizeof(dump_reader_t));
+  heap = (dump_reader_t **)malloc(COMBINE_WAYS * sizeof(dump_reader_t *));
+  if( !r || !heap ) {
+    errormsg(E_FATAL, "not enough memory to merge %d files\n", n);
+  }
+
+  /* the marks tell which features are new */
+  unmark_learner_items(learner);
+
+  learner->model.options = m_options;
+  learner->model.cp = m_cp;
+  learner->model.dt = m_dt;
+
+  for(w = 0; w < n; ) {
+    /* open the next batch of dumps with the same hash size */
+    for(m = 0; (w < n) && (m < COMBINE_WAYS); w++) {
+      if( !open_dump_reader(&r[m], path[w]) ) {
+	ok = merge_learner_struct(learner, path[w]) && ok;
+      } else if( (m > 0) && 
+		 (r[m].head.max_tokens != r[0].head.max_tokens) ) {
+	close_dump_reader(&r[m]);
+	break;
+      } else {
+	if( u_options & (1<<U_OPTION_VERBOSE) ) {
+	  fprintf(stdout, "loaded %s\n", path[w]);
+	}
+	m++;
+      }
+    }
+    if( (m == 0) || !tmp_seek_end(learner) ) {
+      for(k = 0; k < m; k++) {
+	close_dump_reader(&r[k]);
+      }
+      continue;
+    }
+
+    dump_mask = r[0].head.max_tokens - 1;
+    for(k = 0, len = 0; k < m; k++) {
+      if( peek_dump_item(&r[k]) ) {
+	heap[len++] = &r[k];
+      }
+    }
+    for(k = len / 2; k-- > 0; ) {
+      sift_dump_heap(heap, len, k);
+    }
+
+    /* equal features come out one after another */
+    missing = 0;
+    while( len > 0 ) {
+      memcpy(&item, peek_dump_item(heap[0]), sizeof(l_item_t));
+      item.count = 0;
+      do {
+	next = peek_dump_item(heap[0]);
+	INCREASE(item.count, next->count, 
+		 K_TOKEN_COUNT_MAX, overflow_warning);
+	heap[0]->run_pos++;
+	if( !peek_dump_item(heap[0]) ) {
+	  heap[0] = heap[--len];
+	}
+	sift_dump_heap(heap, len, 0);
+      } while( (len > 0) && (peek_dump_item(heap[0])->id == item.id) );
+
+      if( add_combined_item(learner, &item) ) {
+	missing++;
+      }
+    }
+
+    for(k = 0; k < m; k++) {
+      missing = append_combined_tokens(learner, &r[k], missing);
+
+      for(ci = 0; ci < ASIZE; ci++) { 
+	for(cj = 0; cj < ASIZE; cj++) { 
+	  learner->dig[ci][cj] += r[k].head.dig[ci][cj];
+	}
+      }
+      merge_document_counts(learner, &r[k].head);
+      close_dump_reader(&r[k]);
+    }
+
+    if( missing > 0 ) {
+      errormsg(E_WARNING, 
+	       "%ld merged features have no token, the learned category might be corrupt\n", 
+	       (long)missing);
+      unmark_learner_items(learner);
+      ok = 0;
+    }
+  }
+
+  free(r);
+  free(heap);
+  return ok;
+}
+/* returns an approximate binomial r.v.; if np < 10 and n > 20, 
+ * a Poisson approximation is used, else the variable is exact.
+ */   
+token_count_t binomial(token_count_t n, double p) {
+  double sum, thresh;
+  token_count_t i, x;
+
+  x = 0;
+  if( (n > 20) && (n * p < 10) ) {
+    /* approximate poisson has lambda = np */
+    sum = -log( ((double)rand())/(RAND_MAX + 1.0) );
+    thresh = n * p;
+    /* printf("poisson with sum = %g thresh = %g\n", sum, thresh);       */
+    while( (sum < thresh) && (x < n) ) {
+      x++;
+      sum += -log( ((double)rand())/(RAND_MAX + 1.0) );
+      /* printf("poisson with sum = %g thresh = %g, x = %d\n", sum, thresh, x); */
+    }
+  } else {
+    /* direct calculation of binomial */
+    for(i = 0; i < n; i++) {
+      x += (int)(p + ((double)rand())/(RAND_MAX + 1.0));
+    }
+  }
+/*   if( x > 0 ) { printf("binomial x = %d, n = %d, p = %g, np = %g\n", x, n, p, n * p); } */
+  return x;
+}
+
+void update_shannon_partials(learner_t *learner, bool_t fulldoc) {
+  hash_count_t i;
+  weight_t ell, lell;
+  bool_t docount;
+
+  docount = (learner->doc.emp.top > 0);
+  /* if force is true, we have a document, else we check emp.top to 
+     see if this is a nonempty document */
+  if( m_options & (1<<M_OPTION_CALCENTROPY) ) {
+
+    learner->doc.emp.shannon = 0;
+    if( learner->doc.emp.top > 0 ) {
+      /* assume all marks are zero to start with */
+      for(i = 0; i < learner->doc.emp.top; i++) {
+	l_item_t *p = find_in_learner(learner, learner->doc.emp.stack[i]);
+	if( p && !MARKEDP(p) ) {
+	  ell = ((weight_t)p->tmp.read.eff)/learner->doc.emp.top;
+
+	  /* it would be nice to be able to digitize p->B, but ell is
+	     often smaller than the smallest value, and if there are
+	     many documents, there could simultaneously be overflow on the most
+	     frequent features. So we need p->B to be a floating point type. */
+	  p->B += ell;
+
+	  /* the standard entropy convention is that 0*inf = 0. here, if
+	   * ell is so small that log(ell) is infinite, we pretend ell
+	   * == 0 this is slightly better than testing for ell == 0
+	   * directly.
+	   */
+
+	  lell = -log(ell);
+	  if( !isinf(lell) ) {
+	    learner->doc.emp.shannon += ell * lell;
+	  }
+
+	  SETMARK(p);
+	}
+      }
+
+      if( u_options & (1<<U_OPTION_CONFIDENCE) ) {
+	emplist_add_to_reservoir(learner->doc.reservoir, 
+				 learner->doc.count, 
+				 &learner->doc.emp);
+      }
+
+/*       fprintf(stderr, "udate_shannon A +(%f) S +(%f)\n",  */
+/* 	      -learner->doc.emp.shannon, (learner->doc.emp.shannon * learner->doc.emp.shannon)); */
+      learner->doc.A += -learner->doc.emp.shannon;
+      learner->doc.S += (learner->doc.emp.shannon * learner->doc.emp.shannon);
+
+      /* clear the empirical counts and marks */
+      for(i = 0; i < learner->doc.emp.top; i++) {
+	l_item_t *p = find_in_learner(learner, learner->doc.emp.stack[i]);
+	if( p && MARKEDP(p) ) {
+	  p->tmp.read.eff = 0;
+	  UNSETMARK(p);
+	}
+      }
+
+      /* now reset the empirical features */
+      learner->doc.emp.top = 0;
+
+    }
+  }
+  if( docount ) {
+    learner->doc.count++;
+  }
+}
+
+void calc_shannon(learner_t *learner) {
+  l_item_t *i, *e;
+  document_count_t c, n;
+  hash_count_t q;
+  emplist_t *empl;
+  score_t score;
+  score_t effective_count = 0.0;
+  double Lambda, jensen, s2;
+ 
+
+  learner->mu = 0.0;
+  learner->s2 = 0.0;
+  learner->alpha = 0.0;
+  learner->beta = 0.0;
+
+  effective_count = learner->doc.count; /* cast to real value for readability */
+
+  if( (m_options & (1<<M_OPTION_CALCENTROPY)) &&
+      (learner->doc.count > 1) ) {
+    learner->shannon += -(learner->doc.A/effective_count);
+    learner->shannon2 = 
+      (effective_count * learner->doc.S - (learner->doc.A * learner->doc.A)) /
+      (effective_count * (effective_count - 1.0)); 
+
+/*     fprintf(stderr, "[%f %f %f %f]\n", effective_count * learner->doc.S, (learner->doc.A * learner->doc.A), (effective_count * learner->doc.S - (learner->doc.A * learner->doc.A)), (effective_count * (effective_count - 1.0)) ); */
+/*     fprintf(stderr, "calc_entropy eff %f sha %f sha2 %f A %f S %f\n", effective_count, learner->shannon, learner->shannon2, learner->doc.A , learner->doc.S); */
+
+  } else { /* no individual documents, so compute global entropy */
+
+    learner->shannon = 0.0;
+    learner->shannon2 = 0.0;
+
+    if( !learner->feat.item ) {
+      build_learner_features(learner);
+    }
+    for(q = learner->feat.start[learner->max_order]; 
+	q < learner->feat.start[learner->max_order + 1]; q++) {
+      learner->shannon += 
+	log((weight_t)learner->feat.count[q]) * (weight_t)learner->feat.count[q]; 
+    }
+    learner->shannon = 
+      -( learner->shannon/learner->full_token_count -
+	 log((weight_t)learner->full_token_count) );
+  }
+
+  if( (u_options & (1<<U_OPTION_CONFIDENCE)) &&
+      (learner->doc.count > 0) ) {
+
+    /* shannon was computed during update */
+    jensen = 0.0;
+    e = learner->hash + learner->max_tokens;
+    for(i = learner->hash; i != e; i++) {
+      if( NOTNULL(i->lam) ) {
+	Lambda = UNPACK_LAMBDA(i->lam);
+	if( i->typ.order == 1 ) {
+	  Lambda += UNPACK_RWEIGHTS(i->tmp.min.dref) - learner->logZ;
+	}
+	learner->mu += (Lambda * i->B);
+	jensen += (Lambda * Lambda * i->B);
+      }
+    }
+
+    learner->mu /= effective_count;
+    learner->mu = -(learner->shannon + learner->mu);
+
+    s2 = 0.0;
+    n = 1;
+    for(c = 0; c < RESERVOIR_SIZE; c++) {
+      empl = &(learner->doc.reservoir[c]);
+      if( !empl->stack  ) {
+	n++;
+	continue;
+      } else {
+	score = 0;
+	for(q = 0; q < empl->top; q++) {
+	  i = find_in_learner(learner, empl->stack[q]);
+	  if( i && NOTNULL(i->lam) ) {
+	    Lambda = UNPACK_LAMBDA(i->lam);
+	    if( i->typ.order == 1 ) {
+	      Lambda += UNPACK_RWEIGHTS(i->tmp.min.dref) - learner->logZ;
+	    }
+	    score += Lambda;
+	  }
+	}
+
+	score = score/empl->top + empl->shannon;
+	if( u_options & (1<<U_OPTION_VERBOSE) &&
+	    u_options & (1<<U_OPTION_CONFIDENCE) ) {
+	  fprintf(stdout, 
+		  "%s ( %5.2" FMT_printf_score_t " + "
+		  "%-5.2" FMT_printf_score_t " )* %-" FMT_printf_integer_t " \n",
+		  "reservoir",
+		  -nats2bits(score),
+		  nats2bits(empl->shannon),
+		  empl->top);
+	}
+
+	score = -score - learner->mu;
+	s2 += (score)*(score);
+      }
+    }
+
+    /* the reservoir doesn't contain enough extreme samples, so
+       the variance is necessarily underestimated. 
+    */
+    if( (c <= n) || isinf(learner->s2) ) {
+      learner->s2 = 0.0;
+      learner->alpha = 0.0;
+      learner->beta = 0.0;
+    } else {
+      learner->s2 = s2/(c-n);
+      learner->alpha = (learner->mu*learner->mu)/learner->s2;
+      learner->beta = learner->s2/learner->mu;
+    }
+
+
+  } else {
+    learner->alpha = 0.0;
+    learner->beta = 0.0;
+    learner->mu = 0.0;
+    learner->s2 = 0.0;
+  }
+
+  if( m_options & (1<<M_OPTION_CALCENTROPY) ) {
+    clear_empirical(&empirical);
+  }
+
+  if( u_options & (1<<U_OPTION_VERBOSE) ) {
+    fprintf(stdout, 
+	    "documents %ld shannon %" FMT_printf_score_t 
+	    " mu %" FMT_printf_score_t 
+	    " s2 %" FMT_printf_score_t 
+	    " alpha %" FMT_printf_score_t 
+	    " beta %" FMT_printf_score_t "\n",
+	    (long int)effective_count, 
+	    nats2bits(learner->shannon), 
+	    nats2bits(learner->mu), 
+	    nats2bits(learner->s2), 
+	    nats2bits(learner->alpha),
+	    nats2bits(learner->beta));
+  }
+
+}
+
+void reset_mbox_messages(learner_t *learner, MBOX_State *mbox) {
+  not_header = 1;
+  learner->doc.count = 0;
+  learner->doc.nullcount = 0; /* first header doesn't count */
+  learner->doc.skip = 0;
+}
+
+void count_mbox_messages(learner_t *learner, Mstate mbox_state, char *textbuf) {
+
+  if( !textbuf ) { 
+    update_shannon_partials(learner, 0);
+    /* don't count document */
+  } else {
+    switch(mbox_state) {
+    case msHEADER:
+      if(not_header) {
+	if( u_options & (1<<U_OPTION_DECIMATE) ) {
+	  learner->doc.skip = ( rand() > (int)(RAND_MAX>>decimation) );
+	} 
+	if( !learner->doc.skip ) {
+	  if( m_options & (1<<M_OPTION_CALCENTROPY) &&
+	      (learner->doc.emp.top == 0) ) {
+	    learner->doc.nullcount++;
+	  }
+	  update_shannon_partials(learner, 1);
+	}
+      }
+      not_header = 0;
+      break;
+    default:
+      not_header = 1;
+      break;
+    }
+  }
+
+}
+
+
+l_item_t *find_in_learner(learner_t *learner, hash_value_t id) {
+  hash_count_t n, m;
+
+  n = probe_hash_ctrl(learner->ctrl, learner->max_tokens, id, id,
+		      (byte_t *)learner->hash, sizeof(l_item_t), 
+		      offsetof(l_item_t, id));
+  if( learner->grow.old_tokens && 
+      ((n == learner->max_tokens) || !FILLEDP(&learner->hash[n])) ) {
+    /* the hash is growing and id may not have been moved yet */
+    m = probe_old_layout(learner, id);
+    if( m < learner->grow.old_tokens ) {
+      return &learner->hash[m];
+    }
+  }
+  /* either the id or an empty slot, NULL when hash table is full */
+  return (n < learner->max_tokens) ? &learner->hash[n] : NULL;
+}
+
+
+/* places the token in the global hash and writes the
+   token to a temporary file for later, then updates
+   the digram frequencies. Tokens have the format 
+   DIAMOND t1 DIAMOND t2 ... tn DIAMOND CLASSEP class NUL */
+void hash_word_and_learn(learner_t *learner, 
+			 char *tok, token_type_t tt, regex_count_t re) {
+  hash_value_t id;
+  l_item_t *i;
+  char *s;
+  alphabet_size_t p,q,len;
+  token_count_t seen = 0;
+
+  for(s = tok; s && *s == DIAMOND; s++);
+  if( s && (*s != EOTOKEN) ) { 
+
+    if( overflow_warning ) {
+      return; /* for there be troubles ahead */
+    }
+
+    if( learner->grow.old_tokens || learner->grow.tidy_tokens ) {
+      grow_learner_step(learner);
+    }
+
+    if( m_options & (1<<M_OPTION_MULTINOMIAL) ) { tt.order = 1; }
+
+    if( u_options & (1<<U_OPTION_DECIMATE) ) {
+      if( m_options & (1<<M_OPTION_MBOX_FORMAT) ) {
+	if( learner->doc.skip ) {
+	  return;
+	}
+      } else {
+	if( rand() > (int)(RAND_MAX>>decimation) ) {
+	  return;
+	}
+      }
+    }
+
+    id = hash_full_token(tok);
+    i = find_in_learner(learner, id);
+
+    if( i && !FILLEDP(i) &&
+	((100 * learner->unique_token_count) >= 
+	 (HASH_FULL * learner->max_tokens)) && grow_learner_hash(learner) ) {
+      i = find_in_learner(learner,id);
+      /* new i, go through all tests again */
+    }
+
+    if( i && !FILLEDP(i) && learner->sketch.count ) {
+      seen = count_in_sketch(learner, id);
+      if( seen < (token_count_t)zsketch ) {
+	/* still rare, only the totals count it, as if cut by -z */
+	learner->sketch.held++;
+	INCREMENT(learner->full_token_count, 
+		  K_TOKEN_COUNT_MAX, overflow_warning);
+	INCREMENT(learner->fixed_order_token_count[tt.order],
+		  K_TOKEN_COUNT_MAX, skewed_constraints_warning);
+	i = NULL;
+      }
+    }
+
+    if( i ) {
+
+      if( FILLEDP(i) ) {
+
+	/* redundant :-) */
+
+      } else if( /* !FILLEDP(i) && */
+		((100 * learner->unique_token_count) < 
+		 (HASH_FULL * learner->max_tokens) ) ) {
+
+	/* fill the hash and write to file */
+
+	SET(i->id,id);
+	set_hash_ctrl(learner->ctrl, learner->max_tokens, i - learner->hash, id);
+
+	INCREMENT(learner->unique_token_count, 
+		  K_TOKEN_COUNT_MAX, overflow_warning);
+
+	i->typ = tt;
+
+	if( seen > 1 ) {
+	  /* the occurrences counted in the sketch so far */
+	  i->count = seen - 1;
+	  learner->sketch.held -= MINIMUM(learner->sketch.held, seen - 1);
+	}
+
+	/* order accounting */
+	learner->max_order = MAXIMUM(learner->max_order,i->typ.order);
+
+	INCREMENT(learner->fixed_order_unique_token_count[i->typ.order],
+		  K_TOKEN_COUNT_MAX, overflow_warning);
+
+     	if( (u_options & (1<<U_OPTION_DEBUG)) ) {
+     	  fprintf(stdout, "match %8lx ", (long unsigned int)i->id);
+	  print_token(stdout, tok);
+	  fprintf(stdout, " %d\n", i->typ.order);
+     	}
+
+	tmp_grow(learner); /* just in case we're full */
+	tmp_write_token(learner, tok);
+      }
+
+      INCREMENT(i->count, K_TOKEN_COUNT_MAX, overflow_warning);
+      learner->tmax = MAXIMUM(learner->tmax, i->count);
+
+      if( learner->delta.id ) {
+	note_learner_delta(learner, i->id);
+      }
+
+      if( m_options & (1<<M_OPTION_CALCENTROPY) ) {
+	if( (learner->doc.emp.top < learner->doc.emp.max) ||
+	    emplist_grow(&learner->doc.emp) ) {
+	  i->tmp.read.eff++; /* this can never overflow before i->count */
+	  UNSETMARK(i); /* needed for calculating shannon */
+	  learner->doc.emp.stack[learner->doc.emp.top++] = i->id;
+	}
+      }
+
+      INCREMENT(learner->full_token_count, 
+		K_TOKEN_COUNT_MAX, overflow_warning);
+
+      INCREMENT(learner->fixed_order_token_count[i->typ.order],
+		K_TOKEN_COUNT_MAX, skewed_constraints_warning);
+
+    }
+
+    if( digramic_overflow_warning ) {
+      return;
+    }
+
+
+    /* now update digram frequency counts */
+    if( tt.order == 1 ) { /* count each token only once */
+      p = *tok++;
+      CLIP_ALPHABET(p);
+      len = 1;
+      /* finally update character frequencies */
+      while( *tok != EOTOKEN ) {
+	q = (unsigned char)*tok;
+	CLIP_ALPHABET(q);
+	if( learner->dig[p][q] < K_DIGRAM_COUNT_MAX ) 
+	  { learner->dig[p][q]++; } else { digramic_overflow_warning = 1; }
+	if( learner->dig[RESERVED_MARGINAL][q] < K_DIGRAM_COUNT_MAX )
+	  { learner->dig[RESERVED_MARGINAL][q]++; } /* no warning on overflow */
+
+	p = q;
+	tok++;
+	if( q != DIAMOND ) { len++; }
+      }
+      learner->dig[RESERVED_TOKLEN][len]++;
+
+      if( digramic_overflow_warning ) {
+	errormsg(E_WARNING,
+		"ran out of integers (too much data), "
+		"reference measure may be skewed.\n");
+	m_options |= (1<<M_OPTION_WARNING_BAD);
+      }
+    }
+
+    if( overflow_warning ) {
+      errormsg(E_WARNING,
+	      "ran out of integers (too much data), "
+	      "results may be skewed.\n");
+      m_options |= (1<<M_OPTION_WARNING_BAD);
+    }
+  }
+}
+
+/* initialize global learner object */
+void init_learner(learner_t *learner, char *opath, bool_t readonly) {
+  alphabet_size_t i, j;
+  regex_count_t c;
+  token_order_t z;
+
+  /* some constants */
+  learner->max_tokens = default_max_tokens;
+  learner->max_hash_bits = default_max_hash_bits;
+  learner->full_token_count = 0;
+  learner->unique_token_count = 0;
+  learner->tmax = 0;
+  learner->logZ = 0.0;
+  learner->shannon = 0.0;
+  learner->shannon2 = 0.0;
+  learner->alpha = 0.0;
+  learner->beta = 0.0;
+  learner->mu = 0.0;
+  learner->s2 = 0.0;
+  learner->max_order = 0;
+  memset(learner->mediaprobs, 0 , TOKEN_CLASS_MAX * sizeof(score_t));
+
+  learner->doc.A = 0.0;
+  learner->doc.S = 0.0;
+  learner->doc.count = 0;
+  learner->doc.nullcount = 0;
+  learner->doc.emp.top = 0;
+  learner->doc.emp.max = 0;
+  learner->doc.emp.stack = NULL;
+  memset(learner->doc.reservoir, 0, RESERVOIR_SIZE * sizeof(emplist_t));
+
+  learner->model.options = m_options;
+  learner->model.cp = m_cp;
+  learner->model.dt = m_dt;
+  learner->model.tmin = zthreshold;
+  learner->u_options = u_options;
+
+  learner->mmap_start = NULL;
+  learner->mmap_learner_offset = 0;
+  learner->mmap_hash_offset = 0;
+  learner->hash = NULL;
+  learner->ctrl = NULL;
+  memset(&learner->grow, 0, sizeof(learner->grow));
+  memset(&learner->delta, 0, sizeof(learner->delta));
+  memset(&learner->sketch, 0, sizeof(learner->sketch));
+  memset(&learner->feat, 0, sizeof(l_features_t));
+
+  /* init character frequencies */
+  for(i = 0; i < ASIZE; i++) { 
+    for(j = 0; j < ASIZE; j++) { 
+      learner->dig[i][j] = 0.0;
+    }
+  }
+
+  for(c = 0; c < MAX_RE + 1; c++) {
+    learner->regex_token_count[c] = 0;
+  }
+
+  for(z = 0; z < MAX_SUBMATCH; z++) {
+    learner->fixed_order_token_count[z] = 0;
+    learner->fixed_order_unique_token_count[z] = 0;
+  }
+
+  if( m_options & (1<<M_OPTION_MBOX_FORMAT) ) {
+    reset_mbox_messages(learner, &mbox);
+  }
+
+  if( !(opath && *opath && 
+	read_online_learner_struct(learner, opath, readonly)) ) {
+    /* if we're here, we must do what read_online_... didn't do */
+
+    /* allocate and zero room for hash */
+    learner->hash = (l_item_t *)calloc(learner->max_tokens, sizeof(l_item_t));
+    learner->ctrl = new_hash_ctrl(learner->max_tokens);
+    if( !learner->hash || !learner->ctrl ) {
+      errormsg(E_FATAL,
+	       "not enough memory? I couldn't allocate %li bytes\n",
+	       (sizeof(l_item_t) * ((long int)learner->max_tokens)));
+    }
+
+    learner->tmp.file = NULL;
+    learner->tmp.filename = NULL;
+    learner->tmp.iobuf = NULL;
+    learner->tmp.offset = 0;
+    learner->tmp.avail = 0;
+    learner->tmp.used = 0;
+    learner->tmp.mmap_start = NULL;
+    learner->tmp.mmap_offset = 0;
+    learner->tmp.mmap_length = 0;
+    learner->tmp.mmap_cursor = 0;
+    learner->tmp.arena_cursor = 0;
+
+    /* keep the tokens in memory for now, see tmp_grow() */
+    learner->tmp.arena = (byte_t *)malloc(TOKEN_LIST_GROW);
+    if( learner->tmp.arena ) {
+      learner->tmp.avail = TOKEN_LIST_GROW;
+    } else {
+      tmp_open_file(learner);
+    }
+
+  } else if( (u_options & (1<<U_OPTION_INCREMENTAL)) && !readonly ) {
+    /* only the features counted from now on need new weights */
+    learner->delta.max = system_pagesize/sizeof(hash_value_t);
+    learner->delta.id = 
+      (hash_value_t *)malloc(learner->delta.max * sizeof(hash_value_t));
+    if( !learner->delta.id ) {
+      learner->delta.max = 0;
+    }
+  }
+
+  if( (zsketch > 1) && !readonly ) {
+    /* rare tokens are kept out of the hash, see count_in_sketch() */
+    learner->sketch.bits = 
+      MINIMUM(learner->max_hash_bits + SKETCH_WIDTH_BITS, 30);
+    learner->sketch.count = 
+      (byte_t *)calloc((size_t)SKETCH_DEPTH << learner->sketch.bits, 1);
+    if( !learner->sketch.count ) {
+      errormsg(E_WARNING,
+	       "disabling -Z. Not enough memory? I couldn't allocate %li bytes\n",
+	       ((long int)SKETCH_DEPTH) << learner->sketch.bits);
+      learner->sketch.bits = 0;
+    }
+  }
+
+  if( u_options & (1<<U_OPTION_MMAP) ) {
+    MLOCK(learner->hash, sizeof(l_item_t) * learner->max_tokens);
+  }
+
+  MADVISE(learner->hash, sizeof(l_item_t) * learner->max_tokens, 
+	  MADV_SEQUENTIAL);
+
+  if( m_options & (1<<M_OPTION_CALCENTROPY) ) {
+    learner->doc.emp.max = system_pagesize/sizeof(hash_count_t);
+    learner->doc.emp.stack = 
+      (hash_value_t *)malloc(learner->doc.emp.max * sizeof(hash_value_t));
+    if( !learner->doc.emp.stack ) {
+      errormsg(E_WARNING,
+	       "disabling emp.stack. Not enough memory? I couldn't allocate %li bytes\n",
+	       sizeof(hash_count_t *) * ((long int)learner->doc.emp.max));
+      m_options &= ~(1<<M_OPTION_CALCENTROPY);
+    }
+  }
+
+}
+
+void free_learner(learner_t *learner) {
+  document_count_t i;
+
+  free_learner_hash(learner);
+  free_learner_features(learner);
+  if( learner->ctrl ) {
+    free(learner->ctrl);
+    learner->ctrl = NULL;
+  }
+  if( learner->grow.old ) {
+    free(learner->grow.old);
+    learner->grow.old = NULL;
+  }
+  free_learner_delta(learner);
+  free_learner_sketch(learner);
+
+  if( learner->doc.emp.stack ) { 
+    free(learner->doc.emp.stack); 
+    learner->doc.emp.stack = NULL;
+  }
+
+  for( i = 0; i < RESERVOIR_SIZE; i++ ) {
+    if( learner->doc.reservoir[i].stack ) {
+      free(learner->doc.reservoir[i].stack); 
+      learner->doc.reservoir[i].stack = NULL;
+    }
+  }
+
+  if( learner->tmp.file ) {
+    fclose(learner->tmp.file);
+    learner->tmp.file = NULL;
+  }
+  if( learner->tmp.arena ) {
+    free(learner->tmp.arena);
+    learner->tmp.arena = NULL;
+  }
+
+  cleanup_tempfiles();
+}
+
+/* calculates the most probable Dirichlet parameters 
+   given digram counts. Method described in MacKay and Peto (1995)
+   Since we don't count the DIAMOND-DIAMOND digram, including the prior will 
+   overestimate the DIAMOND-DIAMOND transition probability. However, for this 
+   transition as well as the others, the Dirichlet will have practically
+   no effect when there's enough data in the corpus.
+
+   HOWEVER: 
+   * A property of the MP posterior estimates is that if character j
+   * never appears as a transition *target*, then the corresponding
+   * u[j] entry is null. Sometimes, this makes sense, as j isn't part
+   * of the "vocabulary", but other times it's not sensible, becasue sooner
+   * or later some spam message will make use of that character in
+   * some combination with another character. When that happens, we're
+   * in trouble.
+   *
+   * Previous versions of dbacl.c had a simple hack to prevent this
+   * possibility: we pretend we saw a DIAMOND-j-DIAMOND
+   * double transition, for each j. Equivalently, we simply increment
+   * the count by 1 for each such transition, i.e.
+   *     learner->dig[i][(alphabet_size_t)DIAMOND]++;
+   *     learner->dig[(alphabet_size_t)DIAMOND][i]++;
+   *
+   * This hack has now been removed again, to prevent confusion.
+   * It's not really needed, since the uniform measure can be used
+   * for spam filtering.
+*/
+void make_dirichlet_digrams(learner_t *learner) {
+  alphabet_size_t i, j;
+  token_count_t k;
+  float G[ASIZE];
+  float H[ASIZE];
+  float V[ASIZE];
+  float F[ASIZE];
+  double prev_alpha;
+  double K, t;
+
+  /* initialize */
+  dirichlet.alpha = 1.0;
+  for(i = AMIN; i < ASIZE; i++) {
+    dirichlet.u[i] = 1.0/((double)(ASIZE - AMIN));
+  }
+
+  /* precompute useful constants */
+  for(j = AMIN; j < ASIZE; j++) {
+    G[j] = 0.0;
+    H[j] = 0.0;
+    V[j] = 0.0;
+    F[j] = 0.0;
+    for(i = AMIN; i < ASIZE; i++) {
+      for(k = AMIN; k < (token_count_t)learner->dig[i][j]; k++) {
+	G[j] += 1.0/k;
+	H[j] += 1.0/((double)k*k);
+      }
+      if( learner->dig[i][j] > 0 ) { 
+	V[j]++; 
+	F[j] += learner->dig[i][j];
+      }
+    }
+    if( 0 && u_options & (1<<U_OPTION_DEBUG) ) { 
+      fprintf(stdout, 
+	      "symbol %d has G = %g H = %g V = %g F = %g\n", 
+	      j, G[j], H[j], V[j], F[j]);
+    }
+  }
+
+  /* now optimize the dirichlet parameters */
+#define MAX_DIRITER 300 
+  k = 0; 
+  do {
+    prev_alpha = dirichlet.alpha;
+    K = 0.0;
+    for(i = AMIN; i < ASIZE; i++) {
+      K += log((F[i] + prev_alpha)/prev_alpha) +
+	(0.5) * F[i]/(prev_alpha * (F[i] + prev_alpha));
+    }
+    dirichlet.alpha = 0.0;
+    for(j = AMIN; j < ASIZE; j++) {
+      t = K - G[j];
+      dirichlet.u[j] = 2 * V[j] /(t + sqrt(t * t + 4 * H[j] * V[j]));
+      dirichlet.alpha += dirichlet.u[j];
+    }
+    if( u_options & (1<<U_OPTION_VERBOSE) ) {
+      fprintf(stdout, 
+	      "dirichlet alpha %g --> %g\n", 
+	      prev_alpha, dirichlet.alpha);
+    }
+  } while((k++ < MAX_DIRITER) && 
+	  (fabs(prev_alpha - dirichlet.alpha) > qtol_alpha) );
+
+  if( k >= MAX_DIRITER ) {
+    errormsg(E_WARNING, "dirichlet measure did not converge.\n");
+  }
+  
+  if(u_options & (1<<U_OPTION_VERBOSE) ) {
+    for(j = AMIN; j < ASIZE; j++) {
+      fprintf(stdout, 
+	      "dirichlet u[%d] =  %g\n", 
+	      j, dirichlet.u[j]);
+    }
+  }
+
+  /* now make the probabilities */
+
+  for(i = AMIN; i < ASIZE; i++) {
+    t = 0.0;
+    for(j = AMIN; j < ASIZE; j++) {
+      t += learner->dig[i][j];
+    }
+    for(j = AMIN; j < ASIZE; j++) {
+      /* note: simulate the effect of digitizing the digrams */
+      learner->dig[i][j] = 
+	UNPACK_DIGRAMS(PACK_DIGRAMS(log(((weight_t)learner->dig[i][j] + 
+					 dirichlet.u[j]) / 
+					(t + dirichlet.alpha)))); 
+      if( 1 && u_options & (1<<U_OPTION_DEBUG) ) {
+	fprintf(stdout,
+		"learner->dig[%d][%d] = %f\n", 
+		i, j, learner->dig[i][j]);
+      }
+    }
+  }
+  /* clear other data */
+  for(i = 0; i < AMIN; i++) {
+    for(j = 0; j < ASIZE; j++) {
+      learner->dig[i][j] = 0.0;
+    }
+  }
+}
+
+void make_uniform_digrams(learner_t *learner) {
+  alphabet_size_t i, j;
+  for(i = AMIN; i < ASIZE; i++) {
+    for(j = AMIN; j < ASIZE; j++) {
+      /* note: simulate the effect of digitizing the digrams */
+      learner->dig[i][j] = UNPACK_DIGRAMS(PACK_DIGRAMS(-log(ASIZE - AMIN)));
+      if(0 && u_options & (1<<U_OPTION_DEBUG) ) {
+	fprintf(stdout,
+		"learner->dig[%d][%d] = %f\n", 
+		i, j, learner->dig[i][j]);
+      }
+    }
+  }
+  /* clear other data */
+  for(i = 0; i < AMIN; i++) {
+    for(j = 0; j < ASIZE; j++) {
+      learner->dig[i][j] = 0.0;
+    }
+  }
+}
+
+
+void make_toklen_digrams(learner_t *learner) {
+  alphabet_size_t i, j;
+  weight_t lam[MAX_TOKEN_LEN+2];
+  weight_t total;
+  /* zero out usual digrams, we only use token length */
+  {
+    for(i = AMIN; i < ASIZE; i++) {
+      for(j = AMIN; j < ASIZE; j++) {
+	learner->dig[i][j] = 0.0;
+      }
+    }
+    for(j = AMIN; j < ASIZE; j++) {
+      learner->dig[RESERVED_MARGINAL][j] = 0.0;
+    }
+  }
+  /* note: toklen counts the number of transitions, not number of chars */
+  total = 0.0;
+  for(i = 2; i < MAX_TOKEN_LEN+2; i++) {
+    if( learner->dig[RESERVED_TOKLEN][i] <= 0.0 ) {
+      /* don't want infinities */
+      learner->dig[RESERVED_TOKLEN][i]++;
+    }
+    total += learner->dig[RESERVED_TOKLEN][i];
+  }  
+
+  lam[0] = 0.0; /* normalizing constant */
+  for(i = 2; i < MAX_TOKEN_LEN+2; i++) {
+    lam[i] = log(learner->dig[RESERVED_TOKLEN][i]/total) - i * log(ASIZE - AMIN);
+  }
+  for(i = 0; i < MAX_TOKEN_LEN+2; i++) {
+    if(0 && u_options & (1<<U_OPTION_DEBUG) ) {
+      fprintf(stdout,
+	      "learner->dig[%d][%d] = %f %f %f\n", 
+	      RESERVED_TOKLEN, i, learner->dig[RESERVED_TOKLEN][i],
+	      -i * log(ASIZE - AMIN), lam[i]);
+    }
+    learner->dig[RESERVED_TOKLEN][i] = UNPACK_DIGRAMS(PACK_DIGRAMS(lam[i]));
+  }
+}
+
+void make_mle_digrams(learner_t *learner) {
+  alphabet_size_t i, j;
+  double total;
+  double missing;
+
+  /* for the mle we use a slightly modified emprirical frequency histogram.
+     This is necessary because the true mle causes a singularity in classification
+     whenever a word contains a character transition which was never seen before.
+     The modification is to mix the true mle with a uniform distribution, but
+     the uniform only accounts for 1/total of the mass, so ie it disappears 
+     quickly.
+  */
+  for(i = AMIN; i < ASIZE; i++) {
+    total = 0.0;
+    missing = 0.0;
+    for(j = AMIN; j < ASIZE; j++) {
+      if( learner->dig[i][j] > 0.0 ) {
+	total += learner->dig[i][j];
+      } else {
+	missing++;
+      }
+    }
+    if( total > 0.0 ) {
+      if( missing > 0.0 ) {
+	missing = 1.0/missing;
+	for(j = AMIN; j < ASIZE; j++) {
+	  learner->dig[i][j] =
+	    UNPACK_DIGRAMS(PACK_DIGRAMS(log((learner->dig[i][j]/total) * (1.0 - missing) + missing)));
+	}	
+      } else {
+	for(j = AMIN; j < ASIZE; j++) {
+	  learner->dig[i][j] = 
+	    UNPACK_DIGRAMS(PACK_DIGRAMS(log(learner->dig[i][j] / total)));
+	}
+      }
+    } else {
+      for(j = AMIN; j < ASIZE; j++) {
+	learner->dig[i][j] = 
+	  UNPACK_DIGRAMS(PACK_DIGRAMS(-log(missing)));
+      }
+    }
+  }
+  /* clear other data */
+  for(i = 0; i < AMIN; i++) {
+    for(j = 0; j < ASIZE; j++) {
+      learner->dig[i][j] = 0.0;
+    }
+  }
+}
+
+void make_iid_digrams(learner_t *learner) {
+  alphabet_size_t i, j;
+  double total;
+  double missing;
+
+  /* the digrams here are not character transitions, but merely destination
+     character frequencies, ie the characters of a token are assumed
+     independent and identically distributed. */
+
+  total = 0.0;
+  missing = 0.0;
+
+  for(j = AMIN; j < ASIZE; j++) {
+    if( learner->dig[RESERVED_MARGINAL][j] > 0.0 ) {
+      total += learner->dig[RESERVED_MARGINAL][j];
+    } else {
+      missing++;
+    }
+  }
+  if( total > 0.0 ) {
+    if( missing > 0.0 ) {
+      missing = 1.0/missing;
+      for(j = AMIN; j < ASIZE; j++) {
+	learner->dig[RESERVED_MARGINAL][j] =
+	  UNPACK_DIGRAMS(PACK_DIGRAMS(log((learner->dig[RESERVED_MARGINAL][j]/total) * (1.0 - missing) + missing)));
+      }
+    } else {
+      for(j = AMIN; j < ASIZE; j++) {
+	learner->dig[RESERVED_MARGINAL][j] =
+	  UNPACK_DIGRAMS(PACK_DIGRAMS(log(learner->dig[RESERVED_MARGINAL][j] / total)));
+      }
+    }
+  } else {
+    for(j = AMIN; j < ASIZE; j++) {
+      learner->dig[RESERVED_MARGINAL][j] =
+	UNPACK_DIGRAMS(PACK_DIGRAMS(-log(missing)));
+    }
+  }
+
+  /* now make all transitions identical */
+  for(j = 0; j < ASIZE; j++) {
+    for(i = AMIN; i < ASIZE; i++) {
+      learner->dig[i][j] = learner->dig[RESERVED_MARGINAL][j];
+    }
+  }
+  /* clear other data */
+  for(i = 0; i < AMIN; i++) {
+    for(j = 0; j < ASIZE; j++) {
+      learner->dig[i][j] = 0.0;
+    }
+  }
+}
+
+/* use 0.0 for small datasets, 1.0 for huge datasets. 
+ * 0.6 works well generally. I don't understand this :-( 
+ */
+void transpose_digrams(learner_t *learner) {
+  register alphabet_size_t i, j;
+  register weight_t t;
+
+  /* we skip transitions involving DIAMOND, TOKENSEP */
+  /* code below uses fact that DIAMOND == 0x01 */
+  /* code below uses fact that TOKENSEP == 0x02 */
+  for(i = AMIN; i < ASIZE; i++) {
+    for(j = AMIN; j < i; j++) {
+      t = (learner->dig[i][j] + learner->dig[j][i])/2.0;
+      learner->dig[j][i] =  0.6 * learner->dig[j][i] + 0.4 * t;
+      learner->dig[i][j] =  0.6 * learner->dig[i][j] + 0.4 * t; 
+    }
+  }
+}
+
+void recompute_ed(learner_t *learner, weight_t *plogzon, weight_t *pdiv, 
+		  int i, weight_t lam[ASIZE], weight_t Xi) {
+  register alphabet_size_t j;
+  weight_t logA = log((weight_t)(ASIZE - AMIN));
+  weight_t logzon, div;
+  weight_t maxlogz, tmp;
+
+  maxlogz = 0.0;
+  for(j = AMIN; j < ASIZE; j++) {
+    if( lam[j] > 0.0 ) {
+      tmp = lam[j] + log(1.0 - exp(-lam[j])) - logA;
+      if( maxlogz < tmp ) {
+	maxlogz = tmp;
+      }
+    }
+  }
+
+
+  logzon = exp(0.0 - maxlogz);
+  div = 0.0;
+  for(j = AMIN; j < ASIZE; j++) {
+    if( lam[j] > 0.0 ) {
+      tmp = -logA - maxlogz;
+      logzon += (exp( lam[j] + tmp) - exp(tmp));
+      div += lam[j] * learner->dig[i][j];
+    }
+  }
+
+
+  tmp = maxlogz + log(logzon);
+
+  if( isnan(tmp) ) {
+    errormsg(E_FATAL,"sorry, digramic partition function went kaboom.\n");
+  }
+
+  logzon = tmp;
+  div = div/Xi - logzon;
+
+  *plogzon = logzon;
+  *pdiv = div;
+}
+
+void make_entropic_digrams(learner_t *learner) {
+  weight_t lam[ASIZE];
+  weight_t lam_delta, old_lam, logt, maxlogt;
+  weight_t Xi, logXi, logzon, div, old_logzon, old_div;
+  weight_t logA = log((weight_t)(ASIZE - AMIN));
+  register alphabet_size_t i, j;
+  int itcount;
+
+  for(i = AMIN; i < ASIZE; i++) {
+
+    /* initializations */
+    Xi = 0.0;
+    for(j = AMIN; j < ASIZE; j++) {
+      Xi += learner->dig[i][j];
+      lam[j] = 0.0;
+    }
+    logXi = log(Xi);
+
+    recompute_ed(learner, &logzon, &div, i, lam, Xi);
+
+    /* now iterate - this is like minimize_learner_divergence() */
+    itcount = 0;
+    do {
+      itcount++;
+
+      old_logzon = logzon;
+      old_div = div;
+
+      lam_delta = 0.0;
+      for(j = AMIN; j < ASIZE; j++) {
+	if( learner->dig[i][j] > 0.0 ) {
+
+	  old_lam = lam[j];
+	  lam[j] = log(learner->dig[i][j]) - logXi + logA + logzon;
+
+	  if( isnan(lam[j]) ) {
+
+	    lam[j] = old_lam;
+	    recompute_ed(learner, &logzon, &div, i, lam, Xi);
+
+	  } else {
+
+	    if( lam[j] > (old_lam + MAX_LAMBDA_JUMP) ) {
+	      lam[j] = (old_lam + MAX_LAMBDA_JUMP);
+	    } else if( lam[j] < (old_lam - MAX_LAMBDA_JUMP) ) {
+	      lam[j] = (old_lam - MAX_LAMBDA_JUMP);
+	    }
+
+	    /* don't want negative weights */
+	    if( lam[j] < 0.0 ) { lam[j] = 0.0; }
+
+	    if( lam_delta < fabs(lam[j] - old_lam) ) {
+	      lam_delta = fabs(lam[j] - old_lam);
+	    }
+
+	  }
+	}
+      }
+
+
+      recompute_ed(learner, &logzon, &div, i, lam, Xi);
+
+      if( u_options & (1<<U_OPTION_VERBOSE) ) {
+	fprintf(stdout, "digramic (%d) entropy change %" FMT_printf_score_t \
+		" --> %" FMT_printf_score_t " (%10f, %10f)\n", i,
+		old_div, div, lam_delta, fabs(logzon - old_logzon));
+      }
+
+    
+    } while( ((fabs(div - old_div) > 0.001) || (lam_delta > 0.001) ||
+	      (fabs(logzon - old_logzon) > 0.001)) && (itcount < 500) );
+
+
+    /* now make the probabilities */
+
+    /* transitions should already sum to 1, but better safe than sorry */
+    maxlogt = log(0.0);
+    for(j = AMIN; j < ASIZE; j++) {
+      if( maxlogt < lam[j] ) {
+	maxlogt = lam[j];
+      }
+    }
+    maxlogt += -logA -logzon;
+    logt = 0.0;
+    for(j = AMIN; j < ASIZE; j++) {
+      logt += exp(lam[j] - logA - logzon - maxlogt);
+    }
+    logt = maxlogt + log(logt);
+
+    for(j = AMIN; j < ASIZE; j++) {
+      /* note: simulate the effect of digitizing the digrams */
+      learner->dig[i][j] = 
+	UNPACK_DIGRAMS(PACK_DIGRAMS(lam[j] - logA - logzon - logt));
+
+      if(0 && u_options & (1<<U_OPTION_DEBUG) ) {
+	fprintf(stdout,
+		"learner->dig[%d][%d] = %f\n", 
+		i, j, learner->dig[i][j]);
+      }
+    }
+  }
+
+  /* clear other data */
+  for(i = 0; i < AMIN; i++) {
+    for(j = 0; j < ASIZE; j++) {
+      learner->dig[i][j] = 0.0;
+    }
+  }
+}
+
+
+void interpolate_digrams(weight_t N, weight_t count[], weight_t p[]) {
+  weight_t lambda = 0.5;
+  weight_t Clam, Dlam, Zlam;
+  alphabet_size_t i;
+  int q = 0;
+
+  for(q = 0; q < 100; q++) {
+    Zlam = Dlam = Clam = 0.0;
+    for(i = AMIN; i < ASIZE; i++) {
+      Clam += log(p[i]) * (count[i]/N);
+      Zlam += pow(p[i], lambda);
+      Dlam += log(p[i]) * pow(p[i], lambda);
+    }
+    lambda += 0.1 * (Clam - Dlam/Zlam);
+/*     if( lambda > 1.0 ) { lambda = 1.0; } */
+/*     else if( lambda < 0.0 ) { lambda = 0.0; } */
+/*     printf("Clam = %g Dlam = %g, Zlam = %g, lamdba = %g\n", Clam, Dlam, Zlam, lambda); */
+  } 
+
+}
+
+
+weight_t calc_learner_digramic_excursion(learner_t *learner, char *tok) {
+  register alphabet_size_t p, q;
+  register weight_t t = 0.0;
+  register alphabet_size_t len;
+  /* now update digram frequency counts */
+  p = (unsigned char)*tok++;
+  CLIP_ALPHABET(p);
+  len = 1;
+  /* finally update character frequencies */
+  while( *tok != EOTOKEN ) {
+    q = (unsigned char)*tok;
+    CLIP_ALPHABET(q);
+    t += learner->dig[p][q];
+    p = q;
+    tok++;
+    if( q != DIAMOND ) { len++; }
+  }
+  t += learner->dig[RESERVED_TOKLEN][len] - learner->dig[RESERVED_TOKLEN][0];
+  return t;
+}
+
+/* with -J, the sweeps over the features while maximizing the entropy
+   are shared between threads. The features of the order being
+   optimized are cut into fixed size blocks, thread t takes the blocks
+   t, t + jobs, t + 2*jobs, ... and the partial results are added up
+   block by block in forward (or reverse) order, so the weights don't
+   depend on the number of threads. */
+#define SWEEP_BLOCK 16384
+
+typedef enum { sweep_maxlogz, sweep_logz, sweep_div, sweep_lambda, 
+	       sweep_shift } sweep_op_t;
+
+typedef struct {
+  learner_t *learner;
+  sweep_op_t op;
+  token_order_t r;
+  bool_t fwd;
+  score_t x; /* log unchanging part, maxlogz or logzonr */
+  score_t logXi;
+  token_count_t zcut;
+  hash_count_t blocks;
+  score_t *sum; /* one per block */
+  score_t *max; /* one per block */
+} sweep_t;
+
+typedef struct {
+  sweep_t *s;
+  int t;
+} sweep_worker_t;
+
+static void sweep_block(sweep_t *s, hash_count_t b) {
+  l_features_t *f = &s->learner->feat;
+  hash_count_t k, lo, hi;
+  score_t R = (score_t)s->r;
+  score_t tmp, new_lam;
+  score_t sum = 0.0;
+  score_t max = (s->op == sweep_maxlogz) ? s->x : 0.0;
+
+  lo = f->start[s->r] + b * SWEEP_BLOCK;
+  hi = (b + 1 < s->blocks) ? lo + SWEEP_BLOCK : f->start[s->r + 1];
+
+  switch(s->op) {
+  case sweep_maxlogz:
+    for(k = lo; k < hi; k++) {
+      tmp = R * f->lam[k] + R * f->ltrms[k] + f->dref[k];
+      if( max < tmp ) {
+	max = tmp;
+      }
+    }
+    break;
+  case sweep_logz:
+    for(k = s->fwd ? lo : hi - 1; s->fwd ? (k < hi) : (k + 1 > lo); 
+	s->fwd ? k++ : k--) {
+      tmp = R * f->ltrms[k] + f->dref[k] - s->x;
+      sum += (exp(R * f->lam[k] + tmp) - exp(tmp)); 
+    }
+    break;
+  case sweep_div:
+    for(k = s->fwd ? lo : hi - 1; s->fwd ? (k < hi) : (k + 1 > lo); 
+	s->fwd ? k++ : k--) {
+      sum += f->lam[k] * (score_t)f->count[k];
+    }
+    break;
+  case sweep_lambda:
+  case sweep_shift:
+    /* same update as in minimize_learner_divergence(), except
+       that a NaN leaves lambda alone without recomputing logZ.
+       sweep_shift doesn't limit the jumps, see
+       minimize_secant_divergence() */
+    for(k = lo; k < hi; k++) {
+      if( f->count[k] > s->zcut ) {
+	new_lam = (log((score_t)f->count[k]) - s->logXi - f->dref[k])/R + 
+	  s->x - f->ltrms[k];
+      } else {
+	new_lam = 0.0;
+      }
+      if( !isnan(new_lam) ) {
+	if( s->op == sweep_lambda ) {
+	  if( new_lam > (f->lam[k] + MAX_LAMBDA_JUMP) ) {
+	    new_lam = (f->lam[k] + MAX_LAMBDA_JUMP);
+	  } else if( new_lam < (f->lam[k] - MAX_LAMBDA_JUMP) ) {
+	    new_lam = (f->lam[k] - MAX_LAMBDA_JUMP);
+	  }
+	}
+	if( new_lam < 0.0 ) { new_lam = 0.0; }
+	if( max < fabs(new_lam - f->lam[k]) ) {
+	  max = fabs(new_lam - f->lam[k]);
+	}
+	f->lam[k] = UNPACK_LAMBDA(PACK_LAMBDA(new_lam));
+      }
+    }
+    break;
+  }
+
+  s->sum[b] = sum;
+  s->max[b] = max;
+}
+
+static void *sweep_worker(void *arg) {
+  sweep_worker_t *w = (sweep_worker_t *)arg;
+  hash_count_t b;
+
+  for(b = w->t; b < w->s->blocks; b += learner_threads) {
+    sweep_block(w->s, b);
+  }
+  return NULL;
+}
+
+/* runs one sweep, then returns the ordered sum of the blocks and 
+   leaves the largest block maximum in *pmax */
+static score_t run_sweep(learner_t *learner, sweep_op_t op, token_order_t r,
+			 bool_t fwd, score_t x, token_count_t zcut, 
+			 score_t *pmax) {
+  sweep_t s;
+  sweep_worker_t *w;
+  hash_count_t b;
+  score_t t = 0.0;
+  int j;
+#if defined HAVE_LIBPTHREAD
+  pthread_t *tid;
+  bool_t *live;
+#endif
+
+  s.learner = learner;
+  s.op = op;
+  s.r = r;
+  s.fwd = fwd;
+  s.x = x;
+  s.logXi = log((score_t)learner->fixed_order_token_count[r]);
+  s.zcut = zcut;
+  s.blocks = (learner->feat.start[r + 1] - learner->feat.start[r] + 
+	      SWEEP_BLOCK - 1) / SWEEP_BLOCK;
+  s.sum = (score_t *)malloc((s.blocks + 1) * sizeof(score_t));
+  s.max = (score_t *)malloc((s.blocks + 1) * sizeof(score_t));
+  w = (sweep_worker_t *)malloc(learner_threads * sizeof(sweep_worker_t));
+  if( !s.sum || !s.max || !w ) {
+    errormsg(E_FATAL, "not enough memory for %d threads\n", learner_threads);
+  }
+  for(j = 0; j < learner_threads; j++) {
+    w[j].s = &s;
+    w[j].t = j;
+  }
+
+#if defined HAVE_LIBPTHREAD
+  tid = (pthread_t *)malloc(learner_threads * sizeof(pthread_t));
+  live = (bool_t *)calloc(learner_threads, sizeof(bool_t));
+  if( !tid || !live ) {
+    errormsg(E_FATAL, "not enough memory for %d threads\n", learner_threads);
+  }
+  for(j = 1; j < learner_threads; j++) {
+    live[j] = (pthread_create(&tid[j], NULL, sweep_worker, &w[j]) == 0);
+  }
+  /* we do our own share, and any share a thread couldn't be started for */
+  for(j = 0; j < learner_threads; j++) {
+    if( !live[j] ) {
+      sweep_worker(&w[j]);
+    }
+  }
+  for(j = 1; j < learner_threads; j++) {
+    if( live[j] ) {
+      pthread_join(tid[j], NULL);
+    }
+  }
+  free(tid);
+  free(live);
+#else
+  for(j = 0; j < learner_threads; j++) {
+    sweep_worker(&w[j]);
+  }
+#endif
+
+  *pmax = (op == sweep_maxlogz) ? x : 0.0;
+  for(b = 0; b < s.blocks; b++) {
+    t += s.sum[fwd ? b : s.blocks - 1 - b];
+    if( *pmax < s.max[b] ) {
+      *pmax = s.max[b];
+    }
+  }
+
+  free(w);
+  free(s.sum);
+  free(s.max);
+  return t;
+}
+
+/* calculates the rth-order divergence but needs normalizing constant
+   note: this isn't the full divergence from digref, just the bits
+   needed for the r-th optimization - fwd indicates the traversal
+   direction in the hash (alternate between them to reduce numerical
+   errors */
+score_t learner_divergence(learner_t *learner, 
+			   score_t logzonr, score_t Xi,
+			   token_order_t r, bool_t fwd) {
+  l_features_t *f = &learner->feat;
+  register hash_count_t k, lo, hi;
+  score_t t = 0.0;
+  score_t max;
+
+  if( (learner_threads > 1) || qtol_secant ) {
+    t = run_sweep(learner, sweep_div, r, fwd, 0.0, 0, &max);
+    return -logzonr + t/Xi;
+  }
+
+  lo = f->start[r];
+  hi = f->start[r + 1];
+  for(k = fwd ? lo : hi - 1; fwd ? (k < hi) : (k + 1 > lo); fwd ? k++ : k--) {
+    t += f->lam[k] * (score_t)f->count[k];
+  }
+
+  return -logzonr + t/Xi;
+}
+
+/* calculates the normalizing constant - fwd indicates the traversal
+   direction in the hash (alternate between them to reduce numerical
+   errors */
+score_t learner_logZ(learner_t *learner, token_order_t r, 
+		     score_t log_unchanging_part, bool_t fwd) {
+  l_features_t *f = &learner->feat;
+  register hash_count_t k, lo, hi;
+
+  score_t maxlogz, tmp;
+  score_t t =0.0;
+  score_t R = (score_t)r;
+
+/*   printf("learner_logZ(%d, %f)\n", r, log_unchanging_part); */
+
+  /* -E secant divides differences of logZ, so it always sums the
+     blocks in the same order, whatever the number of threads */
+  if( (learner_threads > 1) || qtol_secant ) {
+    run_sweep(learner, sweep_maxlogz, r, fwd, log_unchanging_part, 0, &maxlogz);
+    t = exp(log_unchanging_part - maxlogz) + 
+      run_sweep(learner, sweep_logz, r, fwd, maxlogz, 0, &tmp);
+    goto done;
+  }
+
+  lo = f->start[r];
+  hi = f->start[r + 1];
+
+  maxlogz = log_unchanging_part;
+  for(k = lo; k < hi; k++) {
+    tmp = R * f->lam[k] + R * f->ltrms[k] + f->dref[k];
+    if( maxlogz < tmp ) {
+      maxlogz = tmp;
+    }
+  }
+
+  t =  exp(log_unchanging_part - maxlogz);
+  for(k = fwd ? lo : hi - 1; fwd ? (k < hi) : (k + 1 > lo); fwd ? k++ : k--) {
+    tmp = R * f->ltrms[k] + f->dref[k] - maxlogz;
+    t += (exp(R * f->lam[k] + tmp) - exp(tmp)); 
+  }
+
+ done:
+  tmp =  (maxlogz + log(t))/R;
+/*   printf("t =%f maxlogz = %f logZ/R = %f\n", t, maxlogz, tmp); */
+
+  /* investigate this someday */
+  if( isnan(tmp) ) {
+    errormsg(E_FATAL,"sorry, partition function went kaboom.\n");
+  }
+
+  return tmp;
+}
+
+/* reconstructs the order of a token (can be zero for empty token) */
+token_order_t get_token_order(char *tok) {
+  token_order_t o = 0;
+  if( tok && *tok ) { 
+    while( *(++tok) ) {
+      if( *tok == DIAMOND ) {
+	o++;
+      }
+    }
+  }
+  return o;
+}
+
+
+/* fills the hash with partial calculations, returns true if the
+   weight of one of the suffixes is marked, see mark_learner_delta() */
+bool_t fill_ref_vars(learner_t *learner, l_item_t *k, char *tok) {
+  hash_value_t id;
+  char *t, *e;
+  l_item_t *l;
+  bool_t marked = 0;
+
+  /* weight of the r-th order excursion */
+  k->tmp.min.dref = PACK_RWEIGHTS(calc_learner_digramic_excursion(learner,tok));
+
+  /* for each suffix of tok, add its weight */
+  k->tmp.min.ltrms = PACK_LWEIGHTS(0.0);
+
+  if( tok && *tok ) {
+    e = strchr(tok + 1, EOTOKEN);
+    for( t = tok + 1; t + 1 < e; t++ ) {
+      if( *t == DIAMOND ) {
+	id = hash_partial_token(t, e - t, e);
+	l = find_in_learner(learner, id); 
+	/* a suffix is always of lower order, anything else is a
+	   different feature whose id collides */
+	if( l && (l->typ.order < k->typ.order) ) {
+	  k->tmp.min.ltrms += PACK_LWEIGHTS(UNPACK_LAMBDA(l->lam));
+	  if( MARKEDP(l) ) {
+	    marked = 1;
+	  }
+	}
+      }
+    }
+
+    /* extra smoothing doesn't seem that good */
+#undef EXTRA_SMOOTHING
+#if defined EXTRA_SMOOTHING
+    /* rather than adding only suffixes, this adds all 
+     * the prefixes also, then divides by two. */
+    if( e ) {
+      /* for each prefix of tok, add its weight */
+      for(t = e - 2; t > tok; t--) {
+	if( *t == DIAMOND ) {
+	  id = hash_partial_token(tok, t - tok + 1, e);
+	  l = find_in_learner(id);
+	  if( l ) {
+	    k->ltrms += PACK_LWEIGHTS(UNPACK_LAMBDA(l->lam));
+	  }
+	}
+      }
+      /* now we have twice as many weights as we need */
+      k->ltrms /= 2;
+    }  
+#endif
+  }
+
+  return marked;
+}
+
+/* with -I, a feature whose suffixes' weights are reoptimized is
+   reoptimized as well, while the budget allows */
+static void mark_delta_neighbour(learner_t *learner, l_item_t *k) {
+  if( learner->delta.id && !MARKEDP(k) &&
+      (learner->delta.active < learner->unique_token_count/DELTA_FRACTION) ) {
+    SETMARK(k);
+    learner->delta.active++;
+  }
+}
+
+/* fills hash with partial calculations and returns the
+ * log unchanging part of the normalizing constant, for all
+ * orders < r (not r). On return, kappa contains the reference probability
+ * mass of the set of all features <= r (including r).
+ */
+score_t recalculate_reference_measure(learner_t *learner, token_order_t r, score_t *kappa) {
+  hash_value_t id;
+  byte_t buf[BUFSIZ+1];
+  char tok[(MAX_TOKEN_LEN+1)*MAX_SUBMATCH+EXTRA_TOKEN_LEN];
+  size_t n = 0;
+
+  const byte_t *p, *base;
+  char *q;
+
+  l_item_t *k;
+  l_features_t *f = &learner->feat;
+  hash_count_t j;
+
+  score_t tmp, lunch;
+  score_t R = (score_t)r;
+  score_t max = 0.0;
+  score_t mykappa = 0.0;
+
+  /* for r == 1, the partial_z is not modified, but
+     we still have to go through the tokens and prebuild k-dref */
+
+  /* now we calculate the logarithmic word weight
+     from the digram model, for each token in the hash */
+  base = tmp_get_base(learner);
+  if( f->tok && base ) {
+    /* all features of order <= r, with their token strings
+       already located by index_learner_tokens() */
+    for(j = 0; j < f->start[r+1]; j++) {
+      if( f->tok[j] < 0 ) {
+	continue;
+      }
+      k = f->item[j];
+      if( k->typ.order == r ) {
+	for(p = base + f->tok[j], q = tok; *p != TOKENSEP; p++) {
+	  *q++ = *p;
+	}
+	*q = 0;
+	if( fill_ref_vars(learner, k, tok) ) {
+	  mark_delta_neighbour(learner, k);
+	}
+      } else if( NOTNULL(k->lam) ) {
+	/* assume ref_vars were already filled */
+	tmp = R * UNPACK_LAMBDA(k->lam) + 
+	  R * UNPACK_LWEIGHTS(k->tmp.min.ltrms) +
+	  UNPACK_RWEIGHTS(k->tmp.min.dref);
+	if( max < tmp ) {
+	  max = tmp;
+	}
+      }
+      mykappa += exp(UNPACK_RWEIGHTS(k->tmp.min.dref));
+    }
+  } else if( !tmp_seek_start(learner) ) {
+    errormsg(E_ERROR, "cannot seek in temporary token file, reference weights not calculated.\n");
+  } else {
+    q = tok;
+    while( (n = tmp_read_block(learner, buf, BUFSIZ, &p)) > 0 ) {
+/*       p = buf; */
+/*       p[n] = '\0'; */
+      while( n-- > 0 ) {
+	if( *p != TOKENSEP) {
+	  *q++ = *p; /* copy into tok */
+	} else { /* interword space */ 
+	  *q = 0; /* append NUL to tok */
+	  /* now write weight in hash */
+	  id = hash_full_token(tok);
+	  k = find_in_learner(learner, id); 
+	  if( k && (get_token_order(tok) == k->typ.order) ) {
+	    if( k->typ.order <= r) {
+	      if( k->typ.order == r ) {
+		if( fill_ref_vars(learner, k, tok) ) {
+		  mark_delta_neighbour(learner, k);
+		}
+	      } else if(k->typ.order < r) {
+		/* assume ref_vars were already filled */
+		if( NOTNULL(k->lam) ) {
+		  tmp = R * UNPACK_LAMBDA(k->lam) + 
+		    R * UNPACK_LWEIGHTS(k->tmp.min.ltrms) +
+		    UNPACK_RWEIGHTS(k->tmp.min.dref);
+		  if( max < tmp ) {
+		    max = tmp;
+		  }
+		}
+	      }
+	      mykappa += exp(UNPACK_RWEIGHTS(k->tmp.min.dref));
+	    }
+	  }
+	  q = tok; /* reset q */
+	}
+	p++;
+      }
+    }
+  }
+
+  /* the lower orders are contiguous in learner->feat */
+  lunch = 1.0;
+  for(j = 0; j < f->start[r]; j++) {
+    if( NOTNULL(f->lam[j]) ) {
+      tmp = -max + R * f->ltrms[j] + f->dref[j];
+      lunch += (exp(R * f->lam[j] + tmp) - exp(tmp));
+    }
+  }
+  lunch = max + log(lunch);
+
+  /* kappa is the reference mass of all features <= rth order. */
+  *kappa = mykappa;
+
+  return lunch;
+}
+
+
+/* just for debugging */
+void print_score(learner_t *learner, token_order_t r) {
+  hash_count_t i;
+  double logprob = 0.0;
+  double lpapprox = 0.0;
+
+  for(i = 0; i < learner->max_tokens; i++) {
+    if( FILLEDP(&learner->hash[i]) &&
+	(learner->hash[i].typ.order <= r) ) {
+      logprob += learner->hash[i].count * (learner->hash[i].lam);
+      if( learner->hash[i].typ.order == 1 ) {
+	logprob += learner->hash[i].count * 
+	  UNPACK_RWEIGHTS(learner->hash[i].tmp.min.dref)/((weight_t)r);
+      }
+    }
+    if( FILLEDP(&learner->hash[i]) &&
+	(learner->hash[i].typ.order == r) ) {
+      lpapprox += learner->hash[i].count * 
+	((learner->hash[i].lam) + 
+	 UNPACK_LWEIGHTS(learner->hash[i].tmp.min.ltrms) + 
+	 UNPACK_RWEIGHTS(learner->hash[i].tmp.min.dref)/((weight_t)r));
+    }
+
+  }
+
+  fprintf(stdout,
+	  "*** logprob = %" FMT_printf_score_t " * %d (r = %" FMT_printf_integer_t ", logZ = %" FMT_printf_score_t ")\n", 
+	 ((score_t)(logprob / learner->fixed_order_token_count[r])), 
+	 learner->fixed_order_token_count[r], 
+	 r, learner->logZ);
+  fprintf(stdout,
+	  "*** lpapprox = %" FMT_printf_score_t " * %ld (r = %d, logZ = %" FMT_printf_score_t ")\n", 
+	 ((score_t)(lpapprox / learner->fixed_order_token_count[r])), 
+	 learner->fixed_order_token_count[r], 
+	 r, learner->logZ);
+}
+
+
+/* experimental: this sounded like a good idea, but isn't ?? */
+void theta_rescale(learner_t *learner, token_order_t r, score_t logupz, score_t Xi, bool_t fwd) {
+  register l_item_t *i, *e;
+  register token_count_t c = 0;
+
+  score_t tmp;
+  score_t theta =0.0;
+  score_t R = (score_t)r;
+  score_t mu;
+  score_t sum1, sum2;
+  score_t msum1, msum2;
+  score_t s = 0;
+
+  e = fwd ? (learner->hash + learner->max_tokens) : learner->hash - 1;
+
+  msum1 = msum2 = log(0.0);
+  for(i = fwd ? learner->hash : learner->hash + learner->max_tokens - 1; 
+      i != e; fwd ? i++ : i--) {
+    if( FILLEDP(i) && (i->typ.order == r) ) {
+      if( NOTNULL(i->lam) ) {
+	s += i->count;
+	tmp = R * UNPACK_LWEIGHTS(i->tmp.min.ltrms) + 
+	  UNPACK_RWEIGHTS(i->tmp.min.dref);
+	if( tmp > msum1 ) {
+	  msum1 = tmp;
+	}
+	tmp += R * UNPACK_LAMBDA(i->lam);
+	if( tmp > msum2 ) {
+	  msum2 = tmp;
+	}
+      }
+      if( ++c >= learner->fixed_order_unique_token_count[r] ) {
+	c = 0;
+	break;
+      }
+    }
+  }  
+
+  mu = ((score_t)s)/Xi;
+  s = log(mu) - log(1 - mu) + logupz; 
+  if( s > msum1 ) {
+    msum1 = s;
+  }
+
+  sum1 = exp(s - msum1);
+  sum2 = 0.0;
+  for(i = fwd ? learner->hash : learner->hash + learner->max_tokens - 1; 
+      i != e; fwd ? i++ : i--) {
+    if( FILLEDP(i) && (i->typ.order == r) ) {
+      if( NOTNULL(i->lam) ) {
+	tmp = R * UNPACK_LWEIGHTS(i->tmp.min.ltrms) + 
+	  UNPACK_RWEIGHTS(i->tmp.min.dref);
+	sum1 += exp(tmp - msum1);
+	tmp += R * UNPACK_LAMBDA(i->lam);
+	sum2 += exp(tmp - msum2);
+      }
+      if( ++c >= learner->fixed_order_unique_token_count[r] ) {
+	c = 0;
+	break;
+      }
+    }
+  }
+
+  theta = ((msum1 + log(sum1)) - (msum2 + log(sum2)))/R;
+  if( isnan(theta) ) {
+    return; /* ignore */
+  }
+  if( u_options & (1<<U_OPTION_VERBOSE) ) {
+    fprintf(stdout, "theta = %f\n", theta);
+  }
+
+  for(i = fwd ? learner->hash : learner->hash + learner->max_tokens - 1; 
+      i != e; fwd ? i++ : i--) {
+    if( FILLEDP(i) && (i->typ.order == r) ) {
+      if( NOTNULL(i->lam) ) {
+	i->lam = PACK_LAMBDA(UNPACK_LAMBDA(i->lam) + theta);
+      }
+      if( ++c >= learner->fixed_order_unique_token_count[r] ) {
+	c = 0;
+	break;
+      }
+    }
+  }
+
+}
+
+/* the mediaprobs are the token probabilities for each token class.
+   (summing the mediaprobs) == 1. We put a uniform prior on the media. */
+void compute_mediaprobs(learner_t *learner) {
+  l_item_t *k, *i;
+  token_class_t j;
+  weight_t R, tmp;
+
+  R = (weight_t)learner->max_order;
+  for(j = 0; j < TOKEN_CLASS_MAX; j++) {
+    learner->mediaprobs[j] = 1.0/TOKEN_CLASS_MAX;
+  }
+
+  k = learner->hash + learner->max_tokens;
+  for(i = learner->hash; i != k; i++) {
+    if( FILLEDP(i) && NOTNULL(i->lam)) {
+      tmp = R * UNPACK_LWEIGHTS(i->tmp.min.ltrms) +
+	UNPACK_RWEIGHTS(i->tmp.min.dref);
+      learner->mediaprobs[i->typ.cls] +=
+	exp(R * UNPACK_LAMBDA(i->lam) + tmp) - exp(tmp);
+    }
+  }
+  
+  tmp = 0;
+  for(j = 0; j < TOKEN_CLASS_MAX; j++) {
+    learner->mediaprobs[j] *= exp(-learner->logZ); 
+    tmp += learner->mediaprobs[j];
+  }
+  /* should have tmp == 1.0 */
+}
+
+/* wall clock seconds, for the timings printed with -v */
+static double learner_clock() {
+#if defined HAVE_UNISTD_H
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (double)tv.tv_sec + (double)tv.tv_usec/1000000.0;
+#else
+  return (double)clock()/CLOCKS_PER_SEC;
+#endif
+}
+
+/* one line of -v output per iteration, t0 is when it started */
+static void print_entropy_change(score_t d, score_t dd, score_t lam_delta,
+				 score_t logz_delta, double t0) {
+  fprintf(stdout, "entropy change %" FMT_printf_score_t \
+	  " --> %" FMT_printf_score_t " (%10f, %10f) %.3fs\n", 
+	  d, dd, lam_delta, logz_delta, learner_clock() - t0);
+}
+
+/* with -I, marks the features counted since the online file was
+   loaded. Only these, and the features whose suffixes are among them
+   (see mark_delta_neighbour()), are reoptimized, the others keep the
+   weights preloaded from the old category. Returns 0 if no list was
+   kept or too many features changed, then all weights are optimized */
+static bool_t mark_learner_delta(learner_t *learner) {
+  hash_count_t j;
+  l_item_t *i;
+
+  if( !learner->delta.id ) {
+    return 0;
+  }
+
+  unmark_learner_items(learner);
+  learner->delta.active = 0;
+  for(j = 0; j < learner->delta.top; j++) {
+    i = find_in_learner(learner, learner->delta.id[j]);
+    if( i && FILLEDP(i) && !MARKEDP(i) ) {
+      SETMARK(i);
+      learner->delta.active++;
+    }
+  }
+
+  if( learner->delta.active > learner->unique_token_count/DELTA_FRACTION ) {
+    unmark_learner_items(learner);
+    free_learner_delta(learner);
+    return 0;
+  }
+  return 1;
+}
+
+/* the normalizing constant as in learner_logZ(), for the features
+   act[0..n-1] of order r, plus the share fixz * exp(fixmax) of all
+   the others */
+static score_t delta_logZ(learner_t *learner, token_order_t r,
+			  hash_count_t *act, hash_count_t n,
+			  score_t fixmax, score_t fixz) {
+  l_features_t *f = &learner->feat;
+  hash_count_t j, k;
+  score_t maxlogz, tmp, t;
+  score_t R = (score_t)r;
+
+  maxlogz = fixmax;
+  for(j = 0; j < n; j++) {
+    k = act[j];
+    tmp = R * f->lam[k] + R * f->ltrms[k] + f->dref[k];
+    if( maxlogz < tmp ) {
+      maxlogz = tmp;
+    }
+  }
+
+  t = fixz * exp(fixmax - maxlogz);
+  for(j = 0; j < n; j++) {
+    k = act[j];
+    tmp = R * f->ltrms[k] + f->dref[k] - maxlogz;
+    t += (exp(R * f->lam[k] + tmp) - exp(tmp)); 
+  }
+
+  tmp = (maxlogz + log(t))/R;
+  if( isnan(tmp) ) {
+    errormsg(E_FATAL,"sorry, partition function went kaboom.\n");
+  }
+  return tmp;
+}
+
+/* with -I, this replaces the iterations of minimize_learner_divergence()
+   for order r. The unmarked features' share of the normalizing
+   constant and of the divergence is summed once, and each iteration
+   only updates the marked features. Returns logZ/r, and leaves the
+   divergence in *pdd */
+static score_t minimize_delta_divergence(learner_t *learner, token_order_t r,
+					 score_t logupz, token_count_t zcut,
+					 score_t div_extra_bits, score_t *pdd) {
+  l_features_t *f = &learner->feat;
+  hash_count_t *act;
+  hash_count_t j, k, n;
+  int itcount;
+  score_t R = (score_t)r;
+  score_t Xi = (score_t)learner->fixed_order_token_count[r];
+  score_t logXi = log(Xi);
+  score_t fixmax, fixz, fixdiv, actdiv, tmp;
+  score_t d, dd, logzonr, old_logzonr, lam_delta, new_lam;
+  double t0;
+
+  n = 0;
+  for(k = f->start[r]; k < f->start[r + 1]; k++) {
+    if( MARKEDP(f->item[k]) ) {
+      n++;
+    }
+  }
+  act = (hash_count_t *)malloc((n + 1) * sizeof(hash_count_t));
+  if( !act ) {
+    errormsg(E_FATAL, "not enough memory for %ld features\n", (long)n);
+  }
+  n = 0;
+  for(k = f->start[r]; k < f->start[r + 1]; k++) {
+    if( MARKEDP(f->item[k]) ) {
+      act[n++] = k;
+    }
+  }
+
+  if( u_options & (1<<U_OPTION_VERBOSE) ) {
+    fprintf(stdout, "reoptimizing %ld of %ld weights\n", 
+	    (long)n, (long)(f->start[r + 1] - f->start[r]));
+  }
+
+  /* the fixed share, act[] is in increasing order */
+  fixmax = logupz;
+  for(j = 0, k = f->start[r]; k < f->start[r + 1]; k++) {
+    if( (j < n) && (act[j] == k) ) {
+      j++;
+    } else {
+      tmp = R * f->lam[k] + R * f->ltrms[k] + f->dref[k];
+      if( fixmax < tmp ) {
+	fixmax = tmp;
+      }
+    }
+  }
+  fixz = exp(logupz - fixmax);
+  fixdiv = 0.0;
+  for(j = 0, k = f->start[r]; k < f->start[r + 1]; k++) {
+    if( (j < n) && (act[j] == k) ) {
+      j++;
+    } else {
+      tmp = R * f->ltrms[k] + f->dref[k] - fixmax;
+      fixz += (exp(R * f->lam[k] + tmp) - exp(tmp)); 
+      fixdiv += f->lam[k] * (score_t)f->count[k];
+    }
+  }
+
+  logzonr = delta_logZ(learner, r, act, n, fixmax, fixz);
+  for(actdiv = 0.0, j = 0; j < n; j++) {
+    actdiv += f->lam[act[j]] * (score_t)f->count[act[j]];
+  }
+  dd = -logzonr + (fixdiv + actdiv)/Xi;
+
+  itcount = 0;
+  do {
+    itcount++;
+    t0 = learner_clock();
+
+    d = dd;
+    old_logzonr = logzonr;
+    lam_delta = 0.0;
+
+    /* same update as in minimize_learner_divergence() */
+    for(j = 0; j < n; j++) {
+      k = act[j];
+      if( f->count[k] > zcut ) {
+	new_lam = (log((score_t)f->count[k]) - logXi - f->dref[k])/R + 
+	  logzonr - f->ltrms[k];
+      } else {
+	new_lam = 0.0;
+      }
+      if( !isnan(new_lam) ) {
+	if( new_lam > (f->lam[k] + MAX_LAMBDA_JUMP) ) {
+	  new_lam = (f->lam[k] + MAX_LAMBDA_JUMP);
+	} else if( new_lam < (f->lam[k] - MAX_LAMBDA_JUMP) ) {
+	  new_lam = (f->lam[k] - MAX_LAMBDA_JUMP);
+	}
+	if( new_lam < 0.0 ) { new_lam = 0.0; }
+	if( lam_delta < fabs(new_lam - f->lam[k]) ) {
+	  lam_delta = fabs(new_lam - f->lam[k]);
+	}
+	f->lam[k] = UNPACK_LAMBDA(PACK_LAMBDA(new_lam));
+      }
+    }
+
+    logzonr = delta_logZ(learner, r, act, n, fixmax, fixz);
+    for(actdiv = 0.0, j = 0; j < n; j++) {
+      actdiv += f->lam[act[j]] * (score_t)f->count[act[j]];
+    }
+    dd = -logzonr + (fixdiv + actdiv)/Xi;
+
+    if( u_options & (1<<U_OPTION_VERBOSE) ) {
+      print_entropy_change(d + div_extra_bits, dd + div_extra_bits,
+			   lam_delta, fabs(logzonr - old_logzonr), t0);
+    }
+
+    process_pending_signal(NULL);
+
+  } while( ((fabs(d - dd) > qtol_div) || (lam_delta > qtol_lam) ||
+	    (fabs(logzonr - old_logzonr) > qtol_logz)) && (itcount < 50) );
+
+  free(act);
+  *pdd = dd;
+  return logzonr;
+}
+
+/* with -E secant, this replaces the iterations of
+   minimize_learner_divergence() for order r. Each lambda update there
+   only depends on the other lambdas through x = logZ/r, so the fixed
+   point is the root of h(x) = logZ(x)/r - x, where logZ(x) is computed
+   with every lambda set from x. Iterative scaling steps x to x + h(x),
+   which crawls when h is flat and stops at 50 iterations, while the
+   secant method takes a few steps for the same passes over the
+   features. The first step is a plain one, and once h changes sign
+   the root stays bracketed. Returns logZ/r, leaves the
+   divergence in *pdd and flips *pfwd like the iterations it replaces */
+static score_t minimize_secant_divergence(learner_t *learner, token_order_t r,
+					  score_t logupz, token_count_t zcut,
+					  score_t div_extra_bits, score_t *pdd,
+					  bool_t *pfwd) {
+  int itcount;
+  score_t Xi = (score_t)learner->fixed_order_token_count[r];
+  score_t x, xn, xp, h, hp, lo, hi;
+  int bracket = 0;
+  score_t d, dd, logzonr, old_logzonr, lam_delta;
+  double t0;
+
+  logzonr = learner_logZ(learner, r, logupz, *pfwd);
+  dd = learner_divergence(learner, logzonr, Xi, r, *pfwd);
+  *pfwd = 1 - *pfwd;
+
+  x = logzonr;
+  xp = hp = lo = hi = 0.0;
+  itcount = 0;
+  do {
+    itcount++;
+    t0 = learner_clock();
+
+    d = dd;
+    old_logzonr = logzonr;
+
+    run_sweep(learner, sweep_shift, r, *pfwd, x, zcut, &lam_delta);
+    logzonr = learner_logZ(learner, r, logupz, *pfwd);
+    dd = learner_divergence(learner, logzonr, Xi, r, *pfwd);
+    *pfwd = 1 - *pfwd;
+
+    h = logzonr - x;
+    if( h > 0.0 ) {
+      lo = x;
+      bracket |= 1;
+    } else {
+      hi = x;
+      bracket |= 2;
+    }
+    if( (itcount > 1) && (h != hp) ) {
+      xn = x - h * (x - xp)/(h - hp);
+    } else {
+      xn = logzonr;
+    }
+    if( isnan(xn) ) {
+      xn = logzonr;
+    }
+    /* h is noisy near the root, because the lambdas are rounded, so
+       once the root is bracketed we don't let the secant leave */
+    if( (bracket == 3) && !((xn > lo) && (xn < hi)) ) {
+      xn = (lo + hi)/2.0;
+    }
+    xp = x;
+    hp = h;
+    x = xn;
+
+    if( u_options & (1<<U_OPTION_VERBOSE) ) {
+      print_entropy_change(d + div_extra_bits, dd + div_extra_bits,
+			   lam_delta, fabs(logzonr - old_logzonr), t0);
+    }
+
+    process_pending_signal(NULL);
+
+  } while( ((fabs(d - dd) > qtol_div) || (lam_delta > qtol_lam) ||
+	    (fabs(logzonr - old_logzonr) > qtol_logz)) && (itcount < 50) );
+
+  *pdd = dd;
+  return logzonr;
+}
+
+/* minimizes the divergence by solving for lambda one 
+   component at a time.  */
+void minimize_learner_divergence(learner_t *learner) {
+  l_features_t *f = &learner->feat;
+  hash_count_t k;
+  token_order_t r;
+  token_count_t lzero;
+  token_count_t zcut = 0;
+  int itcount, mcount;
+  score_t d, dd, b;
+  score_t lam_delta, old_lam, new_lam;
+  score_t logzonr, old_logzonr;
+  score_t logupz, div_extra_bits, kappa;
+  score_t R, Xi, logXi;
+  score_t mp_logz;
+  bool_t fwd = 1;
+  bool_t delta;
+  double t0, t1;
+
+  if( u_options & (1<<U_OPTION_VERBOSE) ) {
+    fprintf(stdout, "now maximizing model entropy\n");
+  }
+
+  learner->logZ = 0.0;
+  learner->divergence = 0.0;
+  mp_logz = 0.0;
+
+  /* disable multipass if we only have one order to play with */
+  if( (m_options & (1<<M_OPTION_MULTINOMIAL)) || 
+      (learner->max_order == 1) ) {
+    qtol_multipass = 0;
+  }
+
+  if( learner->model.tmin != 0 ) {
+    /* ftreshold is unsigned */
+    if( learner->model.tmin > 0 ) { 
+      zcut = learner->model.tmin;
+    } else if (learner->model.tmin + learner->tmax > 0) {
+      zcut = learner->model.tmin + learner->tmax;
+    }
+  }
+
+  build_learner_features(learner);
+
+  delta = mark_learner_delta(learner);
+  if( delta ) {
+    qtol_multipass = 0;
+  } else if( (u_options & (1<<U_OPTION_INCREMENTAL)) &&
+	     (u_options & (1<<U_OPTION_VERBOSE)) ) {
+    fprintf(stdout, "cannot reoptimize incrementally, optimizing all weights\n");
+  }
+
+  for(mcount = 0; mcount < (qtol_multipass ? 50 : 1); mcount++) {
+    for(r = 1; 
+	r <= ((m_options & (1<<M_OPTION_MULTINOMIAL)) ? 1 : learner->max_order); 
+	r++) {
+
+      /* here we precalculate various bits and pieces
+	 which aren't going to change during this iteration */
+      logupz = recalculate_reference_measure(learner, r, &kappa);
+      gather_learner_features(learner, r);
+
+      R = (score_t)r;
+      Xi = (score_t)learner->fixed_order_token_count[r];
+      logXi = log(Xi);
+
+      if( r == 1 ) {
+/*       Xi /= kappa; */
+	div_extra_bits = 0.0;
+      } else {
+      /* calculate extra bits for divergence score display */
+	b = 0.0;
+
+	for(k = 0; k < f->start[r]; k++) {
+	  b += f->lam[k] * (score_t)f->count[k];
+	}
+	div_extra_bits = b/Xi;
+      }
+
+      if( m_options & (1<<M_OPTION_REFMODEL) ) {
+	break;
+      }
+
+      if( u_options & (1<<U_OPTION_VERBOSE) ) {
+	fprintf(stdout, 
+		"* optimizing order %" FMT_printf_integer_t " weights (%" FMT_printf_integer_t " tokens, %" FMT_printf_integer_t " unique, kappa = %f)\n", 
+		r, learner->fixed_order_token_count[r],
+		learner->fixed_order_unique_token_count[r], kappa);
+      }
+
+      t1 = learner_clock();
+      if( delta ) {
+	logzonr = minimize_delta_divergence(learner, r, logupz, zcut,
+					    div_extra_bits, &dd);
+	goto next_order;
+      } else if( qtol_secant ) {
+	logzonr = minimize_secant_divergence(learner, r, logupz, zcut,
+					     div_extra_bits, &dd, &fwd);
+	goto next_order;
+      }
+
+      logzonr = learner_logZ(learner, r, logupz, fwd);
+      dd = learner_divergence(learner, logzonr, Xi, r, fwd);
+      fwd = 1 - fwd;
+/*       printf("logzonr = %f dd = %f logupz = %f Xi = %f\n", logzonr, dd, logupz, Xi); */
+      itcount = 0;
+      do {
+	itcount++;
+	t0 = learner_clock();
+	lzero= 0;
+
+	d = dd;     /* save old divergence */
+	old_logzonr = logzonr;
+
+	lam_delta = 0.0;
+
+	if( learner_threads > 1 ) {
+	  /* the threads sweep all the lambdas against the same logZ */
+	  run_sweep(learner, sweep_lambda, r, fwd, logzonr, zcut, &lam_delta);
+	} else {
+	  for(k = f->start[r]; k < f->start[r + 1]; k++) {
+	    old_lam = f->lam[k];
+
+	    if( f->count[k] > zcut ) {
+	      /* "iterative scaling" lower bound */
+	      new_lam = (log((score_t)f->count[k]) - logXi - f->dref[k])/R + 
+		logzonr - f->ltrms[k];
+	    } else {
+	      new_lam = 0.0;
+	    }
+
+	    if( isnan(new_lam) ) {
+	      /* precision problem, just ignore, don't change lambda */
+	      logzonr = learner_logZ(learner, r, logupz, fwd);
+	    } else {
+	      
+	      /* this code shouldn't be necessary, but is crucial */
+	      if( new_lam > (old_lam + MAX_LAMBDA_JUMP) ) {
+		new_lam = (old_lam + MAX_LAMBDA_JUMP);
+	      } else if( new_lam < (old_lam - MAX_LAMBDA_JUMP) ) {
+		new_lam = (old_lam - MAX_LAMBDA_JUMP);
+	      }
+
+	      /* don't want negative weights */
+	      if( new_lam < 0.0 ) { new_lam = 0.0; lzero++; }
+
+	      if( lam_delta < fabs(new_lam - old_lam) ) {
+		lam_delta = fabs(new_lam - old_lam);
+	      }
+	      /* round the same way as the hash would */
+	      f->lam[k] = UNPACK_LAMBDA(PACK_LAMBDA(new_lam));
+	    }
+	  }
+	}
+
+/* 	theta_rescale(r, logupz, Xi, fwd); */
+
+	/* update values */
+	logzonr = learner_logZ(learner, r, logupz, fwd);
+	dd = learner_divergence(learner, logzonr, Xi, r, fwd);
+	fwd = 1 - fwd;
+
+	if( u_options & (1<<U_OPTION_VERBOSE) ) {
+/* 	fprintf(stdout, "lzero = %ld\n", lzero); */
+	  print_entropy_change(d + div_extra_bits, dd + div_extra_bits,
+			       lam_delta, fabs(logzonr - old_logzonr), t0);
+	}
+
+	process_pending_signal(NULL);
+      
+      } while( ((fabs(d - dd) > qtol_div) || (lam_delta > qtol_lam) ||
+		(fabs(logzonr - old_logzonr) > qtol_logz)) && (itcount < 50) );
+
+    next_order:
+      if( u_options & (1<<U_OPTION_VERBOSE) ) {
+	fprintf(stdout, "order %" FMT_printf_integer_t " optimized in %.3fs\n",
+		r, learner_clock() - t1);
+      }
+
+      /* the next order's reference measure needs these in the hash */
+      scatter_learner_lambdas(learner, r);
+
+      learner->logZ = logzonr;
+      learner->divergence = dd + div_extra_bits;
+    }
+    /* for multipass, we wait until logZ stabilizes */
+    if( fabs(1.0 - mp_logz/learner->logZ) < 0.01 ) {
+      break;
+    }
+    mp_logz = learner->logZ;
+  }
+
+  if( delta ) {
+    unmark_learner_items(learner);
+  }
+
+  /* compute the probability mass of each token class (medium) separately */
+  compute_mediaprobs(learner);
+}
+
+/* dumps readable model weights to the output */
+void dump_model(learner_t *learner, FILE *out, FILE *in) {
+
+  hash_value_t id;
+  byte_t buf[BUFSIZ+1];
+  char tok[(MAX_TOKEN_LEN+1)*MAX_SUBMATCH+EXTRA_TOKEN_LEN];
+  char smb[MAX_SUBMATCH+1];
+  token_order_t s;
+  regex_count_t c;
+  const byte_t *p;
+  char *q;
+  l_item_t *k;
+  size_t n = 0;
+
+  /* preamble - this is copied from save_learner */
+
+  fprintf(out, MAGIC1, learner->filename, 
+	  (m_options & (1<<M_OPTION_REFMODEL)) ? "(ref)" : "");
+  fprintf(out, MAGIC2_o, learner->divergence, learner->logZ, learner->max_order,
+	  (m_options & (1<<M_OPTION_MULTINOMIAL)) ? "multinomial" : "hierarchical" );
+  fprintf(out, MAGIC3, 
+	  (short int)learner->max_hash_bits, 
+	  (long int)learner->full_token_count, 
+	  (long int)learner->unique_token_count,
+	  (long int)learner->doc.count);
+
+  fprintf(out, MAGIC8_o, learner->shannon, learner->shannon2);
+
+  fprintf(out, MAGIC10_o, 
+	  learner->alpha, learner->beta,
+	  learner->mu, learner->s2);
+
+  write_mediaprobs(out, learner);
+
+  fprintf(out, MAGIC9, (long int)learner->model.tmin, (long int)learner->tmax);
+
+  /* print out any regexes we might need */
+  for(c = 0; c < regex_count; c++) {
+    /* write the bitmap */
+    for(q = smb, s = 1; s <= MAX_SUBMATCH; s++) {
+      if( re[c].submatches & (1<<s) ) {
+	*q++ = s + '0';
+      }
+    }
+    *q = '\0';
+
+    fprintf(out, MAGIC5_o, re[c].string, smb);
+  }
+
+  /* print options */
+  fprintf(out, MAGIC4_o, m_options, m_cp, m_dt,
+	  print_model_options(m_options, m_cp, (char*)buf));
+
+  fprintf(out, MAGIC6); 
+
+  fprintf(out, MAGIC_DUMP);
+
+
+  /* now go through hash printing values */
+  if( !tmp_seek_start(learner) ) {
+    errormsg(E_ERROR, "cannot seek in temporary token file.\n");
+  } else {
+    q = tok;
+    while( (n = tmp_read_block(learner, buf, BUFSIZ, &p)) > 0 ) {
+/*       p = buf; */
+/*       p[n] = '\0'; */
+      while( n-- > 0 ) {
+	if( *p != TOKENSEP) {
+	  *q++ = *p; /* copy into tok */
+	} else { /* interword space */ 
+	  *q = 0; /* append NUL to tok */
+	  /* now write weight in hash */
+	  id = hash_full_token(tok);
+	  k = find_in_learner(learner, id); /* guaranteed to be found */
+	  fprintf(out, MAGIC_DUMPTBL_o, 
+		  (weight_t)UNPACK_LAMBDA(k->lam), 
+		  UNPACK_RWEIGHTS(k->tmp.min.dref), k->count, 
+		  (long unsigned int)k->id);
+	  print_token(out, tok);
+	  fprintf(out, "\n");
+	  q = tok; /* reset q */
+	}
+	p++;
+      }
+    }
+  }
+}
+
+/* This is a quick hack to 
+   1) speed up the optimization and 
+   2) stabilise the estimated category model over a sequence of learning runs.
+
+   Normally, if the dataset is nearly the same, then the optimal lambda weights 
+   should be fairly similar (This is not strictly true if the digramic
+   measure varies too much).  
+
+   By reading the old category and presetting the lambdas from it, we typically
+   get close enough to the true weights that one or two optimization iterations
+   suffice. Moreover in that case, most weights should stay close to their
+   "previous" values in the category, so the user doesn't think it's weird.
+
+   A side effect is that there is entropy creep when relearing the same
+   dataset over and over. Unless there's a bug I haven't noticed, this occurs
+   because the entropy maximum we compute is affected by numerical precision
+   and feature ordering within the hash. Each time we relearn the same dataset,
+   we start off with a perturbation from the previous best weights, and obtain 
+   a small improvement.
+   
+   WARNING: THIS USES cat[0], SO IS NOT COMPATIBLE WITH CLASSIFYING.
+
+   Returns true if the weights were preloaded.
+ */
+bool_t learner_prefill_lambdas(learner_t *learner, category_t **pxcat) {
+  hash_count_t c;
+  c_item_t *i, *e;
+  l_item_t *k;
+  category_t *xcat = &(cat[0]);
+  bool_t ok = 0;
+
+  *pxcat = NULL;
+  xcat->fullfilename = strdup(learner->filename);
+  if( open_category(cat) ) {
+    if( xcat->model.options & (1<<M_OPTION_WARNING_BAD) ) {
+      if( u_options & (1<<U_OPTION_VERBOSE) ) {
+	errormsg(E_WARNING, "old category file %s may have bad data\n",
+		xcat->fullfilename);
+      }
+    } else if( (xcat->model.options == m_options) &&
+	       (xcat->retype == learner->retype) &&
+	       (fabs((xcat->model_unique_token_count/
+		      (double)learner->unique_token_count) - 1.0) < 0.15) ) {
+      c = xcat->model_unique_token_count;
+      if( u_options & (1<<U_OPTION_VERBOSE) ) {
+	fprintf(stdout, "preloading %ld token weights\n", (long int)c);
+      }
+    
+      MADVISE(xcat->hash, sizeof(c_item_t) * xcat->max_tokens, MADV_SEQUENTIAL);
+
+      e = xcat->hash + xcat->max_tokens;
+      for(i = xcat->hash; i != e; i++) {
+	if( FILLEDP(i) ) {
+	  k = find_in_learner(learner, NTOH_ID(i->id));
+	  if( k ) {
+	    k->lam = NTOH_LAMBDA(i->lam);
+	  }
+	  if( --c <= 0 ) {
+	    break;
+	  }
+	}
+      }
+
+      /* tweak default quality settings */
+      if( !quality ) {
+	qtol_div = 0.01;
+	qtol_lam = CLIP_LAMBDA_TOL(0.01);
+	qtol_logz = 0.05;
+      }
+      ok = 1;
+
+    }
+    /* we're done, but don't close the category yet, as we might want to
+       overwrite it */
+    *pxcat = xcat;
+  } else {
+    if( u_options & (1<<U_OPTION_VERBOSE) ) {
+      errormsg(E_WARNING, "cannot open file for reading %s\n", 
+	      xcat->fullfilename);
+    }
+    free(xcat->fullfilename);
+  }
+  return ok;
+}
+
+
+void optimize_and_save(learner_t *learner) {
+
+  hash_count_t i;
+  token_order_t c;
+  token_count_t held;
+  category_t *opencat = NULL;
+
+  finish_learner_growth(learner);
+  held = learner->sketch.held;
+  free_learner_sketch(learner); /* counting is over */
+
+  if(100 * learner->unique_token_count >= HASH_FULL * learner->max_tokens) { 
+    errormsg(E_WARNING,
+	    "table full, some tokens ignored - "
+	    "try with option -h %i\n",
+	    learner->max_hash_bits + 1);
+  } else if( learner->unique_token_count <= 0 ) {
+    errormsg(E_WARNING,
+	    "no tokens matched - have I learned nothing?\n");
+    tmp_close(learner);
+    exit(0); /* exit code for success */
+  }
+
+  if( skewed_constraints_warning ) {
+    errormsg(E_WARNING,
+	    "ran out of integers (too much data) constraints will be skewed.\n");
+    m_options |= (1<<M_OPTION_WARNING_BAD);
+  }
+
+  if( u_options & (1<<U_OPTION_VERBOSE) ) {
+    fprintf(stdout, 
+	    "picked up %" FMT_printf_integer_t " (%" FMT_printf_integer_t " distinct) tokens\n", 
+	    learner->full_token_count, learner->unique_token_count);
+    if( zsketch > 1 ) {
+      fprintf(stdout, 
+	      "kept %" FMT_printf_integer_t " tokens seen fewer than %d times out of the hash\n",
+	      held, zsketch);
+    }
+    fprintf(stdout, 
+	    "calculating reference word weights\n");
+  }
+
+  if( *online ) {
+    write_online_learner_struct(learner, online);
+  }
+
+  /* transposition smoothing */
+/*   transpose_digrams(); */
+
+  if( *digtype && !strcmp(digtype, "uniform") ) {
+    make_uniform_digrams(learner);
+  } else if( *digtype && !strcmp(digtype, "dirichlet") ) {
+    make_dirichlet_digrams(learner);
+  } else if( *digtype && !strcmp(digtype, "maxent") ) {
+    make_entropic_digrams(learner);
+  } else if( *digtype && !strcmp(digtype, "toklen") ) {
+    make_toklen_digrams(learner);
+  } else if( *digtype && !strcmp(digtype, "mle") ) {
+    make_mle_digrams(learner);
+  } else if( *digtype && !strcmp(digtype, "iid") ) {
+    make_iid_digrams(learner);
+  } else {
+    make_uniform_digrams(learner);
+  }
+
+  if( learner->fixed_order_token_count[1] == 0 ) {
+    /* it's a higher order model but there are no first
+       order tokens! We can't handle that! Go through the 
+       hash converting everything to first order.
+       This will result in incorrect calculations, unless
+       the higher order tokens don't overlap. Suitable only for
+       geniuses and fools. */
+    errormsg(E_WARNING,
+	    "\n"
+	    "         You have not defined any unigrams, so in this model\n"
+	    "         features will be treated independently, which is quite\n"
+	    "         likely incorrect. I hope you know what you're doing,\n"
+	    "         because I don't!\n\n");
+
+    m_options |= (1<<M_OPTION_MULTINOMIAL);
+    for(c = 2; c <= learner->max_order; c++) {
+      learner->fixed_order_token_count[1] += learner->fixed_order_token_count[c];
+      learner->fixed_order_unique_token_count[1] += 
+	learner->fixed_order_unique_token_count[c];
+    }
+    for(i = 0; i < learner->max_tokens; i++) {
+      if( FILLEDP(&learner->hash[i]) ) {
+	learner->hash[i].typ.order = 1;
+      }
+    }
+
+  }
+
+
+  /* if the category already exists, we read its lambda values.
+     this should speed up the minimization slightly. With -I, only
+     the changed weights are then reoptimized */
+  if( !((u_options & (1<<U_OPTION_NOZEROLEARN)) &&
+	learner_prefill_lambdas(learner, &opencat)) ) {
+    free_learner_delta(learner);
+  }
+
+  minimize_learner_divergence(learner);
+
+  calc_shannon(learner);
+  free_learner_features(learner);
+
+  if( u_options & (1<<U_OPTION_DUMP) ) {
+    dump_model(learner, stdout, learner->tmp.file);
+  }
+
+  tmp_close(learner);
+  /* we don't free learner->tmpiobuf, as we'll be exiting soon anyway */
+#if defined HAVE_POSIX_MEMALIGN
+/*   if( learner->tmpiobuf ) { free(learner->tmpiobuf); } */
+#endif
+
+  /* now save the model to a file */
+  if( !opencat || !fast_partial_save_learner(learner, opencat) ) {
+    save_learner(learner, online);
+  }
+  if( opencat ) { free_category(opencat); }
+}
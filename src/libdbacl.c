@@ -0,0 +1,482 @@
+/* 
+ * Copyright (C) 2002 Laird Breyer
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA.
+ * 
+ * Author:   Laird Breyer <laird@lbreyer.com>
+ */
+
+/* 
+ * This file implements the public libdbacl interface (see libdbacl.h)
+ * on top of the same global state that the dbacl program uses.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+#include <setjmp.h>
+
+#if defined HAVE_UNISTD_H
+#include <unistd.h> 
+#include <sys/types.h>
+#endif
+
+#include "util.h"
+#include "libdbacl.h"
+#include "dbacl.h" /* make sure this is last */
+
+struct dbacl_handle {
+  learner_t learner;
+  bool_t learning;
+  bool_t failed; /* after a fatal error, see LIB_RECOVER() */
+};
+
+/* global variables */
+
+extern category_t cat[MAX_CAT];
+extern category_count_t cat_count;
+
+extern classifier_t classifier;
+
+extern options_t u_options;
+extern options_t m_options;
+extern charparser_t m_cp;
+extern char *extn;
+extern token_order_t ngram_order;
+
+extern MBOX_State mbox;
+extern XML_State xml;
+
+extern char *digtype;
+extern char *progname;
+extern char *inputfile;
+extern long inputline;
+
+extern long system_pagesize;
+
+extern jmp_buf *fatal_jump;
+
+/* there is only one set of globals, so only one handle */
+static dbacl_t *active = NULL;
+
+/* fatal errors (eg out of memory) make errormsg() jump back to the
+   public function which was called, instead of exiting the program
+   using the library. The work in progress is abandoned half done, so
+   the handle fails from then on, and can only be closed. Must be
+   used in the function body itself, and undone by LIB_DONE() before
+   it returns */
+#define LIB_RECOVER(d, recovery, failure)	\
+  if( setjmp(recovery) ) {			\
+    (d)->failed = 1;				\
+    return (failure);				\
+  }						\
+  fatal_jump = &(recovery)
+
+#define LIB_DONE() (fatal_jump = NULL)
+
+/***********************************************************
+ * CALLBACKS                                               *
+ ***********************************************************/
+
+static int lib_line_filter(MBOX_State *mbox, char *buf) {
+  int retval = mbox_line_filter(mbox, buf, &xml);
+  if( active->learning ) {
+    count_mbox_messages(&active->learner, mbox->state, buf);
+  }
+  return retval;
+}
+
+#if defined HAVE_MBRTOWC
+static int w_lib_line_filter(MBOX_State *mbox, wchar_t *buf) {
+  return w_mbox_line_filter(mbox, buf, &xml);
+}
+#endif
+
+static void lib_learner_word_fun(char *tok, token_type_t tt, regex_count_t re) {
+  hash_word_and_learn(&active->learner, tok, tt, re);
+}
+
+static void lib_learner_post_line_fun(char *buf) {
+  /* only call this when buf is NULL, ie end of file */
+  if( !buf && (m_options & (1<<M_OPTION_MBOX_FORMAT)) ) {
+    count_mbox_messages(&active->learner, mbox.state, buf);
+  }
+}
+
+/***********************************************************
+ * INTERNAL FUNCTIONS                                      *
+ ***********************************************************/
+
+/* this is the part of sanitize_options() in dbacl.c which still
+   applies when there are no command line switches */
+static void lib_sanitize_options() {
+  if( !(m_options & (1<<M_OPTION_TEXT_FORMAT)) &&
+      !(m_options & (1<<M_OPTION_MBOX_FORMAT)) &&
+      !(m_options & (1<<M_OPTION_HTML)) &&
+      !(m_options & (1<<M_OPTION_XML)) ) {
+    m_options |= (1<<M_OPTION_TEXT_FORMAT);
+  }
+  if( m_options & (1<<M_OPTION_MBOX_FORMAT) ) {
+    if( !(m_options & (1<<M_OPTION_XML)) ) {
+      m_options |= (1<<M_OPTION_HTML);
+    }
+    if( u_options & (1<<U_OPTION_LEARN) ) {
+      m_options |= (1<<M_OPTION_CALCENTROPY);
+    }
+  }
+  if( u_options & (1<<U_OPTION_LEARN) ) {
+    /* no regexes in the library */
+    m_options |= (1<<M_OPTION_USE_STDTOK);
+  }
+  if( m_cp == CP_DEFAULT ) {
+    if( m_options & (1<<M_OPTION_MBOX_FORMAT) ) {
+      m_cp = CP_ADP;
+    } else {
+      m_cp = CP_ALPHA;
+    }
+  }
+  if( !*digtype ) {
+    if( m_options & (1<<M_OPTION_MBOX_FORMAT) ) {
+      digtype = "uniform";
+    } else {
+      digtype = "dirichlet";
+    }
+  }
+}
+
+/* reads a whole document through the usual filters. The document
+   is either the input stream, or if that is NULL, the buffer. */
+static void lib_process(FILE *input, const char *buf, size_t len,
+			void (*word_fun)(char *, token_type_t, regex_count_t),
+			void (*post_line_fun)(char *)) {
+  int (*line_filter)(MBOX_State *, char *) = NULL;
+  void (*character_filter)(XML_State *, char *) = NULL; 
+#if defined HAVE_MBRTOWC
+  int (*w_line_filter)(MBOX_State *, wchar_t *) = NULL;
+  void (*w_character_filter)(XML_State *, wchar_t *) = NULL; 
+#endif
+
+  if( m_options & (1<<M_OPTION_MBOX_FORMAT) ) {
+    line_filter = lib_line_filter;
+#if defined HAVE_MBRTOWC
+    w_line_filter = w_lib_line_filter;
+#endif
+  }
+  if( (m_options & (1<<M_OPTION_XML)) ||
+      (m_options & (1<<M_OPTION_HTML)) ) {
+    character_filter = xml_character_filter;
+#if defined HAVE_MBRTOWC
+    w_character_filter = w_xml_character_filter;
+#endif
+  }
+
+  reset_xml_character_filter(&xml, xmlRESET);
+  if( m_options & (1<<M_OPTION_MBOX_FORMAT) ) {
+    reset_mbox_line_filter(&mbox);
+  }
+
+  if( !(m_options & (1<<M_OPTION_I18N)) ) {
+    if( input ) {
+      process_file(input, line_filter, character_filter,
+		   word_fun, NULL, post_line_fun);
+    } else {
+      process_buffer(buf, len, line_filter, character_filter,
+		     word_fun, NULL, post_line_fun);
+    }
+  } else {
+#if defined HAVE_MBRTOWC
+    if( input ) {
+      w_process_file(input, w_line_filter, w_character_filter,
+		     word_fun, NULL, post_line_fun);
+    } else {
+      w_process_buffer(buf, len, w_line_filter, w_character_filter,
+		       word_fun, NULL, post_line_fun);
+    }
+#else
+    errormsg(E_ERROR, "international support not available (recompile).\n");
+#endif
+  }
+}
+
+static int lib_classify(dbacl_t *d, FILE *input, 
+			const char *buf, size_t len, double *scores) {
+  cat_score_t *sc;
+  category_count_t i, map;
+  jmp_buf recovery;
+
+  LIB_RECOVER(d, recovery, -1);
+
+  if( !classifier.sc || (classifier.cat_count != cat_count) ) {
+    lib_sanitize_options();
+    free_classifier(&classifier);
+    if( !init_classifier(&classifier, cat, cat_count) ) {
+      LIB_DONE();
+      return -1;
+    }
+    /* a handle is meant to classify many documents */
+    index_classifier(&classifier);
+    fuse_classifier(&classifier);
+  }
+
+  lib_process(input, buf, len, score_word, NULL);
+
+  /* find MAP */
+  sc = classifier.sc;
+  map = 0;
+  for(i = 0; i < cat_count; i++) {
+    if( sc[map].score < sc[i].score ) {
+      map = i;
+    }
+    if( scores ) {
+      scores[i] = -nats2bits(sc[i].score);
+    }
+  }
+
+  /* clean up for next document */
+  reset_classifier_scores(&classifier);
+  if( m_options & (1<<M_OPTION_CALCENTROPY) ) {
+    clear_empirical(&classifier.empirical);
+  }
+  LIB_DONE();
+  return (int)map;
+}
+
+/***********************************************************
+ * PUBLIC FUNCTIONS                                        *
+ ***********************************************************/
+
+int dbacl_api_version(void) {
+  return LIBDBACL_API_VERSION;
+}
+
+dbacl_t *dbacl_open(void) {
+  dbacl_t *d;
+  jmp_buf recovery;
+
+  if( active ) {
+    return NULL;
+  }
+  d = (dbacl_t *)calloc(1, sizeof(dbacl_t));
+  if( !d ) {
+    return NULL;
+  }
+
+  if( !progname ) { progname = "libdbacl"; }
+  inputfile = "buffer";
+  inputline = 0;
+
+#if defined(HAVE_GETPAGESIZE)
+  system_pagesize = getpagesize();
+#endif
+  if( system_pagesize == -1 ) { system_pagesize = BUFSIZ; }
+
+  if( setjmp(recovery) ) {
+    cleanup_file_handling();
+    free(d);
+    return NULL;
+  }
+  fatal_jump = &recovery;
+  init_file_handling();
+  LIB_DONE();
+
+  active = d;
+  return d;
+}
+
+void dbacl_close(dbacl_t *d) {
+  category_count_t c;
+
+  if( !d || (d != active) ) {
+    return;
+  }
+
+  if( d->learning || d->failed ) {
+    tmp_close(&d->learner);
+    free_learner(&d->learner);
+    if( d->learner.filename ) { free(d->learner.filename); }
+  }
+
+  free_classifier(&classifier);
+  if( d->failed && (cat_count < MAX_CAT) ) {
+    /* a category which failed to load may be left in part */
+    free_category(&cat[cat_count]);
+    memset(&cat[cat_count], 0, sizeof(category_t));
+  }
+  for(c = 0; c < cat_count; c++) {
+    free_category(&cat[c]);
+  }
+  memset(cat, 0, cat_count * sizeof(category_t));
+  cat_count = 0;
+
+  cleanup_file_handling();
+
+  u_options = 0;
+  m_options = 0;
+  m_cp = CP_DEFAULT;
+  ngram_order = 1;
+  digtype = "";
+
+  free(d);
+  active = NULL;
+}
+
+int dbacl_set_format(dbacl_t *d, const char *format) {
+  options_t mask = 
+    (1<<M_OPTION_TEXT_FORMAT)|(1<<M_OPTION_MBOX_FORMAT)|
+    (1<<M_OPTION_HTML)|(1<<M_OPTION_XML);
+
+  if( !d || d->failed || !format || d->learning || (cat_count > 0) ) {
+    return -1;
+  }
+  if( !strcasecmp(format, "text") ) {
+    m_options = (m_options & ~mask) | (1<<M_OPTION_TEXT_FORMAT);
+  } else if( !strcasecmp(format, "email") ) {
+    m_options = (m_options & ~mask) | (1<<M_OPTION_MBOX_FORMAT);
+  } else if( !strcasecmp(format, "html") ) {
+    m_options = (m_options & ~mask) | (1<<M_OPTION_HTML);
+  } else if( !strcasecmp(format, "xml") ) {
+    m_options = (m_options & ~mask) | (1<<M_OPTION_XML);
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+int dbacl_load_category(dbacl_t *d, const char *name) {
+  category_t *c;
+  jmp_buf recovery;
+
+  if( !d || d->failed || d->learning || !name || !*name || 
+      (cat_count >= MAX_CAT) ) {
+    return -1;
+  }
+
+  LIB_RECOVER(d, recovery, -1);
+
+  c = &cat[cat_count];
+  c->fullfilename = sanitize_path((char *)name, extn);
+  if( !load_category(c) || 
+      !sanitize_model_options(&m_options, &m_cp, c) ) {
+    free_category(c);
+    memset(c, 0, sizeof(category_t));
+    LIB_DONE();
+    return -1;
+  }
+  LIB_DONE();
+  ngram_order = (ngram_order < c->max_order) ? c->max_order : ngram_order;
+  u_options |= (1<<U_OPTION_CLASSIFY);
+  return (int)cat_count++;
+}
+
+int dbacl_category_count(const dbacl_t *d) {
+  return d ? (int)cat_count : 0;
+}
+
+const char *dbacl_category_name(const dbacl_t *d, int index) {
+  if( !d || (index < 0) || (index >= (int)cat_count) ) {
+    return NULL;
+  }
+  return cat[index].filename;
+}
+
+int dbacl_classify_buffer(dbacl_t *d, const char *buf, size_t len, 
+			  double *scores) {
+  if( !d || d->failed || (cat_count == 0) || (!buf && len) ) {
+    return -1;
+  }
+  return lib_classify(d, NULL, buf, len, scores);
+}
+
+int dbacl_classify_fd(dbacl_t *d, int fd, double *scores) {
+  FILE *input;
+  int map, dupfd;
+
+  if( !d || d->failed || (cat_count == 0) ) {
+    return -1;
+  }
+  /* the caller keeps its descriptor */
+  dupfd = dup(fd);
+  if( dupfd == -1 ) {
+    return -1;
+  }
+  input = fdopen(dupfd, "rb");
+  if( !input ) {
+    close(dupfd);
+    return -1;
+  }
+  map = lib_classify(d, input, NULL, 0, scores);
+  fclose(input);
+  return map;
+}
+
+int dbacl_learn_buffer(dbacl_t *d, const char *name,
+		       const char *buf, size_t len) {
+  char *path;
+  bool_t same;
+  jmp_buf recovery;
+
+  if( !d || d->failed || !name || !*name || (cat_count > 0) || 
+      (!buf && len) ) {
+    return -1;
+  }
+
+  LIB_RECOVER(d, recovery, -1);
+
+  if( !d->learning ) {
+    u_options |= (1<<U_OPTION_LEARN);
+    lib_sanitize_options();
+    d->learner.filename = sanitize_path((char *)name, extn);
+    d->learner.retype = 0;
+    init_learner(&d->learner, "", 0);
+    d->learning = 1;
+  } else {
+    /* must be the same category, possibly found in $DBACL_PATH */
+    path = sanitize_path((char *)name, extn);
+    same = !strcmp(path, d->learner.filename);
+    free(path);
+    if( !same ) {
+      LIB_DONE();
+      return -1;
+    }
+  }
+
+  lib_process(NULL, buf, len, lib_learner_word_fun, lib_learner_post_line_fun);
+  LIB_DONE();
+  return 0;
+}
+
+int dbacl_save(dbacl_t *d) {
+  jmp_buf recovery;
+
+  if( !d || d->failed || !d->learning ) {
+    return -1;
+  }
+  /* optimize_and_save() exits when there is nothing to learn */
+  if( d->learner.unique_token_count <= 0 ) {
+    return -1;
+  }
+  LIB_RECOVER(d, recovery, -1);
+  optimize_and_save(&d->learner);
+  LIB_DONE();
+  free_learner(&d->learner);
+  free(d->learner.filename);
+  d->learner.filename = NULL;
+  d->learning = 0;
+  u_options &= ~(1<<U_OPTION_LEARN);
+  return 0;
+}
@@ -0,0 +1,119 @@
+/* 
+ * Copyright (C) 2002 Laird Breyer
+ *  
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA.
+ * 
+ * Author:   Laird Breyer <laird@lbreyer.com>
+ */
+#ifndef LIBDBACL_H
+#define LIBDBACL_H
+
+/* 
+ * libdbacl - the dbacl classifier and learner as a C library.
+ *
+ * This header is self contained and only uses standard C types, so
+ * that programs compiled against it don't depend on the internal
+ * layout of categories and learners (see dbacl.h), which changes
+ * from one release to the next. The handle is opaque, and the
+ * library version can be checked at run time.
+ *
+ * The library shares its state with the dbacl program, which is
+ * built on top of it, so there can only be ONE open handle per
+ * process at any time, and the functions must not be called from
+ * several threads at once. A handle either classifies with the
+ * categories loaded into it, or learns a single new category, but
+ * not both.
+ *
+ * Errors are reported on stderr, and the function returns -1 (NULL
+ * for dbacl_open()). Fatal errors, eg out of memory or a category
+ * which can't be used with those already loaded, leave the handle
+ * failed: every later call returns -1, and it can only be closed.
+ * A new handle can be opened afterwards.
+ *
+ * Besides the static libdbacl.a, the library is built as the shared
+ * object libdbacl.so.1, which only exports the functions below.
+ *
+ * A typical classification:
+ *
+ *   dbacl_t *d = dbacl_open();
+ *   dbacl_load_category(d, "spam");
+ *   dbacl_load_category(d, "notspam");
+ *   best = dbacl_classify_buffer(d, msg, msglen, scores);
+ *   dbacl_close(d);
+ *
+ * and learning:
+ *
+ *   dbacl_t *d = dbacl_open();
+ *   dbacl_set_format(d, "email");
+ *   dbacl_learn_buffer(d, "spam", msg1, msglen1);
+ *   dbacl_learn_buffer(d, "spam", msg2, msglen2);
+ *   dbacl_save(d);
+ *   dbacl_close(d);
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* bumped whenever a function is added; existing functions never
+   change their signature or meaning */
+#define LIBDBACL_API_VERSION 1
+
+typedef struct dbacl_handle dbacl_t;
+
+/* returns LIBDBACL_API_VERSION of the library actually linked */
+int dbacl_api_version(void);
+
+/* returns NULL if a handle is already open in this process */
+dbacl_t *dbacl_open(void);
+void dbacl_close(dbacl_t *d);
+
+/* document type, as for the -T switch: "text", "email", "html" or
+   "xml". Only used for learning, as loaded categories impose the
+   type they were learned with. Returns 0 on success, -1 otherwise. */
+int dbacl_set_format(dbacl_t *d, const char *format);
+
+/* loads a category file (searched in $DBACL_PATH like the -c switch).
+   Returns the index of the category, or -1 on failure. */
+int dbacl_load_category(dbacl_t *d, const char *name);
+int dbacl_category_count(const dbacl_t *d);
+const char *dbacl_category_name(const dbacl_t *d, int index);
+
+/* classifies a complete document. If scores is not NULL, it must hold
+   dbacl_category_count() entries, and receives the score of each
+   category in bits, as printed by dbacl -n (smaller is better).
+   Returns the index of the best category, or -1 on failure. The
+   buffer is read in place and never modified. */
+int dbacl_classify_buffer(dbacl_t *d, const char *buf, size_t len, 
+			  double *scores);
+/* same, but reads the document from fd until end of file. The
+   descriptor is not closed. */
+int dbacl_classify_fd(dbacl_t *d, int fd, double *scores);
+
+/* adds a document to the category being learned, which is named by
+   the first call. Returns 0 on success, -1 otherwise. */
+int dbacl_learn_buffer(dbacl_t *d, const char *name,
+		       const char *buf, size_t len);
+/* computes the model for all the documents learned so far and
+   writes the category file. Returns 0 on success, -1 otherwise. */
+int dbacl_save(dbacl_t *d);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -44,6 +44,8 @@ splint -f $SRCDIR/splintrc $SRCDIR/dbacl.c \
 && splint -f $SRCDIR/splintrc $SRCDIR/hmine.c \
 && splint -f $SRCDIR/splintrc $SRCDIR/hparse.c \
 && splint -f $SRCDIR/splintrc $SRCDIR/hypex.c \
+&& splint -f $SRCDIR/splintrc $SRCDIR/learner.c \
+&& splint -f $SRCDIR/splintrc $SRCDIR/libdbacl.c \
 && splint -f $SRCDIR/splintrc $SRCDIR/mailinspect.c \
 && splint -f $SRCDIR/splintrc -DMBW_WIDE $SRCDIR/mbw.c \
 && splint -f $SRCDIR/splintrc -DMBW_MB $SRCDIR/mbw.c \
@@ -84,7 +84,7 @@ extern myregex_t re[MAX_RE];
 extern regex_count_t regex_count;
 extern regex_count_t antiregex_count;
 
-extern empirical_t empirical;
+extern classifier_t classifier;
 
 /* regexes used for tagging */
 myregex_t tagre[MAX_RE];
@@ -213,18 +213,18 @@ void build_scores(weight_t *s) {
     (cat[0].model_full_token_count / cat[0].model_num_docs) : 100;
 
   if( m_options & (1<<M_OPTION_CALCENTROPY) ) {
-    cat[0].score_shannon = 
-      -( cat[0].score_shannon / ((score_t)cat[0].complexity) -
-	 log((score_t)cat[0].complexity) );
-    cat[0].score_div = 
-      -(cat[0].score/cat[0].complexity + cat[0].score_shannon);
+    classifier.sc[0].score_shannon = 
+      -( classifier.sc[0].score_shannon / ((score_t)classifier.sc[0].complexity) -
+	 log((score_t)classifier.sc[0].complexity) );
+    classifier.sc[0].score_div = 
+      -(classifier.sc[0].score/classifier.sc[0].complexity + classifier.sc[0].score_shannon);
   }
 
   /* various experimental scoring systems */
-  s[0] = -cat[0].score - log_poisson(cat[0].complexity, lambda); /* arbitrary */
-  s[1] = -cat[0].score / cat[0].complexity;
-  s[2] = cat[0].score_div;
-  s[3] = (weight_t)gamma_pvalue(&cat[0], cat[0].score_div)/10;
+  s[0] = -classifier.sc[0].score - log_poisson(classifier.sc[0].complexity, lambda); /* arbitrary */
+  s[1] = -classifier.sc[0].score / classifier.sc[0].complexity;
+  s[2] = classifier.sc[0].score_div;
+  s[3] = (weight_t)gamma_pvalue(&cat[0], classifier.sc[0].score_div)/10;
 }
 
 /* formats descriptions for email.index_format > 0 */
@@ -265,12 +265,10 @@ char *process_email_line(char *textbuf) {
       }
 
       /* reset calculations */
-      cat[0].score = 0.0;
-      cat[0].complexity = 0.0;
-      cat[0].fcomplexity = 0;
+      reset_classifier_scores(&classifier);
 
       if( m_options & (1<<M_OPTION_CALCENTROPY) ) {
-	clear_empirical(&empirical);
+	clear_empirical(&classifier.empirical);
       }
 
       /* now increment email number */
@@ -352,12 +350,10 @@ void process_last_email() {
     }
   }
 
-  cat[0].score = 0.0;
-  cat[0].complexity = 0;
-  cat[0].fcomplexity = 0;
+  reset_classifier_scores(&classifier);
   
   if( m_options & (1<<M_OPTION_CALCENTROPY) ) {
-    clear_empirical(&empirical);
+    clear_empirical(&classifier.empirical);
   }
 
 }
@@ -1432,10 +1428,8 @@ int main(int argc, char **argv) {
 
   /* setup */
 
-  if( m_options & (1<<M_OPTION_CALCENTROPY) ) {
-    init_empirical(&empirical, 
-		   default_max_tokens, 
-		   default_max_hash_bits); /* sets cached to zero */
+  if( !init_classifier(&classifier, cat, cat_count) ) {
+    exit(1);
   }
 
   init_file_handling();
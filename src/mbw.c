@@ -151,7 +151,7 @@ static const signed char b64_code_table[256] = {
   -1,-1,-1,-1,-1,-1
 };
 
-#define b64_code(c) ((int)b64_code_table[(int)c])
+#define b64_code(c) ((int)b64_code_table[(unsigned char)(c)])
 
 static const signed char qp_code_table[256] = {
   -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
@@ -172,7 +172,68 @@ static const signed char qp_code_table[256] = {
   -1,-1,-1,-1,-1,-1
 };
 
-#define qp_code(c) (qp_code_table[(int)c])
+#define qp_code(c) (qp_code_table[(unsigned char)(c)])
+
+/* the alpha, alnum, graph and char parsers don't look at neighbouring
+   characters, so good_char() only depends on the byte itself. For
+   these, the tokenizer uses two lookup tables instead, which fold
+   the case and classify all 256 bytes in advance. The tables depend
+   on the locale, m_cp and the -j switch, so they are rebuilt whenever
+   m_cp or -j differ from the last time. */
+typedef struct {
+  bool_t ready;
+  charparser_t cp;
+  options_t casen;
+  unsigned char lower[256];
+  unsigned char cls[256];
+} good_char_tables_t;
+
+static good_char_tables_t gctab;
+
+static const good_char_tables_t *good_char_tables() {
+  options_t casen = m_options & (1<<M_OPTION_CASEN);
+  int c, d;
+
+  if( (m_cp != CP_ALPHA) && (m_cp != CP_ALNUM) && 
+      (m_cp != CP_GRAPH) && (m_cp != CP_CHAR) ) {
+    return NULL;
+  }
+  if( !gctab.ready || (gctab.cp != m_cp) || (gctab.casen != casen) ) {
+    for(c = 0; c < 256; c++) {
+      d = casen ? c : (unsigned char)tolower(c);
+      gctab.lower[c] = (unsigned char)d;
+      switch(m_cp) {
+      case CP_ALPHA:
+	gctab.cls[c] = isalpha(d) ? gcTOKEN : gcDISCARD;
+	break;
+      case CP_ALNUM:
+	gctab.cls[c] = isalnum(d) ? gcTOKEN : gcDISCARD;
+	break;
+      case CP_GRAPH:
+	gctab.cls[c] = isgraph(d) ? gcTOKEN : gcDISCARD;
+	break;
+      default:
+	gctab.cls[c] = isgraph(d) ? gcTOKEN_END : gcDISCARD;
+	break;
+      }
+    }
+    /* an empty line */
+    gctab.lower[0] = '\0';
+    gctab.cls[0] = gcDISCARD;
+    gctab.cp = m_cp;
+    gctab.casen = casen;
+    gctab.ready = 1;
+  }
+  return &gctab;
+}
+
+/* same as good_char(), for the parsers above */
+static __inline__
+good_char_t table_good_char(const good_char_tables_t *t, char *c) {
+  unsigned char b = (unsigned char)*c;
+  *c = (char)t->lower[b];
+  return (good_char_t)t->cls[b];
+}
 
 #endif
 
@@ -453,19 +514,17 @@ bool_t mbw_prefix(flush_cache)(mbw_prefix(decoding_cache) *dc, mbw_t *line, bool
     }
 
     if( p > dc->cache ) {
-      for(q = dc->cache; q < p; q++) {
-	*line++ = *q;
-      }
-      *line = mbw_lit('\0');
+      mbw_memmove(line, dc->cache, p - dc->cache);
+      line[p - dc->cache] = mbw_lit('\0');
 
       dc->data_ptr = dc->cache;
       if( !all ) {
 	/* now fold unused part back into cache. Note that
 	 * b64_line_cache is always NUL terminated, so we don't
 	 * need b64_cache_ptr to mark the end. */
-	while( *p ) {
-	  *dc->data_ptr++ = *p++;
-	}
+	q = dc->cache + mbw_strlen(p);
+	mbw_memmove(dc->cache, p, q - dc->cache);
+	dc->data_ptr = q;
       }
       *dc->data_ptr = mbw_lit('\0');
       return 1;
@@ -497,9 +556,33 @@ mbw_t *mbw_prefix(b64_line_filter2)(mbw_t *line, mbw_t *q) {
   mbw_t buf[4];
   mbw_t *buf_start = buf;
   mbw_t *buf_end = buf + 4;
+  int a, b, c, d;
 
   if( q ) {
     while( *p ) {
+      if( buf_start == buf ) {
+	/* most of a well formed line is whole groups of four codes
+	   without padding, which we decode without the buffer. The
+	   codes are looked up in turn, so we never read past the NUL */
+	while( ((a = mbw_prefix(b64_code)(p[0])) > -1) && (a < 64) &&
+	       ((b = mbw_prefix(b64_code)(p[1])) > -1) && (b < 64) &&
+	       ((c = mbw_prefix(b64_code)(p[2])) > -1) && (c < 64) &&
+	       ((d = mbw_prefix(b64_code)(p[3])) > -1) && (d < 64) ) {
+	  *q = (a<<2) + (b>>4);
+	  if( !*q ) { *q = REPNUL; }
+	  q++;
+	  *q = (b<<4) + (c>>2);
+	  if( !*q ) { *q = REPNUL; }
+	  q++;
+	  *q = (c<<6) + d;
+	  if( !*q ) { *q = REPNUL; }
+	  q++;
+	  p += 4;
+	}
+	if( !*p ) { 
+	  break; 
+	}
+      }
       if( mbw_prefix(b64_code)(*p) > -1 ) {
 	*buf_start++ = *p;
 	if( buf_start == buf_end ) {
@@ -561,10 +644,15 @@ bool_t mbw_prefix(b64_line_filter)(mbw_prefix(decoding_cache) *b64cache,
  */
 mbw_t *mbw_prefix(qp_line_filter2)(mbw_t *line, mbw_t *q) {
   mbw_t *p = line;
+  size_t n;
   if( q ) {
     while( *p ) {
       if( *p != mbw_lit('=') ) {
-	*q++ = *p++;
+	/* copy the whole run up to the next escape at once */
+	n = mbw_strcspn(p, mbw_lit("="));
+	if( q != p ) { mbw_memmove(q, p, n); }
+	q += n;
+	p += n;
       } else {
 	if( !*(++p) || mbw_isspace(*p) ) { 
 	  break;
@@ -1566,6 +1654,10 @@ void mbw_prefix(std_tokenizer)(mbw_t *p, char **pq, char *hbuf,
   char *q;
   char *tstart, *qq, *cq;
   bool_t reset;
+  good_char_t g;
+#if defined MBW_MB
+  const good_char_tables_t *gct = good_char_tables();
+#endif
 
   if( p && (p[0] == mbw_lit('\0')) ) { 
     /* waste of time */
@@ -1588,7 +1680,12 @@ void mbw_prefix(std_tokenizer)(mbw_t *p, char **pq, char *hbuf,
 
   /* p[0] at least is nonzero */
   do {
-    switch( mbw_prefix(good_char)(p) ) {
+#if defined MBW_MB
+    g = (gct && p) ? table_good_char(gct, p) : good_char(p);
+#else
+    g = mbw_prefix(good_char)(p);
+#endif
+    switch( g ) {
     case gcIGNORE:
       /* pretend there is no character here */
       break;
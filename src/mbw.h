@@ -44,6 +44,8 @@
 #define mbw_strchr(x,y) wcschr(x,y)
 #define mbw_strncpy(x,y,z) wcsncpy(x,y,z)
 #define mbw_strlen(x) wcslen(x)
+#define mbw_strcspn(x,y) wcscspn(x,y)
+#define mbw_memmove(x,y,z) wmemmove(x,y,z)
 
 #if defined HAVE_MBRTOWC
 static mbstate_t copychar_shiftstate;
@@ -91,6 +93,8 @@ static charbuf_len_t copychar_len;
 #define mbw_strchr(x,y) strchr(x,y)
 #define mbw_strncpy(x,y,z) strncpy(x,y,z)
 #define mbw_strlen(x) strlen(x)
+#define mbw_strcspn(x,y) strcspn(x,y)
+#define mbw_memmove(x,y,z) memmove(x,y,z)
 #define mbw_copychar(x,y) { *(x)++ = (y); }
 
 #define mbw_regcomp(x,y,z) regcomp(x,y,z)
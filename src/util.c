@@ -27,6 +27,7 @@
 #endif
 
 #include <signal.h>
+#include <setjmp.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -58,6 +59,10 @@ extern void *out_iobuf;
 extern long system_pagesize;
 
 int sa_signal = 0;
+
+/* when set, fatal errors return there instead of exiting, so that a
+   program using libdbacl survives them, see exit_fatal() */
+jmp_buf *fatal_jump = NULL;
 signal_cleanup_t cleanup = { NULL };
 
 /***********************************************************
@@ -108,6 +113,59 @@ void cleanup_tempfiles() {
   }
 }
 
+/* the standard tmpfile() call doesn't tell the filename,
+   the standard mkstemp() is unreliable,
+   and the moronic unix system doesn't remember filenames on open().
+   1) remember to free the tmpname when done.
+   2) the tmplate is appended with a pattern .tmp.xx,
+   3) if you want a particular directory, prepend it to tmplate.
+   4) file is opened for read/write, but truncated to zero.
+   5) The limit of 100 tempfiles is hardcoded. If dbacl needs more than
+      that then it's either a bug with dbacl or something wrong on your FS.
+*/
+/*@null@*/ 
+FILE *mytmpfile(const char *tmplate, /*@out@*/ char **tmpname) {
+  FILE *result = NULL;
+  size_t l;
+  int i, fd;
+
+  l = strlen(tmplate);
+  *tmpname = (char *)malloc(sizeof(char)*(l + 8));
+  if( *tmpname ) {
+    strcpy(*tmpname, tmplate);
+#if defined ATOMIC_CATSAVE
+    for(i = 0; i < 100; i++) {
+      snprintf(*tmpname + l, 8, ".tmp.%d", i);
+      /* this may have problems on NFS systems? */
+      fd = ATOMIC_CREATE(*tmpname);
+      if( fd != -1 ) {
+	result = fdopen(fd, "w+b");
+	/* no need to close fd */
+	break;
+      }
+    }
+#else
+    snprintf(*tmpname + l, 8, ".tmp.%d", rand() % 100);
+    result = fopen(*tmpname, "w+b");
+#endif
+
+    if( !result ) {
+      free(*tmpname);
+      *tmpname = NULL;
+    }
+  }
+  return result;
+}
+
+bool_t myrename(const char *src, const char *dest) {
+#if defined ATOMIC_CATSAVE
+  /* the rename is atomic on posix */
+  return (bool_t)(rename(src, dest) == 0);
+#else
+  return (bool_t)1; /* just pretend */
+#endif
+}
+
 
 void set_iobuf_mode(FILE *input) {
   struct stat statinfo;
@@ -158,6 +216,68 @@ hash_value_t hash_partial_token(const char *tok, int len, const char *extra) {
   return (hash_value_t)hash((unsigned char *)extra, EXTRA_CLASS_LEN, h);
 }
 
+/***********************************************************
+ * HASH TABLE PROBING                                      *
+ ***********************************************************/
+
+/* nonzero iff some byte of x is zero */
+#define HCTRL_ONES ((u_int64_t)0x0101010101010101ULL)
+#define HCTRL_HASZERO(x) (((x) - HCTRL_ONES) & ~(x) & (HCTRL_ONES << 7))
+
+/* returns a zeroed control array for a hash of max_tokens slots */
+byte_t *new_hash_ctrl(hash_count_t max_tokens) {
+  return (byte_t *)calloc((size_t)max_tokens + HCTRL_GROUP, 1);
+}
+
+/* copies the control bytes of the first slots to their mirrors, after
+   ctrl[0] to ctrl[max_tokens - 1] were written directly */
+void mirror_hash_ctrl(byte_t *ctrl, hash_count_t max_tokens) {
+  size_t j;
+
+  for(j = (size_t)max_tokens; j < (size_t)max_tokens + HCTRL_GROUP; j++) {
+    ctrl[j] = ctrl[j % max_tokens];
+  }
+}
+
+/* finds id in a linearly probed hash of max_tokens items, each size
+   bytes long with the stored id (key, which may be in network byte
+   order) at offset idoff. Returns the slot holding the id, or else
+   the first empty slot met, exactly like a slot by slot probe would.
+   Returns max_tokens if the hash is full and id isn't in it.
+
+   Whole groups of slots with neither an empty slot nor a matching
+   tag are skipped with a few word operations, which is what keeps
+   long probe sequences in a nearly full hash cheap. */
+hash_count_t probe_hash_ctrl(const byte_t *ctrl, hash_count_t max_tokens,
+			     hash_value_t id, hash_value_t key,
+			     const byte_t *items, size_t size, size_t idoff) {
+  hash_count_t mask = max_tokens - 1;
+  hash_count_t n = id & mask;
+  size_t seen, k;
+  byte_t tag = HCTRL_TAG(id);
+  hash_value_t v;
+  u_int64_t w, t = HCTRL_ONES * tag;
+
+  for(seen = 0; seen < (size_t)max_tokens; seen += HCTRL_GROUP) {
+    memcpy(&w, ctrl + n, sizeof(w));
+    if( HCTRL_HASZERO(w) || HCTRL_HASZERO(w ^ t) ) {
+      for(k = 0; (k < HCTRL_GROUP) && (seen + k < (size_t)max_tokens); k++) {
+	if( ctrl[n + k] == 0 ) {
+	  return (n + k) & mask;
+	} else if( ctrl[n + k] == tag ) {
+	  /* items may be packed, so the id needn't be aligned */
+	  memcpy(&v, items + ((n + k) & mask) * size + idoff, sizeof(v));
+	  if( v == key ) {
+	    return (n + k) & mask;
+	  }
+	}
+      }
+    }
+    n = (n + HCTRL_GROUP) & mask;
+  }
+  return max_tokens;
+}
+
 /***********************************************************
  * WEIGHT SIZE REDUCTION                                   *
  ***********************************************************/
@@ -230,6 +350,10 @@ void init_signal_handling() {
   sigaction(SIGQUIT, &act, NULL);
   sigaction(SIGTERM, &act, NULL);
   sigaction(SIGPIPE, &act, NULL);
+
+  /* a reload request must not look like the end of the input to a
+     read in progress, e.g. while a -K server waits for a message */
+  act.sa_flags = SA_RESTART;
   sigaction(SIGUSR1, &act, NULL);
 
   act.sa_handler = sigsegv;
@@ -302,6 +426,18 @@ void process_pending_signal(FILE *input) {
 /***********************************************************
  * ERROR DISPLAY                                           *
  ***********************************************************/
+/* gives up after a fatal error, which was already reported */
+void exit_fatal() {
+  jmp_buf *jump = fatal_jump;
+
+  cleanup_tempfiles();
+  if( jump ) {
+    fatal_jump = NULL;
+    longjmp(*jump, 1);
+  }
+  exit(1);
+}
+
 void errormsg(int etype, const char *fmt, ...) {
   va_list vap;
 
@@ -325,8 +461,7 @@ void errormsg(int etype, const char *fmt, ...) {
 #endif
 
   if( etype == E_FATAL ) { 
-    cleanup_tempfiles();
-    exit(1);
+    exit_fatal();
   }
 }
 
@@ -357,6 +492,23 @@ void print_token(FILE *out, const char *tok) {
   }
 }
 
+/* in server mode, a message ends with a line containing a single dot,
+ * and any other line starting with a dot has one dot removed (this is
+ * the same dot-stuffing convention as for SMTP). Returns true if the
+ * line in textbuf marks the end of the current message.
+ */
+bool_t unstuff_textbuf() {
+  if( textbuf[0] == '.' ) {
+    if( !textbuf[1] ||
+	((textbuf[1] == '\n') && !textbuf[2]) ||
+	((textbuf[1] == '\r') && (textbuf[2] == '\n') && !textbuf[3]) ) {
+      return 1;
+    }
+    memmove(textbuf, textbuf + 1, strlen(textbuf));
+  }
+  return 0;
+}
+
 /* even after the EOF is reached, this pretends there are
  * a few more blank lines, to allow filters to process
  * cached input.
@@ -364,8 +516,9 @@ void print_token(FILE *out, const char *tok) {
 bool_t fill_textbuf(FILE *input, int *extra_lines) {
   char *s;
   charbuf_len_t l, k;
-  
-  if( !(cmd & (1<<CMD_QUITNOW)) && !feof(input) ) {
+
+  if( !(cmd & (1<<CMD_QUITNOW)) &&
+      !(cmd & (1<<CMD_END_OF_MESSAGE)) && !feof(input) ) {
     process_pending_signal(input);
 
     /* read in a full line, allocating memory as necessary */
@@ -379,8 +532,7 @@ bool_t fill_textbuf(FILE *input, int *extra_lines) {
 	fprintf(stderr, 
 		"error: not enough memory for input line (%d bytes)\n",
 		textbuf_len);
-	cleanup_tempfiles();
-	exit(1);
+	exit_fatal();
       }
 
       s = textbuf + textbuf_len - (k++);
@@ -390,6 +542,55 @@ bool_t fill_textbuf(FILE *input, int *extra_lines) {
       MADVISE(textbuf, sizeof(char) * textbuf_len, MADV_SEQUENTIAL);
 
     }
+
+    if( (u_options & (1<<U_OPTION_SERVER)) && unstuff_textbuf() ) {
+      /* behave as if we just hit EOF */
+      textbuf[0] = '\0';
+      cmd |= (1<<CMD_END_OF_MESSAGE);
+    }
+    return 1;
+  } else if( *extra_lines > 0 ) {
+    strcpy(textbuf, "\r\n");
+    *extra_lines = (*extra_lines) - 1;
+    return 1;
+  }
+  return 0;
+}
+
+/* same as fill_textbuf(), but reads the next line out of the memory
+ * between *pbuf and end, and advances *pbuf. There is no stdio
+ * buffering, and textbuf grows at most once per line. The line must
+ * still be copied, because the filters and tokenizers modify textbuf
+ * in place.
+ */
+bool_t fill_textbuf_from_memory(const char **pbuf, const char *end, 
+				int *extra_lines) {
+  const char *eol;
+  charbuf_len_t l;
+
+  if( !(cmd & (1<<CMD_QUITNOW)) && (*pbuf < end) ) {
+    process_pending_signal(NULL);
+
+    eol = (const char *)memchr(*pbuf, '\n', end - *pbuf);
+    eol = eol ? eol + 1 : end;
+    l = (charbuf_len_t)(eol - *pbuf);
+
+    if( l >= textbuf_len ) {
+      /* grow in one step, but still geometrically */
+      textbuf_len = (l < 2 * textbuf_len) ? 2 * textbuf_len : l + 1;
+      textbuf = (char *)realloc(textbuf, textbuf_len);
+      if( !textbuf ) {
+	fprintf(stderr, 
+		"error: not enough memory for input line (%d bytes)\n",
+		textbuf_len);
+	exit_fatal();
+      }
+      MADVISE(textbuf, sizeof(char) * textbuf_len, MADV_SEQUENTIAL);
+    }
+
+    memcpy(textbuf, *pbuf, l);
+    textbuf[l] = '\0';
+    *pbuf = eol;
     return 1;
   } else if( *extra_lines > 0 ) {
     strcpy(textbuf, "\r\n");
@@ -428,8 +629,7 @@ bool_t fill_wc_textbuf(char *pptextbuf, mbstate_t *shiftstate) {
 	      "error: not enough memory for wide character conversion "
 	      "(%ld bytes)\n",
 	      (long int)(wc_textbuf_len * sizeof(wchar_t)));
-      cleanup_tempfiles();
-      exit(1);
+      exit_fatal();
     }
 
     MADVISE(wc_textbuf, sizeof(wchar_t) * wc_textbuf_len, MADV_SEQUENTIAL);
@@ -27,6 +27,8 @@
 /* external commands */
 #define CMD_QUITNOW                     1
 #define CMD_RELOAD_CATS                 2
+/* input state */
+#define CMD_END_OF_MESSAGE              3
 
 /* in gcc, most calls to extern inline functions are inlined */
 
@@ -50,6 +52,47 @@ hash_value_t hash_full_token(const char *tok);
 hash_value_t hash_partial_token(const char *tok, int len, 
 				const char *extra);
 
+/* the learner, category and empirical hashes all use linear probing,
+   with a separate array of one control byte per slot so a probe can
+   skip over a group of slots without touching the items. A control
+   byte is 0 for an empty slot, otherwise the top 7 bits of the id
+   with the high bit set. The first HCTRL_GROUP bytes are mirrored at
+   the end, so a group can always be read in one piece. While the
+   learner hash grows, a slot can also be a tombstone, which a probe
+   walks past like a filled slot. */
+#define HCTRL_GROUP 8
+#define HCTRL_DELETED ((byte_t)1)
+#define HCTRL_TAG(id) ((byte_t)(0x80 | ((id) >> (8 * sizeof(hash_value_t) - 7))))
+byte_t *new_hash_ctrl(hash_count_t max_tokens);
+void mirror_hash_ctrl(byte_t *ctrl, hash_count_t max_tokens);
+hash_count_t probe_hash_ctrl(const byte_t *ctrl, hash_count_t max_tokens,
+			     hash_value_t id, hash_value_t key,
+			     const byte_t *items, size_t size, size_t idoff);
+
+/* these are called once per slot when a table is rebuilt, so they
+   must be inlined */
+
+/* sets the control byte of slot n and its mirrors */
+static __inline__
+void set_hash_ctrl_byte(byte_t *ctrl, hash_count_t max_tokens, 
+			hash_count_t n, byte_t c) {
+  size_t j;
+
+  ctrl[n] = c;
+  /* tables smaller than a group are mirrored several times */
+  for(j = (size_t)n + max_tokens; j < (size_t)max_tokens + HCTRL_GROUP; 
+      j += max_tokens) {
+    ctrl[j] = c;
+  }
+}
+
+/* records that slot n now holds id (or is empty if id is zero) */
+static __inline__
+void set_hash_ctrl(byte_t *ctrl, hash_count_t max_tokens, 
+		   hash_count_t n, hash_value_t id) {
+  set_hash_ctrl_byte(ctrl, max_tokens, n, id ? HCTRL_TAG(id) : 0);
+}
+
 /* this should make them as fast as a macro */
 digitized_weight_t digitize_a_weight(weight_t w, token_order_t o);
 weight_t undigitize_a_weight(digitized_weight_t d, token_order_t o);
@@ -74,9 +117,15 @@ void cleanup_signal_handling();
 void init_buffers();
 void cleanup_buffers();
 void cleanup_tempfiles();
+void exit_fatal();
+FILE *mytmpfile(const char *tmplate, char **tmpname);
+bool_t myrename(const char *src, const char *dest);
 void set_iobuf_mode(FILE *input);
 
+bool_t unstuff_textbuf();
 bool_t fill_textbuf(FILE *input, int *extra_lines);
+bool_t fill_textbuf_from_memory(const char **pbuf, const char *end, 
+				int *extra_lines);
 #if defined HAVE_MBRTOWC
 bool_t fill_wc_textbuf(char *pptextbuf, mbstate_t *shiftstate);
 #endif